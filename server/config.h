@@ -50,11 +50,18 @@ If you do not wish to proceed with the registration issue a QUIT command.\r\n\
 #define REGUSER_PROGRAM        PROGLIB_DIR "regusermail"
 #define DAEMON_PROGRAM         PROGLIB_DIR "rgtpd"
 #define UDBM_PROGRAM           ADMINBIN_DIR "udbmanage"
+#define NETSTAT_FILENAME       "/proc/net/netstat"
 
 /* Spool filename prefixes and suffixes */
 #define SPOOL_DIR              "/tmp/spool/"
 #define EDITED_FILENAMESFX     ".edited"
 #define WITHDRAWN_FILENAMESFX  ".withdrawn"
+#define WIRE_FILENAMESFX       ".wire"
+#define KEYS_FILENAMESFX       ".keys"
+#define DEFLATED_FILENAMESFX   ".wire.z"
+#define XREF_DIR               "xref/"
+#define INDEXSEG_DIR           "indexseg/"
+#define ITEMPACK_DIR           "itempack/"
 
 /* Filenames relative to the spool directory */
 #define EDITLOCK_FILENAME      "editlock"
@@ -67,6 +74,13 @@ If you do not wish to proceed with the registration issue a QUIT command.\r\n\
 #define MOTD_FILENAME          "motd"
 #define RANDOMSTUFF_FILENAME   "secretseed"
 #define USERDB_FILENAME        "userdatabase"
+#define XREF_STAMP             XREF_DIR "stamp"
+#define XREF_TABLE             XREF_DIR "table"
+#define XREF_POSTINGS          XREF_DIR "postings"
+#define XREF_RECENT            XREF_DIR "recent"
+#define INDEXSEG_MANIFEST      INDEXSEG_DIR "manifest"
+#define ITEMPACK_TABLE         ITEMPACK_DIR "table"
+#define ITEMMETA_FILENAME      "itemmeta"
 
 /* You might want to change these */
 #define DATESTRING_FORMAT    "%H.%M on %a %d %b"
@@ -81,6 +95,39 @@ If you do not wish to proceed with the registration issue a QUIT command.\r\n\
 #define INACTIVITY_TIMEOUT       3600   /* in seconds, so 60 minutes */
 #define EDITORINACTIVITY_TIMEOUT 1200   /* in seconds, so 20 minutes */
 #define DATA_TIMEOUT              300   /* in seconds, so 5 minutes */
+#define WAIT_TIMEOUT               60   /* seconds WAIT waits if not told */
+#define WAIT_MAXTIMEOUT           600   /* longest WAIT; must be less than the above */
+#define WAIT_POLL                   1   /* seconds between WAIT's looks if there's no mirror */
+#define LISTEN_BACKLOG            128   /* connections the kernel may queue for us */
+#define POOL_TICK                   1   /* seconds between worker pool checks */
+#define ENGINE_TICK                 1   /* seconds between -multiplex housekeeping */
+#define ENGINE_MAXEVENTS           64   /* epoll events handled per wait */
+#define ENGINE_OUTBUF           16384   /* stdio buffer for -multiplex responses */
+#define SESSION_INBUF            4096   /* client input read at once, for pipelining; *
+                                        * must be > INPUTLINE_MAXLEN */
+#define SESSION_OUTBUF          16384   /* stdio buffer for forked sessions' responses */
+#define PARK_TICK                   1   /* seconds between parked session timeout checks */
+#define ACCEPTORS_MAX              64   /* most -acceptors we'll run */
+#define SUPERVISOR_TICK             1   /* seconds between -acceptors checks */
+#define ACCEPTQ_CHECK              60   /* seconds between accept queue reports */
+#define NETSTATLINE_MAXLEN       8192   /* longest line in NETSTAT_FILENAME */
+#define WIRE_READBUF             8192   /* bytes read at once making a wire-format twin */
+#define INDEXMIRROR_RECORDS      1024   /* recent index entries kept in shared memory */
+#define INDEXMIRROR_TRIES           5   /* times INDX retries the mirror before the file */
+#define INDEXSEG_RECORDS         4096   /* index entries in a sealed segment */
+#define INDEXDIFF_CONTEXT           3   /* lines of context diff --unified gives */
+#define KEYS_READRECORDS           64   /* index entries read at once making a companion */
+#define XREF_RECENTMAX            512   /* postings added before they're all remade */
+#define ITEMPACK_TRIES              5   /* times a reader looks again if compaction moves an item */
+#define ITEMPACK_MAXSEGS           16   /* item pack segments allowed before they're merged */
+#define ITEMMETA_TRIES              5   /* times a reader retries the item summaries */
+#define ITEMMETA_MINSLOTS        1024   /* smallest item summary table; a power of two */
+#define ITEMMETA_MARKS             16   /* contribution markers kept in each item summary */
+#define DEFLATE_LEVEL               6   /* zlib compression level for COMP DEFLATE */
+#define DEFLATE_BUF             16384   /* bytes deflated at once */
+#define ADMIT_HASHSIZE           1021   /* buckets in admission control tables */
+#define ADMIT_LOGINTERVAL          60   /* seconds between rejection reports */
+#define STATS_LOGINTERVAL        3600   /* seconds between session accounting totals */
 #define DEFAULT_ACCESS    al_write
 #define DEFAULT_SECRETBYTES   8         /* MUST be <= SECRET_MAXBYTES */
 #define RANDOMSTUFF_LOW     128         /* min amount of random to keep */
@@ -105,6 +152,18 @@ If you do not wish to proceed with the registration issue a QUIT command.\r\n\
 #define TCPPORT_DEFAULT       TCPPORT_RGTP
 #define ITEM_MAXFILENAMELEN   (sizeof(ITEM_FILENAMEPFX)+ITEMID_LEN)
 #define INDEXENTRY_LENINF     (INDEXENTRY_LEN+1)
+#define XREF_KEYLEN           (USERID_MAXLEN+1)
+#define XREF_PADLEN           (1+USERID_MAXLEN) /* kind, then key padded with spaces */
+#define XREF_ENTRYLEN         (XREF_PADLEN+21) /* "kkey offset count\n" */
+#define XREF_RECENTLEN        (XREF_PADLEN+10) /* "kkey sequence\n" */
+#define INDEXSEG_MAXFILENAMELEN (sizeof(INDEXSEG_DIR)+16)
+#define WIRE_MAXFILENAMELEN   ((ITEM_MAXFILENAMELEN > INDEXSEG_MAXFILENAMELEN ? \
+                                ITEM_MAXFILENAMELEN : INDEXSEG_MAXFILENAMELEN) + \
+                               sizeof(WIRE_FILENAMESFX))
+#define KEYS_MAXFILENAMELEN   (INDEXSEG_MAXFILENAMELEN+sizeof(KEYS_FILENAMESFX))
+#define DEFLATED_MAXFILENAMELEN (WIRE_MAXFILENAMELEN+sizeof(DEFLATED_FILENAMESFX))
+#define ITEMPACK_MAXFILENAMELEN (sizeof(ITEMPACK_DIR)+16)
+#define ITEMPACK_ENTRYLEN     (ITEMID_LEN+32) /* "id seg offset length\n" */
 
 #define UMASK_ADD             007 /* deny rwx to other */
 
@@ -26,49 +26,98 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <setjmp.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/times.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/memfd.h>
+#include <dirent.h>
+#include <strings.h>
+
+#include <zlib.h>
 
 #include "config.h"
 #include "ehandle.h"
 #include "md5.h"
 #include "userdb.h"
 #include "misc.h"
+#include "indexscan.h"
 
 /* Global variables (may be modified by server after forking children) */
 static int debugserver;           /* number of times we were given the -debug flag */
 /* debug=1 means standard interactive debug, debug=2 means noninteractive logged   */
 static unsigned long servseq;     /* serial number for each server subprocess      */
-struct sockaddr_in calleraddr;    /* child's server socket peer (client) address   */
+struct sockaddr_in calleraddr;    /* peer address of the connection just accepted  */
 static sig_atomic_t wantrestart;  /* caught a SIGUSR2 - restart when convenient    */
 static long mypid;                /* for use in messages, &c                       */
-
-/* Per-session variables */
-static int debuglevel;            /* how much debugging - range from 0 to 9; only   *
-                                   * available if the dangerous -debug switch       *
-                                   * was given.                                     */
-static int supertrace;            /* log all commands and responses from now on     */
+static long daemonpid;            /* process which KILL and KILR should signal     */
+static int poolmin, poolmax;      /* -pool: number of idle workers to keep between; *
+                                   * poolmin==0 means fork for each connection      */
+static int multiplex;             /* -multiplex: serve all sessions in one process  */
+static int nwaiting;              /* -multiplex: sessions in the middle of a WAIT   */
+static int acceptors;             /* -acceptors: number of listening processes      */
+static int isacceptor;            /* we're one of those, started by daemonpid       */
+static int backlog= LISTEN_BACKLOG; /* -backlog: for listen()                       */
+static int parktime;              /* -park: seconds idle before parking a session   */
+static long parkerpid;            /* our parking process, or 0                      */
+static long parentpid;            /* in the parking process, the daemon             */
+static int statspipe[2]= { -1, -1 }; /* session accounting: [0] daemon, [1] servers */
 static unsigned int alarmclosefd; /* on SIGALRM close this fd and set to -1         */
 static int slave;                 /* per-client socket fd                           */
 static int port;                  /* port we are listening or must listen on        */
-static char clientid[100];        /* client's IP number and port, for logging       */
-static char loglinebuf[INPUTLINE_MAXLEN+5]; /* use this to log the cmd line if we   *
+
+/*
+ * Per-session state
+ *
+ * In the usual fork-per-connection arrangement there is exactly one
+ * of these in each server process.  With -multiplex one process keeps
+ * a list of them and points sess at the one whose command it is
+ * running, so the command implementations below always use sess.
+ */
+
+struct session {
+  struct session *next;           /* next in list of all sessions in this process */
+  int fd;                         /* client socket fd                              */
+  unsigned long servseq;          /* serial number of this session                 */
+  struct sockaddr_in calleraddr;  /* client's address                              */
+  char clientid[100];             /* client's IP number and port, for logging      */
+  int debuglevel;                 /* how much debugging - range from 0 to 9; only   *
+                                   * available if the dangerous -debug switch       *
+                                   * was given.                                     */
+  int supertrace;                 /* log all commands and responses from now on     */
+  char loglinebuf[INPUTLINE_MAXLEN+5]; /* use this to log the cmd line if we        *
                                    * decide we want to somewhere; empty string      *
                                    * means we've already logged this command        */
+  int identdone;                  /* we've already done an Ident lookup            */
+  time_t started;                 /* when the client connected                     */
+  unsigned long commands;         /* how many command lines they've sent           */
+  struct timeval utime, stime;    /* CPU charged to the session other than by this *
+                                   * process's own getrusage (before it was parked,*
+                                   * or, with -multiplex, all of it)                */
+  long maxrss;                    /* largest RSS of any earlier process, in kB     */
 
 /*
  * Continuation/reply/edit states:
@@ -82,18 +131,18 @@ static char loglinebuf[INPUTLINE_MAXLEN+5]; /* use this to log the cmd line if w
  * lenbeforeedit	-1	-1	-1	-1	set	set	
  */
 
-static int maycontinue; 		  /* a continuation (CONT) is allowed now,   *
-                                           * 0 for false or 1 for true.              */
-static char saveditemid[ITEMID_LEN+1]=""; /* itemid which may be continued (if       *
-					   * maycontinue is set) or which is being   *
-                                           * edited (if lenbeforeedit != -1) or the  *
-                                           * empty string (if we're editing the      *
-                                           * index (again, lenbeforeedit != -1).     */
-static FILE *edit=0;                      /* open filehandle onto the edit lock file *
-                                           * if we have an EDLK, otherwise NULL      */
-static unsigned long lenbeforeedit= -1;   /* -1 if we are not editing anything; if   *
-                                           * we are this is the length it was when   *
-                                           * we sent it in response to EDIT or EDIX. */
+  int maycontinue; 		  /* a continuation (CONT) is allowed now,   *
+                                   * 0 for false or 1 for true.              */
+  char saveditemid[ITEMID_LEN+1]; /* itemid which may be continued (if       *
+				   * maycontinue is set) or which is being   *
+                                   * edited (if lenbeforeedit != -1) or the  *
+                                   * empty string (if we're editing the      *
+                                   * index (again, lenbeforeedit != -1).     */
+  FILE *edit;                     /* open filehandle onto the edit lock file *
+                                   * if we have an EDLK, otherwise NULL      */
+  unsigned long lenbeforeedit;    /* -1 if we are not editing anything; if   *
+                                   * we are this is the length it was when   *
+                                   * we sent it in response to EDIT or EDIX. */
 
 /*
  * Registration/user login/access control states:
@@ -109,35 +158,64 @@ static unsigned long lenbeforeedit= -1;   /* -1 if we are not editing anything;
  * servernonce       ?              ?              set            ?
  */
 
-static int registration;                /* We have accepted a REGU (0=false, 1=TRUE. */
-static enum accesslevel alevel;         /* The currently allowed access level.       */
-static char userid[USERID_MAXLEN+1]=""; /* The userid claimed by the client.         */
-struct userentry identue;               /* User database structure corresponding to  *
-                                         * username and access level claimed by user *
-                                         * if we're doing an authentication.  If not *
-                                         * .userid is "" and other fields undefined. */
-unsigned char servernonce[16];          /* If we're doing an auth, our nonce.        */
+  int registration;               /* We have accepted a REGU (0=false, 1=TRUE. */
+  enum accesslevel alevel;        /* The currently allowed access level.       */
+  char userid[USERID_MAXLEN+1];   /* The userid claimed by the client.         */
+  struct userentry identue;       /* User database structure corresponding to  *
+                                   * username and access level claimed by user *
+                                   * if we're doing an authentication.  If not *
+                                   * .userid is "" and other fields undefined. */
+  unsigned char servernonce[16];  /* If we're doing an auth, our nonce.        */
 
 /*
  * Data submission states:
- *                Initial/       Item/          Edited         Edited
- *                No data        reply          Index          Item
- *                -------------- -------------- -------------- --------------
- * data           NULL           set            set            set
- * grogname       ?              set            ""             status (ignored)
- * dstab          ?              set            set            set
+ *                Initial/       Receiving      Item/          Edited         Edited
+ *                No data        data           reply          Index          Item
+ *                -------------- -------------- -------------- -------------- --------------
+ * data           NULL           set            set            set            set
+ * indata         false          TRUE           false          false          false
+ * grogname       ?              set            set            ""             status (ignored)
+ * dstab          ?              ?              set            set            set
  */
 
-static FILE *data=0;                      /* If DATA has been sent, the open file    *
-                                           * containing the data, otherwise NULL.    */
-static char grogname[INPUTLINE_MAXLEN+5]; /* The grogname in item or reply DATA;     *
-                                           * "" for revised (edited) index data;     *
-                                           * the status line (which will be ignored  *
-                                           * by EDCF) for revised item data;         *
-                                           * undefined if no data sent.              */
-static struct stat dstab;                 /* If data has been sent, the result of    *
-                                           * fstat on the data file after writing    *
-                                           * the data to it, otherwise undefined.    */
+  FILE *data;                     /* If DATA has been sent, the open file    *
+                                   * containing the data, otherwise NULL.    */
+  char grogname[INPUTLINE_MAXLEN+5]; /* The grogname in item or reply DATA;  *
+                                   * "" for revised (edited) index data;     *
+                                   * the status line (which will be ignored  *
+                                   * by EDCF) for revised item data;         *
+                                   * undefined if no data sent.              */
+  struct stat dstab;              /* If data has been sent, the result of    *
+                                   * fstat on the data file after writing    *
+                                   * the data to it, otherwise undefined.    */
+  int indata;                     /* We're reading lines after DATA; 2 if    *
+                                   * they're a DATA REPL/NEWI we've refused. */
+  int datafirstline;              /* The next data line is the grogname or   *
+                                   * item status line.                       */
+  const char *dataerror;          /* Response to give at the end of the data *
+                                   * instead of 350, or 0.                   */
+  char dataerbuf[INDEXENTRY_LENINF+100]; /* dataerror may point here.        */
+  char datacmd[INPUTLINE_MAXLEN+5]; /* DATA REPL/NEWI: the command to run at *
+                                   * the end of the data, or "".             */
+
+  /* Input and output */
+  char inbuf[SESSION_INBUF];      /* received but not yet processed           */
+  int inlen;                      /* number of bytes in inbuf                 */
+  int skipping;                   /* discarding the rest of an overlong line  */
+  time_t lastinput;               /* -multiplex: when we last heard from them */
+  int outfd;                      /* -multiplex: responses not yet sent, or -1 */
+  off_t outdone, outlen;          /* -multiplex: how much of outfd is sent    */
+  int closing;                    /* -multiplex: close when out is sent       */
+  struct ipentry *ip;             /* -multiplex: for admitdone                */
+  int deflate;                    /* COMP DEFLATE: send data responses deflated */
+  int waiting;                    /* -multiplex: 1 in WAIT, 2 when its reply is due */
+  long waitfor;                   /* WAIT: the sequence number awaited         */
+  time_t waituntil;               /* WAIT: when to give up                     */
+  int waitword;                   /* -multiplex: mirror->wake when we last looked */
+};
+
+static struct session *sess;      /* session whose command we're running now     */
+static struct session *sessions;  /* all the sessions in this process            */
 
 /*
  * Errorhandling
@@ -162,6 +240,9 @@ static time_t gettime(void) {
 static void tcpident(void);
 static void checkstderr(void);
 static void setsupertrace(void);
+static void endsession(void);
+static void clientflush(void);
+static void statsreport(struct session *s, int self);
 
 static void vlog(enum loglevel level, const char *fmt, va_list al) {
   struct tm *tmp;
@@ -178,7 +259,7 @@ static void vlog(enum loglevel level, const char *fmt, va_list al) {
   }
   strftime(buf,99,"%d.%m.%y %H:%M:%S %Z",tmp); buf[99]=0;
 
-  fprintf(stderr, "%s %s groggsd%ld %s : ", buf, loglevels[level], mypid, clientid);
+  fprintf(stderr, "%s %s groggsd%ld %s : ", buf, loglevels[level], mypid, sess ? sess->clientid : "");
   vfprintf(stderr,fmt,al);
   fputc('\n',stderr);
   fflush(stderr);
@@ -210,7 +291,7 @@ void ohshite(const char *fmt, ...) {
   va_end(al);
   log(ll_error,"%s (%d- %s)",buf,esave,strerror(esave));
   fprintf(stdout,"484 Server system error: %s (%s)\r\n",buf,strerror(esave));
-  exit(0);
+  endsession();
 }
 
 void ohshit(const char *fmt, ...) {
@@ -222,13 +303,13 @@ void ohshit(const char *fmt, ...) {
   va_end(al);
   log(ll_error,"%s",buf);
   fprintf(stdout,"484 Server internal error: %s\r\n",buf);
-  exit(0);
+  endsession();
 }
 
 static void ensurelogcmdline(void) {
-  if (!*loglinebuf) return;
-  log(ll_debug,"<< %s",loglinebuf);
-  *loglinebuf=0;
+  if (!*sess->loglinebuf) return;
+  log(ll_debug,"<< %s",sess->loglinebuf);
+  *sess->loglinebuf=0;
 }
 
 static void protocolviolation(const char *string) {
@@ -252,8 +333,10 @@ static char *makedatestring(time_t thetime) {
 }
 
 static void sigpipehandler(void) {
+  if (multiplex) return; /* the write will fail with EPIPE instead */
   log(ll_trace,"Broken pipe, closing");
   fflush(stderr);
+  if (sess && statspipe[1] != -1) statsreport(sess,1); /* as endsession */
   _exit(0);
 }
 
@@ -262,22 +345,36 @@ void sigalrmhandler(void);
 void settimeout(int fd, int timeout) {
   alarmclosefd= fd;
   signal(SIGALRM,&sigalrmhandler);
+  alarm(timeout);
+}
+
+static jmp_buf sessionabort;      /* -multiplex: endsession() comes back here */
+
+static void endsession(void) {
+  /* The client's connection is to be closed after whatever we've
+   * already said.  Does not return. */
+  if (!multiplex || !sess) {
+    if (sess && statspipe[1] != -1) statsreport(sess,1);
+    exit(0);
+  }
+  longjmp(sessionabort,1);
 }
 
 static void wastimeout(void) {
   log(ll_trace,"timeout, closing");
   fputs("481 Timeout awaiting input - closing connection.\r\n",stdout);
-  exit(0);
+  endsession();
 }
 
 void sigalrmhandler(void) {
-  int e, nfd;
+  int e, fd, nfd;
   e= errno;
-  close(alarmclosefd);
+  fd= alarmclosefd;
+  close(fd);
   alarmclosefd= -1;
   nfd= open("/dev/null",O_RDONLY);
-  if (nfd >= 0 && nfd != alarmclosefd) {
-    dup2(nfd,alarmclosefd);
+  if (nfd >= 0 && nfd != fd) {
+    dup2(nfd,fd);
     close(nfd);
   }
   signal(SIGPIPE,sigpipehandler);
@@ -297,6 +394,26 @@ static void skipspace(char **cmdp) {
   while (**cmdp == ' ') (*cmdp)++;
 }
 
+static int ifchanged(const char *cmd, long *sincer) {
+  /* ITEM, MOTD and INDX may end with IF #seq, and then answer with
+   * notchanged rather than send it all again if nothing has changed
+   * since seq.  Sets *sincer to seq, or to -1 if cmd is empty;
+   * returns 0 if cmd is anything else, having said so. */
+  char *estr;
+
+  *sincer= -1;
+  if (!*cmd) return 1;
+  if (!strncasecmp(cmd,"IF #",4)) {
+    *sincer= strtol(cmd+4,&estr,16);
+    if (estr != cmd+4 && !*estr && *sincer >= 0) return 1;
+  }
+  protocolviolation("511 Only IF #sequence number may follow."); return 0;
+}
+
+static void notchanged(long last) {
+  printf("213 %08lX  Not changed since then.\r\n",last);
+}
+
 static void id2file(const char *id, char *file) {
   strcpy(file,ITEM_FILENAMEPFX);
   strcat(file,id);
@@ -358,7 +475,7 @@ static char *getitemid(char *cmd) {
   if (*cmd) {
     protocolviolation("511 Garbage after 8 characters of Item-ID."); return 0;
   }
-  maycontinue= 0; /* Cancel any pending CONT possibility */
+  sess->maycontinue= 0; /* Cancel any pending CONT possibility */
   *p++= 0;
   return buf;
 }
@@ -398,13 +515,12 @@ static void setstatus(int ns, const char *msg) {
   static const char *const statusstrings[]= {
     "no access yet","no posting","posting ok","editor"
   };
-  alevel= ns;
-  log(ll_trace,"%s (%s)",msg,statusstrings[alevel]);
-  printf("23%d %s (%s)\r\n",alevel,msg,statusstrings[alevel]);
+  sess->alevel= ns;
+  log(ll_trace,"%s (%s)",msg,statusstrings[sess->alevel]);
+  printf("23%d %s (%s)\r\n",sess->alevel,msg,statusstrings[sess->alevel]);
 }
 
-static void tcpident(void) {
-  static int done=0;
+static void identlookup(void) {
   int tcpidents;
   struct sockaddr_in tcpidenta;
   fd_set wfds;
@@ -412,9 +528,7 @@ static void tcpident(void) {
   char buf[TCPIDENTLINE_MAXLEN+5];
   int flags, nfds, l, i;
 
-  if (done) return;
-  done=1;
-  tcpidenta= calleraddr;
+  tcpidenta= sess->calleraddr;
   tcpidenta.sin_port= htons(TCPPORT_IDENT);
   tcpidents= socket(AF_INET,SOCK_STREAM,0);
   if (tcpidents<0) ohshite("Failed to create Ident socket");
@@ -448,7 +562,7 @@ static void tcpident(void) {
       close(tcpidents); return;
     }
   }
-  sprintf(buf,"%d, %d\r\n",ntohs(calleraddr.sin_port),port);
+  sprintf(buf,"%d, %d\r\n",ntohs(sess->calleraddr.sin_port),port);
   flags &= ~O_NDELAY;
   if (fcntl(tcpidents,F_SETFL,flags)==-1) ohshite("Failed fcntl reset flags");
   signal(SIGPIPE,SIG_IGN);
@@ -473,1678 +587,6116 @@ static void tcpident(void) {
   log(ll_ident,"Ident response `%s'%s",buf,alarmclosefd==-1 ? " (timed out)" : "");
 }
 
+static void closeabove(int lowfd) {
+  /* Closes every fd from lowfd up; in one go if the kernel can, as the
+   * limit may be a million or so. */
+  long fd, maxfd;
+
+#ifdef SYS_close_range
+  if (!syscall(SYS_close_range,(unsigned)lowfd,~0U,0)) return;
+#endif
+  maxfd= sysconf(_SC_OPEN_MAX);
+  for (fd=lowfd; fd<maxfd; fd++) close(fd);
+}
+
+static void tcpident(void) {
+  /* The lookup is done in a detached grandchild, which logs the answer
+   * when it gets one; we don't wait for it. */
+  int child, status;
+
+  if (sess->identdone) return;
+  sess->identdone=1;
+  child= fork();
+  if (child == -1) { loge(ll_ident,"Failed to fork for Ident lookup"); return; }
+  if (!child) {
+    child= fork();
+    if (child == -1) loge(ll_ident,"Failed to fork for Ident lookup");
+    if (child) _exit(0);
+    multiplex= 0; statspipe[1]= -1; /* so that endsession() just exits */
+    close(0); close(1); closeabove(3);
+    if (open("/dev/null",O_RDWR) != 0 || dup(0) != 1) _exit(1);
+    identlookup();
+    _exit(0);
+  }
+  while (waitpid(child,&status,0) == -1 && errno == EINTR);
+}
+
 static void setsupertrace(void) {
-  if (supertrace) return;
+  if (sess->supertrace) return;
   ensurelogcmdline();
   log(ll_trace,"(Supertrace enabled.)");
-  supertrace=1;
+  sess->supertrace=1;
 }
 
 static int editing(void) {
-  if (lenbeforeedit != -1) return 1;
+  if (sess->lenbeforeedit != -1) return 1;
   protocolviolation("500 No EDIT in progress."); return 0;
 }
 
 static int datadone(void) {
-  if (data) return 1;
+  if (sess->data) return 1;
   protocolviolation("500 Need DATA first."); return 0;
 }
 
 static int noeditinprogress(void) {
-  if (lenbeforeedit==-1) return 1;
+  if (sess->lenbeforeedit==-1) return 1;
   protocolviolation("500 EDIT/EDIX still outstanding."); return 0;
 }
 
-static void skiptonewline(void) {
-  int c;
-  while ((c= getchar()) != EOF && c != '\n');
-  if (c!=EOF) return;
-  if (alarmclosefd == -1) wastimeout();
-  if (ferror(stdin)) loge(ll_trace,"Connection died in very long line, closing");
-  else log(ll_trace,"EOF during very long line, closing");
-  exit(0);
-}
-
-static void copyfile(FILE *file, const char *filename) {
+static void copyfile(FILE *file, const char *filename, FILE *out) {
   char buf[INPUTLINE_MAXLEN+5];
   int l;
 
-  fputs("250 Data follows\r\n",stdout);
   while (fgets(buf,INPUTLINE_MAXLEN,file)) {
     l= strlen(buf);
     if (!l || buf[l-1] != '\n')
       ohshit("File containing %s is corrupted",filename);
-    if (buf[0]=='.') fputc('.',stdout);
-    fwrite(buf,1,l-1,stdout);
-    fputs("\r\n",stdout);
+    if (buf[0]=='.') fputc('.',out);
+    fwrite(buf,1,l-1,out);
+    fputs("\r\n",out);
   }
   if (ferror(file)) ohshite("Error reading %s",filename);
-  fputs(".\r\n",stdout);
 }
-     
-static void noitem(const char *id) {
-  printf("410 Item %s does not exist or has been archived.\r\n",id);
-  return;
+
+/*
+ * Wire-format twins
+ *
+ * Items, the index, the MOTD and the edit log are read far more often
+ * than they are written, so next to each we keep a twin (with
+ * WIRE_FILENAMESFX) holding its contents just as copyfile would send
+ * them: dot-stuffed, with CRLF line endings.  The twin starts with a
+ * struct wirekey describing the file it was made from; if that no
+ * longer matches, the twin is stale and we make a new one.  The
+ * writers keep the twins up to date, but anyone can make one, so a
+ * missing or stale twin costs only a render.
+ *
+ * Beware: we mustn't close any fd on a file we have locked, as that
+ * would drop the lock; so these functions are given the fd to read.
+ */
+
+struct wirekey {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtimensec;
+};
+
+static void statwirekey(const struct stat *stab, struct wirekey *k) {
+  memset(k,0,sizeof(*k));
+  k->dev= stab->st_dev;
+  k->ino= stab->st_ino;
+  k->size= stab->st_size;
+  k->mtime= stab->st_mtim.tv_sec;
+  k->mtimensec= stab->st_mtim.tv_nsec;
 }
 
-static void copycontrib(FILE *item, const char *destid) {
-  /* copies data to the destination and closes both */
-  int c;
-  
-  while ((c= fgetc(data)) != EOF) {
-    if (fputc(c,item)==EOF)
-      ohshite("AARGH! Failed to write all of reply to %s", destid);
+static int getwirekey(int fd, struct wirekey *k) {
+  struct stat stab;
+
+  if (fstat(fd,&stab)) return -1;
+  statwirekey(&stab,k);
+  return 0;
+}
+
+static void wirefilename(char *buf, const char *name) {
+  strcpy(buf,name);
+  strcat(buf,WIRE_FILENAMESFX);
+}
+
+static int wireline(int c, int *linelenp, FILE *out) {
+  /* Renders one character; returns -1 if copyfile would reject the file. */
+  if (c == '\n') {
+    *linelenp= 0;
+    return putc('\r',out) == EOF || putc('\n',out) == EOF ? -1 : 0;
   }
-  if (ferror(data))
-    ohshite("AARGH! Failed to read all of reply file for %s",destid);
-  fclose(data); data=0;
-  if (fclose(item))
-    ohshite("AARGH! Failed to close %s after reply",destid);
+  if (!c || ++*linelenp > INPUTLINE_MAXLEN-2) return -1;
+  if (*linelenp == 1 && c == '.' && putc('.',out) == EOF) return -1;
+  return putc(c,out) == EOF ? -1 : 0;
 }
 
-static void indexentry(FILE *index, unsigned long sequence,
-                       long timestamp, const char *refid,
-                       int type, const char *subject) {
-  /* makes an index entry */
-  char indexbuf[INDEXENTRY_LENINF+5];
-  int l;
+static int wirerender(int fd, const char *name) {
+  /* Makes a new twin for name, whose contents can be read from fd.
+   * Returns 0, or -1 if we couldn't (perhaps because name isn't fit to
+   * send, in which case copyfile will complain about it). */
+  char wire[WIRE_MAXFILENAMELEN+5];
+  char tmp[sizeof(wire)+30];
+  char buf[WIRE_READBUF];
+  struct wirekey k;
+  FILE *out;
+  off_t pos;
+  int n, i, linelen;
+
+  wirefilename(wire,name);
+  sprintf(tmp,"%s.%ld",wire,(long)getpid());
+  if (getwirekey(fd,&k)) { loge(ll_error,"Failed to fstat to make wire format"); return -1; }
+  out= fopen(tmp,"w");
+  if (!out) { loge(ll_error,"Failed to create wire format file"); return -1; }
+  if (fwrite(&k,sizeof(k),1,out) != 1) goto x_error;
+  linelen= 0;
+  for (pos=0; pos<k.size; pos+=n) {
+    n= pread(fd,buf, k.size-pos < sizeof(buf) ? k.size-pos : sizeof(buf), pos);
+    if (n<0 && errno == EINTR) { n= 0; continue; }
+    if (n<=0) goto x_error;
+    for (i=0; i<n; i++)
+      if (wireline(buf[i],&linelen,out)) goto x_unfit;
+  }
+  if (linelen) goto x_unfit;
+  if (fclose(out)) { out= 0; goto x_error; }
+  if (rename(tmp,wire)) { loge(ll_error,"Failed to install wire format file"); unlink(tmp); return -1; }
+  return 0;
 
-  sprintf(indexbuf,"%08lX %08lX",sequence,timestamp);
-  memset(indexbuf+17,' ',INDEXENTRY_LENINF-17-1);
-  memcpy(indexbuf+18,refid,ITEMID_LEN);
-  memcpy(indexbuf+19+ITEMID_LEN,userid,strlen(userid));
-  indexbuf[20+ITEMID_LEN+USERID_MAXLEN]= type;
+ x_error:
+  loge(ll_error,"Failed to write wire format file");
+ x_unfit:
+  if (out) fclose(out);
+  unlink(tmp); unlink(wire);
+  return -1;
+}
 
-  l= strlen(subject);
-  if (l > SUBJECTININDEX_MAXLEN) {
-    memcpy(indexbuf+22+ITEMID_LEN+USERID_MAXLEN, subject, SUBJECTININDEX_MAXLEN-3);
-    memcpy(indexbuf+22+ITEMID_LEN+USERID_MAXLEN+SUBJECTININDEX_MAXLEN-3, "...", 3);
-  } else {
-    memcpy(indexbuf+22+ITEMID_LEN+USERID_MAXLEN, subject, l);
+static void wirerenderfile(const char *name) {
+  /* For a file we haven't got locked (or have already lost the lock on). */
+  int fd;
+
+  fd= open(name,O_RDONLY);
+  if (fd == -1) { loge(ll_error,"Failed to open file to make wire format"); return; }
+  wirerender(fd,name);
+  close(fd);
+}
+
+static void wireappend(int fd, const char *name, const struct wirekey *before) {
+  /* Brings the twin up to date after something has been appended to
+   * name, which looked like *before until then. */
+  char wire[WIRE_MAXFILENAMELEN+5];
+  char buf[WIRE_READBUF];
+  struct wirekey k, oldk;
+  FILE *out;
+  off_t pos;
+  int n, i, linelen;
+
+  wirefilename(wire,name);
+  out= fopen(wire,"r+");
+  if (!out ||
+      fread(&oldk,sizeof(oldk),1,out) != 1 || memcmp(&oldk,before,sizeof(oldk)) ||
+      getwirekey(fd,&k) || fseek(out,0,SEEK_END)) {
+    if (out) fclose(out);
+    wirerender(fd,name);
+    return;
   }
-  
-  indexbuf[INDEXENTRY_LENINF-1]= '\n';
-  if (fwrite(indexbuf,INDEXENTRY_LENINF,1,index) != 1)
-    ohshite("AARGH! Failed to write index entry relating to %s",refid);
-}  
+  linelen= 0;
+  for (pos=before->size; pos<k.size; pos+=n) {
+    n= pread(fd,buf, k.size-pos < sizeof(buf) ? k.size-pos : sizeof(buf), pos);
+    if (n<0 && errno == EINTR) { n= 0; continue; }
+    if (n<=0) break;
+    for (i=0; i<n && !wireline(buf[i],&linelen,out); i++);
+    if (i<n) break;
+  }
+  if (pos<k.size || linelen ||
+      fseek(out,0,SEEK_SET) || fwrite(&k,sizeof(k),1,out) != 1) {
+    fclose(out);
+    wirerender(fd,name);
+    return;
+  }
+  if (fclose(out)) wirerender(fd,name);
+}
 
-static int line1toolong(const char *p) {
-  return (strchr(p,'\n')-p) > TEXTLINE_MAXLEN;
+static int wireopen(int fd, const char *name, off_t *lenr) {
+  /* Returns an fd on name's twin, if it's current for the file open
+   * on fd, setting *lenr to the length after the wirekey; or -1. */
+  char wire[WIRE_MAXFILENAMELEN+5];
+  struct wirekey k, wk;
+  struct stat stab;
+  int wfd;
+
+  if (getwirekey(fd,&k)) return -1;
+  wirefilename(wire,name);
+  wfd= open(wire,O_RDONLY);
+  if (wfd == -1) return -1;
+  if (pread(wfd,&wk,sizeof(wk),0) != sizeof(wk) || memcmp(&k,&wk,sizeof(k)) ||
+      fstat(wfd,&stab)) {
+    close(wfd); return -1;
+  }
+  *lenr= stab.st_size - sizeof(wk);
+  return wfd;
 }
 
-static char *createitem(FILE *index, unsigned long sequence,
-                        time_t timestamp, const char *subject,
-                        int typecodechar, const char *continuing) {
-  /* NB the index file must have been locked.  The subject must already have
-   * been checked for length */
-  FILE *item;
-  char *newid, *datestring;
-  char idfile[ITEM_MAXFILENAMELEN+5];
-  char headbuf[INPUTLINE_MAXLEN*5+5];
-  
-  newid= newitemid(); id2file(newid,idfile);
-  item= fopen(idfile,"w+");
-  if (!item) ohshite("File for new item %s uncreateable",newid);
+/*
+ * Deflated responses
+ *
+ * After COMP DEFLATE a session's data responses are sent as
+ * "252 <n> bytes of deflated data follow" and then n bytes of zlib
+ * stream (RFC1950) which inflate to exactly what would have followed
+ * a 250: the dot-stuffed lines and the final ".".  Each part of the
+ * snapshot is deflated on its own and ended with a sync flush, so the
+ * parts can simply be put one after another between the zlib header
+ * and a final block and the Adler-32 of the lot.  That means a twin
+ * sent whole - an item, the MOTD, a sealed index segment - need only
+ * be deflated once, so next to the twin we keep a deflated twin (with
+ * DEFLATED_FILENAMESFX) starting with a struct deflatedhead.  Whoever
+ * finds it missing or stale while sending the twin makes a new one.
+ */
 
-  datestring= makedatestring(timestamp);
-  if (!*grogname) {
-    sprintf(headbuf, ITEMSTART_PFXSTRING "%s from %s at %s\n",
-            newid,userid,datestring);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              ITEMSTART_PFXSTRING "%s submitted at %s by\n"
-              LONGUSERID_PFXSTRING "%s\n",
-              newid,datestring,userid);
-  } else {
-    sprintf(headbuf,ITEMSTART_PFXSTRING "%s from %s (%s) at %s\n",
-            newid,grogname,userid,datestring);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              ITEMSTART_PFXSTRING "%s from %s at %s\n"
-              LONGGROGNAME_PFXSTRING "%s\n",
-              newid,userid,datestring,grogname);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              ITEMSTART_PFXSTRING "%s from %s at %s\n"
-              LONGUSERID_PFXSTRING "%s\n",
-              newid,grogname,datestring,userid);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              ITEMSTART_PFXSTRING "%s submitted at %s\n"
-              LONGGROGNAME_PFXSTRING "%s\n"
-              LONGUSERID_PFXSTRING "%s\n",
-              newid,datestring,grogname,userid);
+struct deflatedhead {
+  struct wirekey key;   /* of the file, as at the start of its twin   */
+  off_t len;            /* of the twin, not counting its wirekey      */
+  unsigned long adler;  /* Adler-32 of the same                       */
+  off_t zlen;           /* of the deflate data following this header */
+};
+
+static void deflatedfilename(char *buf, const char *name) {
+  strcpy(buf,name);
+  strcat(buf,DEFLATED_FILENAMESFX);
+}
+
+static int deflatedopen(int fd, const char *name, off_t len) {
+  /* Returns an fd on name's deflated twin, if it's current for the
+   * file open on fd, whose twin is len long after its wirekey; or -1. */
+  char zname[DEFLATED_MAXFILENAMELEN+5];
+  struct deflatedhead h;
+  struct wirekey k;
+  int zfd;
+
+  if (getwirekey(fd,&k)) return -1;
+  deflatedfilename(zname,name);
+  zfd= open(zname,O_RDONLY);
+  if (zfd == -1) return -1;
+  if (pread(zfd,&h,sizeof(h),0) != sizeof(h) ||
+      memcmp(&h.key,&k,sizeof(k)) || h.len != len) {
+    close(zfd); return -1;
   }
-  if (fprintf(item,
-              "%*s %*s          %08lX\n"
-              "^%08lX %08lX\n"
-              "%s"
-              SUBJECT_PFXSTRING "%s\n\n",
-              ITEMID_LEN, continuing, ITEMID_LEN, "", sequence,
-              sequence, timestamp,
-              headbuf, subject) == EOF)
-    ohshite("Failed to write item header to %s",newid);
-  copycontrib(item,newid);
+  return zfd;
+}
 
-  indexentry(index, sequence, timestamp, newid, typecodechar, subject);
-  printf("120 %s\r\n",newid);
-  return newid;
+/*
+ * Snapshots
+ *
+ * A reader must not hold its lock while it writes to the client, or a
+ * client that stops reading would hold up every writer.  So under the
+ * lock we take a snapshot of what we're going to send - an fd on the
+ * twin and the length of it that's ours (twins are only ever appended
+ * to or replaced), or failing that a copy in memory - and only send it
+ * once we've unlocked.
+ */
+
+struct snappart {
+  int wfd;              /* twin, or -1 if we have buf instead */
+  off_t offset, len;
+  char *buf;
+  size_t buflen;
+  off_t whole;          /* length of the whole twin, or -1 if we skipped some */
+  int zfd;              /* COMP DEFLATE: its deflated twin, or -1 */
+  char *zname;          /* COMP DEFLATE: deflated twin to make, or 0 */
+};
+
+struct snapshot {
+  int nparts, size;
+  struct snappart *parts;
+};
+
+static void snapinit(struct snapshot *snap) {
+  snap->nparts= snap->size= 0;
+  snap->parts= 0;
 }
 
-static int checknocont(FILE *item, char *id) {
-  char statusbuf[ITEMID_LEN*2+21+5];
+static struct snappart *snapadd(struct snapshot *snap) {
+  struct snappart *part;
 
-  if (fseek(item,0,SEEK_SET)) ohshite("Rewind failed for checknocont %s",id);
-  if (!fgets(statusbuf,ITEMID_LEN*2+21,item)) {
-    if (ferror(item)) ohshite("Item %s status unreadable",id);
-    noitem(id); return 0;
+  if (snap->nparts == snap->size) {
+    snap->size= snap->size ? snap->size*2 : 4;
+    snap->parts= realloc(snap->parts,snap->size*sizeof(*snap->parts));
+    if (!snap->parts) ohshite("No memory for snapshot");
   }
-  if (strlen(statusbuf) != ITEMID_LEN*2+20 ||
-      statusbuf[ITEMID_LEN*2+19] != '\n')
-    ohshit("Item %s has corrupted status line",id);
-  if (statusbuf[ITEMID_LEN+1] != ' ') {
-    printf("122 %*.*s\r\n"
-           "422 Item has already been continued.\r\n",
-           ITEMID_LEN*2+10,ITEMID_LEN*2+10,statusbuf+ITEMID_LEN+1);
-    return 0;
+  part= &snap->parts[snap->nparts++];
+  part->whole= -1;
+  part->zfd= -1;
+  part->zname= 0;
+  return part;
+}
+
+static int snapwire(struct snapshot *snap, int fd, const char *name,
+                    off_t skip, off_t expectlen) {
+  /* Snapshots the file open on fd from its twin, starting skip bytes
+   * into it.  Returns 0 (having taken nothing) if there's no usable
+   * twin and we can't make one, or if expectlen isn't -1 and the twin
+   * isn't that long (so skip would be wrong). */
+  struct snappart *part;
+  off_t len;
+  int wfd;
+
+  wfd= wireopen(fd,name,&len);
+  if (wfd == -1) {
+    if (wirerender(fd,name)) return 0;
+    wfd= wireopen(fd,name,&len);
+    if (wfd == -1) return 0;
+  }
+  if (skip > len || (expectlen != -1 && len != expectlen)) { close(wfd); return 0; }
+  part= snapadd(snap);
+  part->wfd= wfd;
+  part->offset= sizeof(struct wirekey) + skip;
+  part->len= len - skip;
+  part->buf= 0;
+  if (!skip) {
+    part->whole= len;
+    if (sess->deflate) {
+      part->zfd= deflatedopen(fd,name,len);
+      if (part->zfd == -1) {
+        part->zname= malloc(DEFLATED_MAXFILENAMELEN+5);
+        if (!part->zname) ohshite("No memory for snapshot");
+        deflatedfilename(part->zname,name);
+      }
+    }
   }
   return 1;
 }
 
-static int subjectok(char **cmdp) {
-  if (!**cmdp) {
-    protocolviolation("511 No Subject line specified for new item."); return 0;
+static FILE *snapstream(struct snapshot *snap, const char *name) {
+  /* Returns a stream whose output will be part of the snapshot; it
+   * must be closed before anything else is added. */
+  struct snappart *part;
+  FILE *mem;
+
+  part= snapadd(snap);
+  part->wfd= -1;
+  part->buf= 0;
+  mem= open_memstream(&part->buf,&part->buflen);
+  if (!mem) ohshite("Failed to make snapshot of %s",name);
+  return mem;
+}
+
+static void snapcopy(struct snapshot *snap, FILE *file, const char *filename) {
+  /* Snapshots the rest of file into memory, as copyfile would send it. */
+  FILE *mem;
+
+  mem= snapstream(snap,filename);
+  copyfile(file,filename,mem);
+  if (fclose(mem)) ohshite("Failed to make snapshot of %s",filename);
+}
+
+static void zput(z_stream *zs, const void *buf, size_t len, int flush,
+                 FILE *mem, FILE *cache, const char *name) {
+  /* Deflates len bytes at buf into mem, and into cache unless it's 0. */
+  unsigned char out[DEFLATE_BUF];
+  size_t n;
+
+  zs->next_in= (Bytef*)buf; zs->avail_in= len;
+  do {
+    zs->next_out= out; zs->avail_out= sizeof(out);
+    if (deflate(zs,flush) == Z_STREAM_ERROR) ohshit("Failed to deflate %s",name);
+    n= sizeof(out) - zs->avail_out;
+    if (fwrite(out,1,n,mem) != n) ohshite("Failed to make snapshot of %s",name);
+    if (cache) fwrite(out,1,n,cache);
+  } while (!zs->avail_out);
+}
+
+static void deflatepart(z_stream *zs, struct snappart *part, FILE *mem,
+                        const char *name, unsigned long *adlerp) {
+  /* Deflates part into mem, ending with a sync flush, and releases it.
+   * If it's a whole twin with no deflated twin, makes one of those. */
+  char buf[WIRE_READBUF], tmp[DEFLATED_MAXFILENAMELEN+30];
+  struct deflatedhead h;
+  unsigned long adler;
+  FILE *cache;
+  off_t pos, len;
+  ssize_t n;
+  int r;
+
+  cache= 0;
+  if (part->zname && part->len == part->whole) {
+    memset(&h,0,sizeof(h));
+    sprintf(tmp,"%s.%ld",part->zname,(long)getpid());
+    if (pread(part->wfd,&h.key,sizeof(h.key),0) == sizeof(h.key)) {
+      cache= fopen(tmp,"w");
+      if (cache) fwrite(&h,sizeof(h),1,cache);
+    }
   }
-  if (strlen(*cmdp)+sizeof(SUBJECT_PFXSTRING)-1 > TEXTLINE_MAXLEN) {
-    fputs("424 Subject is too long.\r\n",stdout);
-    return 0;
+  deflateReset(zs);
+  adler= adler32(0,0,0);
+  if (part->wfd == -1) {
+    len= part->buflen;
+    adler= adler32(adler,(Bytef*)part->buf,part->buflen);
+    zput(zs,part->buf,part->buflen,Z_SYNC_FLUSH,mem,0,name);
+    free(part->buf);
+  } else {
+    len= part->len;
+    for (pos=0; pos<len; pos+=n) {
+      n= pread(part->wfd,buf, len-pos < sizeof(buf) ? len-pos : sizeof(buf),
+               part->offset+pos);
+      if (n<0 && errno == EINTR) { n= 0; continue; }
+      if (n<=0) { close(part->wfd); ohshite("Failed to send %s",name); }
+      adler= adler32(adler,(Bytef*)buf,n);
+      zput(zs,buf,n,Z_NO_FLUSH,mem,cache,name);
+    }
+    zput(zs,0,0,Z_SYNC_FLUSH,mem,cache,name);
+    close(part->wfd);
   }
-  return 1;
+  if (cache) {
+    h.len= len; h.adler= adler; h.zlen= ftell(cache) - sizeof(h);
+    r= ferror(cache) || fseek(cache,0,SEEK_SET) || fwrite(&h,sizeof(h),1,cache) != 1;
+    if (fclose(cache) || r || rename(tmp,part->zname)) {
+      loge(ll_error,"Failed to write deflated twin"); unlink(tmp);
+    }
+  }
+  free(part->zname);
+  *adlerp= adler32_combine(*adlerp,adler,len);
 }
 
-char *getitemsubject(FILE *item, const char **emsg) {
-  /* If incorrectly formatted sets *emsg and returns 0. */
+static off_t deflatesnapshot(struct snapshot *snap, struct snapshot *zsnap,
+                             const char *name) {
+  /* Makes zsnap hold snap's data deflated as a zlib stream, followed
+   * by the final ".", and releases snap; returns zsnap's length. */
+  static const unsigned char zheader[2]= { 0x78, 0x9c };
+  struct snappart *part, *zpart;
+  struct deflatedhead h;
+  unsigned char trailer[4];
+  unsigned long adler;
+  z_stream zs;
+  FILE *mem;
+  off_t size;
   int i;
-  static char subjbuf[INPUTLINE_MAXLEN+5];
-  char *subjstart;
-  int l;
 
-  if (fseek(item,ITEMID_LEN*2+20,SEEK_SET)) {
-    *emsg= "fseek for subject failed"; return 0;
+  memset(&zs,0,sizeof(zs));
+  if (deflateInit2(&zs,DEFLATE_LEVEL,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+    ohshit("Failed to start deflating %s",name);
+  snapinit(zsnap);
+  mem= snapstream(zsnap,name);
+  fwrite(zheader,1,sizeof(zheader),mem);
+  adler= adler32(0,0,0);
+  for (i=0; i<snap->nparts; i++) {
+    part= &snap->parts[i];
+    if (part->zfd != -1 && part->len == part->whole &&
+        pread(part->zfd,&h,sizeof(h),0) == sizeof(h)) {
+      if (fclose(mem)) ohshite("Failed to make snapshot of %s",name);
+      zpart= snapadd(zsnap);
+      zpart->wfd= part->zfd;
+      zpart->offset= sizeof(h);
+      zpart->len= h.zlen;
+      zpart->buf= 0;
+      adler= adler32_combine(adler,h.adler,h.len);
+      close(part->wfd);
+      mem= snapstream(zsnap,name);
+      continue;
+    }
+    if (part->zfd != -1) close(part->zfd);
+    deflatepart(&zs,part,mem,name,&adler);
   }
-  i=0;
-  for (;;) {
-    if (++i>4) { *emsg= "has no subject (searched first 4 lines)"; return 0; }
-    if (fgets(subjbuf,INPUTLINE_MAXLEN,item) ==0) {
-      if (ferror(item)) ohshite("Reading file looking for subject");
-      *emsg= "has no subject (searched until early EOF)";
-      return 0;
+  deflateReset(&zs);
+  zput(&zs,".\r\n",3,Z_FINISH,mem,0,name);
+  deflateEnd(&zs);
+  adler= adler32_combine(adler,adler32(adler32(0,0,0),(Bytef*)".\r\n",3),3);
+  for (i=0; i<4; i++) trailer[i]= adler >> (24-i*8);
+  fwrite(trailer,1,sizeof(trailer),mem);
+  if (fclose(mem)) ohshite("Failed to make snapshot of %s",name);
+  free(snap->parts);
+  for (i=0, size=0; i<zsnap->nparts; i++) {
+    zpart= &zsnap->parts[i];
+    size+= zpart->wfd == -1 ? zpart->buflen : zpart->len;
+  }
+  return size;
+}
+
+static void sendparts(struct snapshot *snap, const char *name) {
+  struct snappart *part;
+  ssize_t r;
+  int i;
+
+  for (i=0; i<snap->nparts; i++) {
+    part= &snap->parts[i];
+    if (part->zfd != -1) close(part->zfd);
+    free(part->zname);
+    if (part->wfd == -1) {
+      fwrite(part->buf,1,part->buflen,stdout);
+      free(part->buf);
+      continue;
     }
-    if (!strncmp(subjbuf,SUBJECT_PFXSTRING,sizeof(SUBJECT_PFXSTRING)-1)) break;
+    fflush(stdout);
+    while (part->len > 0) {
+      r= sendfile(1,part->wfd,&part->offset,part->len);
+      if (r<0 && errno == EINTR) continue;
+      if (r<=0) { close(part->wfd); ohshite("Failed to send %s",name); }
+      part->len-= r;
+    }
+    close(part->wfd);
   }
-  subjstart= subjbuf + sizeof(SUBJECT_PFXSTRING) - 1;
-  l= strlen(subjstart);
-  while (l && isspace(subjstart[l-1])) l--;
-  if (!l) { *emsg= "has empty subject"; return 0; }
-  subjstart[l]= 0;
-  return subjstart;
+  free(snap->parts);
 }
 
-static int getnewsecret(unsigned char *buf) {
-  FILE *file;
-  struct stat stab;
-  long truncto;
-  int bytes= DEFAULT_SECRETBYTES;
-  int n;
+static void sendsnapshot(struct snapshot *snap, const char *name) {
+  struct snapshot zsnap;
+  off_t size;
 
-  file= fopen(RANDOMSTUFF_FILENAME,"r+b");
-  if (!file) ohshite("Failed to open " RANDOMSTUFF_FILENAME);
-  makelock(file,F_WRLCK,RANDOMSTUFF_FILENAME);
-  if (fstat(fileno(file),&stab)) ohshite("Failed to fstat " RANDOMSTUFF_FILENAME);
-  truncto= stab.st_size - bytes;
-  if (truncto <= RANDOMSTUFF_LOW) {
-    fputs("484 I've run out of random numbers - please try tomorrow.\r\n",
-          stdout);
-    log(ll_error,"Random numbers down to low water, registration rejected");
-    exit(0);
-  } else if (truncto <= RANDOMSTUFF_WARN) {
-    log(ll_error,"Random numbers running low");
+  if (sess->deflate) {
+    size= deflatesnapshot(snap,&zsnap,name);
+    printf("252 %ld bytes of deflated data follow\r\n",(long)size);
+    sendparts(&zsnap,name);
+    return;
   }
-  if (fseek(file, truncto, SEEK_SET) == -1) ohshite("Failed to seek for random");
-  memset(buf,0,SECRET_MAXBYTES);
-  errno=0; n= fread(buf,1,bytes,file);
-  if (n != bytes) ohshite("Failed to read random");
-  if (ftruncate(fileno(file),truncto)) ohshite("Failed to truncate random");
-  if (ufclose(file,RANDOMSTUFF_FILENAME)) ohshite("Failed to close random");
-  return bytes;
+  fputs("250 Data follows\r\n",stdout);
+  sendparts(snap,name);
+  fputs(".\r\n",stdout);
 }
 
-static void regster(void) {
-  struct userentry ue;
-  FILE *file;
-  int rc, i, child, status;
-  char sbuf[10];
-
-  log(ll_trace,"Registration requested `%s'",userid); tcpident();
-
-  memcpy(ue.userid, userid, USERID_MAXLEN);
-  ue.access= DEFAULT_ACCESS;
-  ue.ident= uil_md5initial;
-  ue.secretbytes= getnewsecret(ue.secret);
-  ue.lastref= gettime();
-  ue.disabled= 0;
+/*
+ * Item packs
+ *
+ * Items that have been quiet for a while are moved out of the item
+ * directory into pack segments in ITEMPACK_DIR, so that it only holds
+ * the ones still being added to.  A segment is just items one after
+ * another, and is never changed once written.  The table says where
+ * each packed item is, one ITEMPACK_ENTRYLEN line per item sorted by
+ * item-ID, so that it can be searched where it's mapped.
+ *
+ * An item's own file, if it has one, always wins over its table entry.
+ * Anything that changes an item unpacks it first (with the index
+ * locked, as -packitems has it), and the stale entry is dropped next
+ * time round; so item files are still the way items come in and go
+ * out, and -unpackitems turns a packed spool back into just them.
+ *
+ * -packitems, run from cron, copies the old items into a new segment,
+ * installs a new table and only then removes their files.  If the
+ * segments are mostly dead space, or there are too many, it copies the
+ * live items too and removes the old segments; a reader that finds a
+ * segment gone has raced with that, and looks again.
+ */
 
-  rc= userdb_change(USERDB_FILENAME,&ue,2);
-  if (rc==1) {
-    log(ll_alert,"Re-registration rejected");
-    fputs("482 Re-registration denied - contact the editors.\r\n",stdout);
-    exit(0);
-  } else if (rc==2) {
-    log(ll_error,"User database is full!");
-    fputs("484 Sorry, user database is full.  Please try again later.\r\n",
-          stdout);
-    exit(0);
-  }
+struct packentry {
+  char id[ITEMID_LEN+1];      /* first, for packidcmp */
+  long seg, offset, len;
+};
 
-  file= tmpfile(); if (!file) ohshite("Failed to make tmp file for secret");
-  for (i=0; i < ue.secretbytes; i++)
-    if (fprintf(file, "%02X", ue.secret[i]) == EOF)
-      ohshite("Failed to write digits of secret to tmp file");
-  if (fflush(file)) ohshite("Failed to flush digits of secret to tmp file");
-  if (fseek(file,0,SEEK_SET) == -1) ohshite("Failed to fseek secret tmp file");
-  if (lseek(fileno(file),0,SEEK_SET)==-1) ohshite("Failed to lseek secret tmp file ");
+struct packfile {
+  char id[ITEMID_LEN+1];      /* first, for packidcmp */
+  int old;
+};
 
-  sprintf(sbuf,"%d",ue.access);
-  log(ll_alert,"Registration - sending mail ...");
+static int packidcmp(const void *a, const void *b) {
+  return strcmp((const char*)a,(const char*)b);
+}
 
-  if ((child= fork()) == -1) ohshite("Fork for reguser");
-  if (!child) {
-    close(0); errno=0;
-    if (dup(fileno(file))) { perror("Failed to dup file to stdin"); _exit(1); }
-    execlp(REGUSER_PROGRAM,REGUSER_PROGRAM,userid,sbuf,clientid,(char*)0);
-    perror("exec " REGUSER_PROGRAM " failed"); _exit(1);
-  }
-  if (waitpid(child,&status,0) != child)
-    ohshite("Failed to wait for reguser process");
-  if (!WIFEXITED(status))
-    ohshit("reguser subprocess failed with code %d",status);
-  status= WEXITSTATUS(status);
-  if (status == 0) {
-    log(ll_trace,"reguser subprocess completed successfully");
-    exit(0);
-  }
-  if (status != 11) ohshit("reguser subprocess returned exit status %d",status);
-  log(ll_trace,"reguser subprocess gave exit status 11, allowing go-around");
+static int packisid(const char *p) {
+  int i;
 
-  userid[0]= 0;
+  if (strlen(p) != ITEMID_LEN || !isupper((unsigned char)*p)) return 0;
+  for (i=1; i<ITEMID_LEN; i++) if (!isdigit((unsigned char)p[i])) return 0;
+  return 1;
 }
-  
-/*
- * Command implementations
- */
 
-struct commandinfo {
-  const char *command;
-  void (*function)(char*);
-  int alevel;
-};
-
-/* GCC won't let me declare this static because I don't say
- * how big it is.  How do I simply _declare_ rather than define
- * this array ?
- */
-const struct commandinfo commandinfos[];
+static void packfilename(char *buf, long seg) {
+  sprintf(buf,"%s%08lX",ITEMPACK_DIR,seg);
+}
 
-/*
- * Identification, session management, etc.
- */
+static int packparse(const char *p, struct packentry *e) {
+  /* Reads the table entry at p.  Returns 0, or -1 if it's corrupt. */
+  char buf[ITEMPACK_ENTRYLEN+1];
 
-static void cmd_dbug(char *cmd) {
-  if (!noargs(cmd)) return;
-  if (!debugserver) {
-    if (!supertrace) {
-      log(ll_alert,"Debug requested"); tcpident(); setsupertrace();
-      fputs("200 Debug mode enabled.\r\n",stdout);
-    } else {
-      log(ll_trace,"DBUG reissued; giving `200 Already operative'");
-      fputs("200 Debug mode already operative.\r\n",stdout);
-    }
-  } else {
-    if (debuglevel < 9) {
-      debuglevel++;
-      log(ll_trace,"Entering debug level %d",debuglevel);
-      printf("200 Debug level %d.\r\n",debuglevel);
-   } else {
-      fputs("200 Debug level already at maximum.\r\n",stdout);
-    }
-  }
+  memcpy(buf,p,ITEMPACK_ENTRYLEN); buf[ITEMPACK_ENTRYLEN]= 0;
+  memcpy(e->id,buf,ITEMID_LEN); e->id[ITEMID_LEN]= 0;
+  return packisid(e->id) && buf[ITEMID_LEN] == ' ' && buf[ITEMPACK_ENTRYLEN-1] == '\n' &&
+    sscanf(buf+ITEMID_LEN,"%lx %ld %ld",&e->seg,&e->offset,&e->len) == 3 &&
+    e->offset >= 0 && e->len > 0 ? 0 : -1;
 }
 
-static void cmd_help(char *cmd) {
-  const struct commandinfo *cip;
-  int pil;
-  
-  if (!noargs(cmd)) return;
-  log(ll_trace,"HELP requested"); setsupertrace();
-  fputs("250 Help information follows ...\r\n"
-        " The commands supported by this server are:\r\n",stdout);
-  for (pil=0, cip=commandinfos; cip->command; cip++,pil++) {
-    if (pil > 4) { fputs("\r\n",stdout); pil=0; }
-    printf("    %-10s",cip->command);
+static int packfind(const char *id, struct packentry *e) {
+  /* Looks id up in the table.  Returns 1 if it's there, with *e filled in. */
+  struct stat stab;
+  const char *map, *p;
+  long min, max, try;
+  int fd, c, found, bad;
+
+  fd= open(ITEMPACK_TABLE,O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) return 0;
+    ohshite("Failed to open " ITEMPACK_TABLE);
   }
-  fputs("\r\n",stdout);
-  fputs(".\r\n",stdout);
+  if (fstat(fd,&stab)) ohshite("Failed to stat " ITEMPACK_TABLE);
+  if (stab.st_size % ITEMPACK_ENTRYLEN)
+    ohshit(ITEMPACK_TABLE " corrupt - invalid length %ld",(long)stab.st_size);
+  if (!stab.st_size) { close(fd); return 0; }
+  map= mmap(0,stab.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if (map == MAP_FAILED) ohshite("Failed to map " ITEMPACK_TABLE);
+  close(fd);
+  min= 0; max= stab.st_size / ITEMPACK_ENTRYLEN;
+  found= bad= 0;
+  while (min < max) {
+    try= (min+max)>>1;
+    p= map + (size_t)try*ITEMPACK_ENTRYLEN;
+    c= memcmp(p,id,ITEMID_LEN);
+    if (!c) { found= 1; bad= packparse(p,e); break; }
+    if (c < 0) { min=try+1; } else { max=try; }
+  }
+  munmap((void*)map,stab.st_size);
+  if (bad) ohshit(ITEMPACK_TABLE " has a corrupted entry for %s",id);
+  return found;
 }
 
-static void cmd_quit(char *cmd) {
-  if (!noargs(cmd)) return;
-  log(ll_trace,"QUIT, closing");
-  fputs("280 Goodbye.\r\n",stdout);
-  exit(0);
+static char *packget(const struct packentry *e) {
+  /* Reads e's item from its segment into a buffer from malloc.
+   * Returns 0 if the segment has gone. */
+  char name[ITEMPACK_MAXFILENAMELEN+5];
+  char *buf;
+  ssize_t r;
+  int fd;
+
+  packfilename(name,e->seg);
+  fd= open(name,O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) return 0;
+    ohshite("Item pack %s inaccessible",name);
+  }
+  buf= malloc(e->len);
+  if (!buf) ohshite("No memory to read item %s",e->id);
+  r= pread(fd,buf,e->len,e->offset);
+  close(fd);
+  if (r == -1) ohshite("Failed to read item %s from %s",e->id,name);
+  if (r != e->len) ohshit("Item %s truncated in %s",e->id,name);
+  return buf;
 }
 
-static int mustscanhex(char **cmdp, int n, unsigned char *dest) {
-  if (scanhex(cmdp,n,dest)) return 1;
-  protocolviolation("511 Hex stream contained non-hex-digit or finished too early.");
+static char *packread(const char *id, long *lenr) {
+  /* Returns item id's packed copy in a buffer from malloc, setting
+   * *lenr, or 0 if it isn't packed. */
+  struct packentry e;
+  char *buf;
+  int tries;
+
+  for (tries=0; tries<ITEMPACK_TRIES; tries++) {
+    if (!packfind(id,&e)) return 0;
+    buf= packget(&e);
+    if (buf) { *lenr= e.len; return buf; }
+  }
+  ohshit("Item %s keeps moving between packs",id);
   return 0;
 }
 
-static void md5_sendchal(void) {
-  struct timeval timevab;
-  unsigned long ul;
-  unsigned short us;
-  
-  if (gettimeofday(&timevab,(void*)0)) ohshite("Failed gettimeofday for nonce");
-  memcpy(servernonce,&timevab.tv_sec,4);
-  ul= (timevab.tv_usec << 12) + servseq; memcpy(servernonce+4,&ul,4);
-  memcpy(servernonce+8,&calleraddr.sin_addr,4);
-  memcpy(servernonce+12,&calleraddr.sin_port,2);
-  us= getpid(); memcpy(servernonce+14,&us,2);
+static FILE *itemopen(const char *id, const char *idfile, long *packedr) {
+  /* Opens item id for reading: its own file, read-locked, or if it has
+   * none a copy of it from the packs, whose length is put in *packedr
+   * (otherwise -1).  Returns 0 if there's no such item. */
+  FILE *item;
+  char *buf;
+  long len;
 
-  if (identue.secretbytes < 0 || identue.secretbytes > SECRET_MAXBYTES)
-    ohshit("User database corrupted - secret length out of range");
-  
-  fputs("333 ",stdout); sendhex(servernonce,16); fputs("\r\n",stdout);
+  *packedr= -1;
+  item= fopen(idfile,"r");
+  if (item) { makelock(item,F_RDLCK,idfile); return item; }
+  if (errno!=ENOENT) ohshite("Item %s inaccessible",id);
+  buf= packread(id,&len);
+  if (!buf) return 0;
+  item= fmemopen(0,len+1,"w+");
+  if (!item) ohshite("No memory to read item %s",id);
+  holdfile(item); /* a -multiplex session may be abandoned with it open */
+  if (fwrite(buf,1,len,item) != len || fseek(item,0,SEEK_SET))
+    ohshite("Failed to copy item %s from its pack",id);
+  free(buf);
+  *packedr= len;
+  return item;
 }
 
-static void md5_copyuserid(unsigned char *dest, const char *src) {
-  memset(dest,0,16);
-  strncpy(dest,src,16);
+static void itemunpack(const char *id, const char *idfile) {
+  /* Gives item id its own file again if it's packed, so that it can be
+   * changed in place.  The index must be locked. */
+  char tmp[ITEM_MAXFILENAMELEN+30];
+  FILE *file;
+  char *buf;
+  long len;
+
+  if (!access(idfile,F_OK)) return;
+  if (errno != ENOENT) ohshite("Item %s inaccessible",id);
+  buf= packread(id,&len);
+  if (!buf) return;
+  sprintf(tmp,"%s.%ld",idfile,(long)getpid());
+  file= fopen(tmp,"w");
+  if (!file) ohshite("Failed to create %s to unpack item",tmp);
+  if (fwrite(buf,1,len,file) != len || fclose(file))
+    ohshite("Failed to write %s to unpack item",tmp);
+  if (rename(tmp,idfile)) ohshite("Failed to install unpacked item %s",idfile);
+  free(buf);
 }
 
-static void authfailure(const char *msg, int twoorthree) {
-  /* NB! This function sometimes RETURNS! */
-  if (alevel) {
-    fprintf(stdout,"43%d %s.\r\n",twoorthree,msg); return;
-  } else {
-    fprintf(stdout,"48%d %s.\r\n",twoorthree,msg);
-    log(ll_trace,"Closing due to auth failure");
-    exit(0);
+static long packtable(struct packentry **esr) {
+  /* Reads the whole table into an array from malloc; returns its length. */
+  char buf[ITEMPACK_ENTRYLEN];
+  struct packentry *es;
+  struct stat stab;
+  FILE *file;
+  long n, i;
+
+  file= fopen(ITEMPACK_TABLE,"r");
+  if (!file) {
+    if (errno != ENOENT) ohshite("Failed to open " ITEMPACK_TABLE);
+    *esr= 0; return 0;
   }
+  if (fstat(fileno(file),&stab)) ohshite("Failed to stat " ITEMPACK_TABLE);
+  if (stab.st_size % ITEMPACK_ENTRYLEN)
+    ohshit(ITEMPACK_TABLE " corrupt - invalid length %ld",(long)stab.st_size);
+  n= stab.st_size / ITEMPACK_ENTRYLEN;
+  es= malloc((n+1)*sizeof(*es));
+  if (!es) ohshite("No memory to read " ITEMPACK_TABLE);
+  for (i=0; i<n; i++) {
+    if (fread(buf,ITEMPACK_ENTRYLEN,1,file) != 1) ohshite("Failed to read " ITEMPACK_TABLE);
+    if (packparse(buf,&es[i])) ohshit(ITEMPACK_TABLE " has corrupted entry %ld",i);
+  }
+  fclose(file);
+  *esr= es;
+  return n;
 }
 
-static void authorise(const char *userid, int ac) {
-  const struct userentry *uep;
-  struct userentry ue;
+static void packwritetable(const struct packentry *es, long n) {
+  /* Installs a new table listing the n entries at es, which are sorted. */
+  char tmp[sizeof(ITEMPACK_TABLE)+30];
+  FILE *file;
+  long i;
+
+  sprintf(tmp,"%s.%ld",ITEMPACK_TABLE,(long)getpid());
+  file= fopen(tmp,"w");
+  if (!file) ohshite("Failed to create new " ITEMPACK_TABLE);
+  for (i=0; i<n; i++)
+    if (fprintf(file,"%s %08lX %010ld %010ld\n",
+                es[i].id,es[i].seg,es[i].offset,es[i].len) == EOF)
+      ohshite("Failed to write new " ITEMPACK_TABLE);
+  if (fflush(file) || fsync(fileno(file)) || fclose(file))
+    ohshite("Failed to write new " ITEMPACK_TABLE);
+  if (rename(tmp,ITEMPACK_TABLE)) ohshite("Failed to install new " ITEMPACK_TABLE);
+}
 
-  log(ll_trace,"Requested user `%.50s', access %d", userid, ac);
-  if (debuglevel > 0) {
-    setstatus(al_edit,"Login successful - debug mode");
-    return;
-  }
-  uep= userdb_find(USERDB_FILENAME,userid,ac);
-  if (!uep) {
-    if (ac>=0 && (uep= userdb_find(USERDB_FILENAME,userid,-1))) {
-      if (uep->access > 0) {
-        log(ll_alert,"Wrong access level - can have %d",uep->access);
-        tcpident(); authfailure("You are denied that access level",2); return;
-      }
-    } else {
-      log(ll_alert,"Unknown user rejected"); tcpident();
-      authfailure("You are unknown to me - please ask the Editors for a userid",2);
-      return;
+static void packforget(const char *id) {
+  /* Takes id out of the table, if it's there.  The index must be locked. */
+  struct packentry *es;
+  long n, i, j;
+
+  n= packtable(&es);
+  for (i=0, j=0; i<n; i++)
+    if (strcmp(es[i].id,id)) es[j++]= es[i];
+  if (j < n) packwritetable(es,j);
+  free(es);
+}
+
+static long packfiles(struct packfile **fsr, time_t before) {
+  /* Lists the item files, sorted, noting which last changed by before. */
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  struct packfile *fs;
+  struct dirent *de;
+  struct stat stab;
+  long n, max;
+  DIR *dir;
+
+  dir= opendir(ITEM_FILENAMEPFX);
+  if (!dir) ohshite("Failed to read " ITEM_FILENAMEPFX);
+  fs= 0; n= max= 0;
+  while ((de= readdir(dir))) {
+    if (!packisid(de->d_name)) continue;
+    id2file(de->d_name,idfile);
+    if (stat(idfile,&stab)) ohshite("Failed to stat %s",idfile);
+    if (n == max) {
+      max= max*2+64;
+      fs= realloc(fs,max*sizeof(*fs));
+      if (!fs) ohshite("No memory to list items");
     }
+    strcpy(fs[n].id,de->d_name);
+    fs[n].old= S_ISREG(stab.st_mode) && stab.st_mtime <= before;
+    n++;
   }
-  ue= *uep;  ue.lastref= gettime();  userdb_change(USERDB_FILENAME,&ue,0);
-  if (uep->disabled) {
-    log(ll_alert,"Disabled user rejected"); tcpident();
-    authfailure("That userid is disabled; contact the Editors",2);
-    exit(0);
-  }
-  switch (uep->ident) {
-  case uil_none:
-    if (uep->access < 0 || uep->access > al_max)
-      ohshit("Unknown access level code `%d'",uep->access);
-    setstatus(uep->access,"Unconfirmed login OK");
-    return;
-  case uil_md5initial:
-    log(ll_trace,"This user still in `initial' registration state");
-  case uil_md5:
-    log(ll_trace,"Requested proof of identity");
-    fputs("130 MD5  Please provide proof of identity.\r\n",stdout);
-    memcpy(&identue, uep, sizeof(identue));
-    md5_sendchal();
-    return;
-  default:
-    ohshit("Unknown ident level code `%d'",uep->ident,userid);
+  closedir(dir);
+  qsort(fs,n,sizeof(*fs),packidcmp);
+  *fsr= fs;
+  return n;
+}
+
+static int packsegments(long **segsr, off_t *totalr, long *nextr) {
+  /* Lists the segments, totalling their sizes; *nextr is set to the
+   * number for a new one. */
+  char name[ITEMPACK_MAXFILENAMELEN+5];
+  struct dirent *de;
+  struct stat stab;
+  long *segs, num;
+  int n, max;
+  DIR *dir;
+
+  dir= opendir(ITEMPACK_DIR);
+  if (!dir) ohshite("Failed to read " ITEMPACK_DIR);
+  segs= 0; n= max= 0; *totalr= 0; *nextr= 0;
+  while ((de= readdir(dir))) {
+    if (strlen(de->d_name) != 8 || strspn(de->d_name,"0123456789ABCDEF") != 8) continue;
+    num= strtol(de->d_name,0,16);
+    packfilename(name,num);
+    if (stat(name,&stab)) ohshite("Failed to stat %s",name);
+    if (n == max) {
+      max= max*2+16;
+      segs= realloc(segs,max*sizeof(*segs));
+      if (!segs) ohshite("No memory to list item packs");
+    }
+    segs[n++]= num;
+    *totalr+= stab.st_size;
+    if (num >= *nextr) *nextr= num+1;
   }
+  closedir(dir);
+  *segsr= segs;
+  return n;
 }
 
-static void cmd_auth(char *cmd) {
-  struct MD5Context md5ctx;
-  unsigned char clienthash[16], clientnonce[16], digest[16];
-  unsigned char messagebuf[16*3+SECRET_MAXBYTES];
-  char *hexp;
-  unsigned char *p, *q;
-  int i, rc;
+static void packput(FILE **segp, long num, struct packentry *e,
+                    const char *buf, long len) {
+  /* Appends e's item, the len bytes at buf, to segment num, creating
+   * it if *segp is 0, and fills in e to say so. */
+  char name[ITEMPACK_MAXFILENAMELEN+5];
 
-  if (!*identue.userid) {
-    protocolviolation("500 AUTH not expected."); return;
+  packfilename(name,num);
+  if (!*segp) {
+    *segp= fopen(name,"w");
+    if (!*segp) ohshite("Failed to create item pack %s",name);
   }
-  hexp= cmd;
-  if (!mustscanhex(&cmd,16,clienthash)) return;
-  skipspace(&cmd);
-  if (!mustscanhex(&cmd,16,clientnonce) || !noargs(cmd)) return;
+  e->seg= num;
+  e->offset= ftell(*segp);
+  e->len= len;
+  if (fwrite(buf,1,len,*segp) != len) ohshite("Failed to write item pack %s",name);
+}
 
-  if (supertrace) log(ll_debug,"AUTH was `%s'",hexp);
+static void packitems(long days) {
+  /* Packs the items whose files haven't changed for days days, and
+   * compacts the segments if need be; -packitems. */
+  char name[DEFLATED_MAXFILENAMELEN+5], idfile[ITEM_MAXFILENAMELEN+5];
+  struct packentry *es, *ns;
+  struct packfile *fs;
+  struct stat stab;
+  FILE *index, *seg, *item;
+  off_t total, live;
+  long n, nf, nn, nold, i, next, *segs;
+  char *buf;
+  int nsegs, compact, s;
 
-  memcpy(messagebuf,clientnonce,16);
-  memcpy(messagebuf+16,servernonce,16);
-  md5_copyuserid(messagebuf+32,identue.userid);
-  for (p=identue.secret, q=messagebuf+48, i=identue.secretbytes;
-       /* We checked the value of identue.secretbytes in md5_sendchal. */
-       i>0;
-       i--) *q++= ~*p++;
-  MD5Init(&md5ctx);
-  if (debuglevel > 0) {
-    fputs("119 clienthash=MD5(",stdout);
-    sendhex(messagebuf,48);
-    fprintf(stdout,"!!%d)\r\n",identue.secretbytes);
+  index= fopen(INDEX_FILENAME,"r+");
+  if (!index) ohshite("Index inaccessible for packing items");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  if (mkdir(ITEMPACK_DIR,0777) && errno != EEXIST)
+    ohshite("Failed to make " ITEMPACK_DIR);
+
+  n= packtable(&es);
+  nf= packfiles(&fs,gettime()-days*86400L);
+  nsegs= packsegments(&segs,&total,&next);
+  for (i=0, nold=0; i<nf; i++) nold+= fs[i].old;
+
+  /* entries for items which have their own files are dead */
+  ns= malloc((n+nold+1)*sizeof(*ns));
+  if (!ns) ohshite("No memory for new " ITEMPACK_TABLE);
+  for (i=0, nn=0, live=0; i<n; i++) {
+    if (bsearch(es[i].id,fs,nf,sizeof(*fs),packidcmp)) continue;
+    ns[nn++]= es[i];
+    live+= es[i].len;
   }
-  MD5Update(&md5ctx,messagebuf,48+identue.secretbytes);
-  MD5Final(digest,&md5ctx);
-  if (debuglevel > 1) {
-    fputs("119 clienthash=",stdout);
-    sendhex(digest,16);
-    fputs("\r\n",stdout);
+  compact= nsegs > ITEMPACK_MAXSEGS || total-live > live;
+
+  seg= 0;
+  for (i=0; compact && i<nn; i++) {
+    buf= packget(&ns[i]);
+    if (!buf) ohshit("Item pack for %s has gone",ns[i].id);
+    packput(&seg,next,&ns[i],buf,ns[i].len);
+    free(buf);
   }
-  if (memcmp(digest,clienthash,16)) {
-    log(ll_alert,"Crypto mismatch - access denied"); tcpident();
-    authfailure("Identity confirmation failed",3); *identue.userid=0; return;
+  for (i=0; i<nf; i++) {
+    if (!fs[i].old) continue;
+    id2file(fs[i].id,idfile);
+    item= fopen(idfile,"r");
+    if (!item) ohshite("Failed to open %s to pack it",idfile);
+    if (fstat(fileno(item),&stab)) ohshite("Failed to stat %s to pack it",idfile);
+    buf= malloc(stab.st_size+1);
+    if (!buf) ohshite("No memory to pack %s",idfile);
+    if (fread(buf,1,stab.st_size,item) != stab.st_size)
+      ohshite("Failed to read %s to pack it",idfile);
+    fclose(item);
+    strcpy(ns[nn].id,fs[i].id);
+    packput(&seg,next,&ns[nn++],buf,stab.st_size);
+    free(buf);
   }
-
-  memcpy(messagebuf,servernonce,16);
-  memcpy(messagebuf+16,clientnonce,16);
-  md5_copyuserid(messagebuf+32,identue.userid);
-  memcpy(messagebuf+48,identue.secret,identue.secretbytes);
-  MD5Init(&md5ctx);
-  if (debuglevel > 0) {
-    fputs("119 serverhash=MD5(",stdout);
-    sendhex(messagebuf,48);
-    fprintf(stdout,"??%d)\r\n",identue.secretbytes);
+  if (seg && (fflush(seg) || fsync(fileno(seg)) || fclose(seg)))
+    ohshite("Failed to write item pack %08lX",next);
+  qsort(ns,nn,sizeof(*ns),packidcmp);
+  packwritetable(ns,nn);
+
+  for (i=0; i<nf; i++) {
+    if (!fs[i].old) continue;
+    id2file(fs[i].id,idfile);
+    if (unlink(idfile)) ohshite("Failed to remove packed item %s",idfile);
+    wirefilename(name,idfile);
+    if (unlink(name) && errno != ENOENT) ohshite("Failed to remove %s",name);
+    deflatedfilename(name,idfile);
+    if (unlink(name) && errno != ENOENT) ohshite("Failed to remove %s",name);
   }
-  MD5Update(&md5ctx,messagebuf,48+identue.secretbytes);
-  MD5Final(digest,&md5ctx);
-  fputs("133 ",stdout); sendhex(digest,16); fputs("\r\n",stdout);
+  for (s=0; compact && s<nsegs; s++) {
+    packfilename(name,segs[s]);
+    if (unlink(name)) ohshite("Failed to remove old item pack %s",name);
+  }
+  if (ufclose(index,INDEX_FILENAME)) ohshite("Failed to close index after packing items");
 
-  if (identue.ident==uil_md5initial) {
-    identue.ident= uil_md5;
-    rc= userdb_change(USERDB_FILENAME,&identue,0);
-    if (rc) ohshit("Change ident level status return %d",rc);
-    log(ll_trace,"Registration confirmed by successful login");
-    setstatus(identue.access,"Registration complete");
-  } else {
-    setstatus(identue.access,"Identity confirmed");
+  log(ll_trace,"Packed %ld items%s; %ld packed in all",
+      nold,compact ? " and compacted the packs" : "",nn);
+  free(es); free(ns); free(fs); free(segs);
+}
+
+static void unpackitems(void) {
+  /* Gives every packed item its own file again and removes the packs;
+   * -unpackitems. */
+  char name[ITEMPACK_MAXFILENAMELEN+5], idfile[ITEM_MAXFILENAMELEN+5];
+  struct packentry *es;
+  FILE *index;
+  long n, i, next, *segs;
+  off_t total;
+  int nsegs, s;
+
+  index= fopen(INDEX_FILENAME,"r+");
+  if (!index) ohshite("Index inaccessible for unpacking items");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  n= packtable(&es);
+  for (i=0; i<n; i++) {
+    id2file(es[i].id,idfile);
+    itemunpack(es[i].id,idfile);
+  }
+  if (unlink(ITEMPACK_TABLE) && errno != ENOENT)
+    ohshite("Failed to remove " ITEMPACK_TABLE);
+  nsegs= access(ITEMPACK_DIR,F_OK) ? 0 : packsegments(&segs,&total,&next);
+  for (s=0; s<nsegs; s++) {
+    packfilename(name,segs[s]);
+    if (unlink(name)) ohshite("Failed to remove item pack %s",name);
   }
-  *identue.userid= 0;
+  if (ufclose(index,INDEX_FILENAME)) ohshite("Failed to close index after unpacking items");
+  log(ll_trace,"Unpacked %ld items",n);
+  free(es);
 }
 
-static void cmd_alvl(char *cmd) {
-  int ac;
+/*
+ * Item summaries
+ *
+ * REPL, CONT and STAT only want an item's status line, length and
+ * subject, so rather than read and parse the item each time we keep
+ * them for every item in ITEMMETA_FILENAME, which each process maps.
+ * We keep where the last few contributions start too, in the item and
+ * in its twin, so that ITEM id #seq can send just the end of it.
+ * It's a hash table of fixed-size records keyed by item-ID.  Writers
+ * (who have the index locked, so there's one at a time) call metabegin
+ * before they change an item and metaend when they've finished, and
+ * in between the count is odd, as with the index mirror, so readers
+ * know not to trust what they see.  A writer that dies half way leaves
+ * the count odd and busy saying what it was changing, and whoever
+ * comes next forgets that item.  A record with no status is an item
+ * we know nothing about (a withdrawn one, say).  When the table is
+ * half full it's copied to one twice the size, and the old one is
+ * marked retired so that everyone maps the new one.  The daemon makes
+ * the table from the items at startup if there isn't a good one.
+ *
+ * An item with no record, perhaps because it was put in the item
+ * directory by hand, is read as before; but anyone changing an item
+ * file by hand must remove the table and restart the daemon.
+ */
 
-  ac= getalvl(&cmd); if (ac<-1) return;
+struct itemmark {
+  long seq;                       /* the contribution's sequence number */
+  long offset, wire;              /* where what was appended with it starts */
+};
 
-  if (!*userid) {
-    protocolviolation("500 Need to be logged in using USER to use ALVL."); return;
-  }
-  if (*identue.userid) {
-    protocolviolation("500 Authentication procedure in progress."); return;
+struct itemmeta {
+  char id[ITEMID_LEN];            /* all zero if the slot is free */
+  char status[ITEMID_LEN*2+20];   /* without its newline; "" if not known */
+  long length, replies;
+  char subject[TEXTLINE_MAXLEN+1];
+  long wirelen;                   /* length as its twin would have it */
+  long nmarks;                    /* contributions, of which marks has the */
+  struct itemmark marks[ITEMMETA_MARKS]; /* last few, at [i % ITEMMETA_MARKS] */
+};
+
+struct metatable {
+  volatile unsigned long count;   /* odd while it's being changed */
+  volatile int retired;           /* replaced by a bigger one */
+  long recsize, slots, used;      /* slots is a power of two */
+  char busy[ITEMID_LEN+1];        /* the item being changed, if any */
+  struct itemmeta recs[1];
+};
+
+#define METATABLE_LEN(slots) \
+  (offsetof(struct metatable,recs) + (size_t)(slots)*sizeof(struct itemmeta))
+
+static struct metatable *meta;
+static size_t metalen;
+
+static int metamap(void) {
+  /* Makes sure we have the current table mapped; returns 0 if there
+   * isn't one. */
+  struct stat stab;
+  void *p;
+  int fd;
+
+  if (meta && !meta->retired) return 1;
+  if (meta) { munmap(meta,metalen); meta= 0; }
+  fd= open(ITEMMETA_FILENAME,O_RDWR);
+  if (fd == -1) return 0;
+  if (fstat(fd,&stab) || stab.st_size < METATABLE_LEN(0)) { close(fd); return 0; }
+  p= mmap(0,stab.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (p == MAP_FAILED) return 0;
+  meta= p; metalen= stab.st_size;
+  if (meta->recsize != sizeof(struct itemmeta) || meta->slots <= 0 ||
+      (meta->slots & (meta->slots-1)) || metalen != METATABLE_LEN(meta->slots)) {
+    munmap(p,metalen); meta= 0; return 0;
   }
-  if (ac == -1) {
-    fputs("432 Sorry, I don't do default levels.\r\n",stdout);
-  } else if (ac < alevel) {
-    setstatus(ac,"Access downgraded on request");
-  } else if (ac == alevel) {
-    fprintf(stdout,"23%d Access level unchanged.\r\n",alevel);
-  } else {
-    authorise(userid,ac);
+  return 1;
+}
+
+static struct itemmeta *metaslot(struct metatable *t, const char *id, int add) {
+  /* Finds id's record in t, or if add a free one for it; 0 if neither. */
+  struct itemmeta *m;
+  unsigned long h;
+  long n;
+  int i;
+
+  for (i=0, h=2166136261UL; i<ITEMID_LEN; i++) h= (h ^ (unsigned char)id[i]) * 16777619UL;
+  for (n=0; n<t->slots; n++) {
+    m= &t->recs[(h+n) & (t->slots-1)];
+    if (!memcmp(m->id,id,ITEMID_LEN)) return m;
+    if (!m->id[0]) return add ? m : 0;
   }
+  return 0;
 }
 
-static void cmd_user(char *cmd) {
-  int ac= -1;
-  char *p;
-  const char *e;
-  char violationbuf[512];
-  
-  p= strchr(cmd,' ');
-  if (p) {
-    *p++= 0;  skipspace(&p);
-    ac= getalvl(&p); if (ac<-1) return;
-    skipspace(&p); if (!noargs(p)) return;
+static int metaparse(const char *p, long len, struct itemmeta *m) {
+  /* Fills in m's status, subject, length, reply count and markers from
+   * the len bytes of item at p, as checknocont and getitemsubject would
+   * read them.  Returns 0 if they can't, or the subject is too long to
+   * keep. */
+  const char *l, *nl, *end;
+  struct itemmark *mark;
+  int i, blank;
+
+  end= p+len;
+  if (len < ITEMID_LEN*2+20 || p[ITEMID_LEN*2+19] != '\n' ||
+      memchr(p,'\n',ITEMID_LEN*2+19) || memchr(p,0,ITEMID_LEN*2+19)) return 0;
+  for (i=0, l= p+ITEMID_LEN*2+20; ; i++, l= nl+1) {
+    if (i >= 4 || l >= end) return 0;
+    nl= memchr(l,'\n',end-l); if (!nl) nl= end;
+    if (nl-l >= sizeof(SUBJECT_PFXSTRING)-1 &&
+        !memcmp(l,SUBJECT_PFXSTRING,sizeof(SUBJECT_PFXSTRING)-1)) break;
   }
-  if (*userid) { protocolviolation("500 Already logged in."); return; }
-  userid[USERID_MAXLEN]= 0;
-  if ((e= userdb_checkid(cmd,userid))) {
-    sprintf(violationbuf,"511 Malformed or missing userid (`%.50s', %.200s)", cmd, e);
-    protocolviolation(violationbuf); *userid= 0; return;
+  l+= sizeof(SUBJECT_PFXSTRING)-1;
+  while (nl > l && isspace((unsigned char)nl[-1])) nl--;
+  if (nl == l || nl-l > TEXTLINE_MAXLEN || memchr(l,0,nl-l)) return 0;
+  memcpy(m->status,p,ITEMID_LEN*2+19); m->status[ITEMID_LEN*2+19]= 0;
+  memcpy(m->subject,l,nl-l); m->subject[nl-l]= 0;
+  m->length= len;
+  m->nmarks= 0;
+  m->wirelen= ITEMID_LEN*2+21;
+  for (l= p+ITEMID_LEN*2+20, blank= 0; l < end; l= nl+1) {
+    nl= memchr(l,'\n',end-l);
+    if (!nl) break;
+    if (*l == '^' && isxdigit((unsigned char)l[1])) {
+      /* what's appended starts with the blank line before the marker */
+      mark= &m->marks[m->nmarks++ % ITEMMETA_MARKS];
+      mark->seq= strtol(l+1,0,16);
+      mark->offset= l-p - blank;
+      mark->wire= m->wirelen - blank*2;
+    }
+    blank= nl == l;
+    m->wirelen+= nl-l + 2 + (*l == '.');
   }
-  if (registration) regster();
-  else authorise(userid,ac);
+  m->replies= m->nmarks ? m->nmarks-1 : 0; /* the first is the item itself */
+  return 1;
 }
 
-static void cmd_regu(char *cmd) {
-  if (!noargs(cmd)) return;
-  if (userid[0] || registration) {
-    protocolviolation("500 REGU not allowed after USER or REGU."); return;
+static int metaget(const char *id, struct itemmeta *m) {
+  /* Copies our record of id into *m; returns 0 if we haven't one we
+   * can trust. */
+  const struct itemmeta *r;
+  unsigned long count;
+  int tries;
+
+  for (tries=0; tries<ITEMMETA_TRIES; tries++) {
+    if (!metamap()) return 0;
+    count= meta->count;
+    __sync_synchronize();
+    if (count & 1) return 0; /* a writer has the index for the whole command */
+    r= metaslot(meta,id,0);
+    if (r) *m= *r;
+    __sync_synchronize();
+    if (meta->count != count || meta->retired) continue;
+    return r && m->status[0];
   }
+  return 0;
+}
 
-  fputs("100 Processing registration request - please stand by.\r\n",stdout);
-  fputs(REGUWARNING_STRING,stdout);
-  registration= 1;
-  log(ll_alert,"REGU accepted, warning issued"); tcpident();
+static int metamark(const struct itemmeta *m, long seq, const struct itemmark **markr) {
+  /* Finds the first contribution to m after seq, setting *markr to it
+   * or to 0 if there isn't one.  Returns 0 if it might be one we
+   * haven't kept. */
+  long i;
+
+  *markr= 0;
+  for (i= m->nmarks > ITEMMETA_MARKS ? m->nmarks-ITEMMETA_MARKS : 0; i<m->nmarks; i++) {
+    if (m->marks[i % ITEMMETA_MARKS].seq <= seq) continue;
+    if (i && i == m->nmarks-ITEMMETA_MARKS) return 0;
+    *markr= &m->marks[i % ITEMMETA_MARKS];
+    break;
+  }
+  return 1;
 }
 
-/*
- * Contributions and replies
- */
+static struct metatable *metanew(long slots, const char *tmp, size_t *lenr) {
+  /* Makes an empty table with slots records in tmp and maps it;
+   * returns 0 if we can't. */
+  struct metatable *t;
+  size_t len;
+  void *p;
+  int fd;
 
-static void cmd_cont(char *cmd) {
-  FILE *olditem, *index;
-  char oldidfile[ITEM_MAXFILENAMELEN+5];
-  unsigned long sequence;
-  time_t currenttime;
-  char *newid, *oldsubject;
-  const char *emsg;
+  len= METATABLE_LEN(slots);
+  fd= open(tmp,O_RDWR|O_CREAT|O_TRUNC,0666);
+  if (fd == -1) return 0;
+  if (ftruncate(fd,len)) { close(fd); unlink(tmp); return 0; }
+  p= mmap(0,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (p == MAP_FAILED) { unlink(tmp); return 0; }
+  t= p;
+  t->recsize= sizeof(struct itemmeta);
+  t->slots= slots;
+  *lenr= len;
+  return t;
+}
 
-  if (!datadone() || !subjectok(&cmd) || !noeditinprogress()) return;
-  if (!maycontinue) {
-    protocolviolation("520 Continuation only allowed after "
-                      "an item found to be too full.");
-    return;
+static int metainstall(struct metatable *t, size_t len, const char *tmp) {
+  /* Puts the new table t in place of the old one, telling everyone
+   * using that.  Returns 0, or -1 if we couldn't. */
+  int r;
+
+  r= rename(tmp,ITEMMETA_FILENAME);
+  if (r) unlink(tmp);
+  munmap(t,len);
+  if (r) return -1;
+  if (meta) {
+    meta->retired= 1;
+    munmap(meta,metalen); meta= 0;
   }
-  index= fopen(INDEX_FILENAME,"a");
-  if (!index) ohshite("Index inaccessible for continuation");
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-  
-  id2file(saveditemid,oldidfile);
-  olditem= fopen(oldidfile,"r+");
-  if (!olditem) {
-    if (errno!=ENOENT)
-      ohshite("Item %s inaccessible for continuation",saveditemid);
-    noitem(saveditemid); ufclose(index,INDEX_FILENAME); return;
+  return 0;
+}
+
+static void metagrow(void) {
+  /* Copies the table to one twice the size, leaving out what we know
+   * nothing about. */
+  char tmp[sizeof(ITEMMETA_FILENAME)+30];
+  struct metatable *t;
+  size_t len;
+  long i;
+
+  sprintf(tmp,"%s.%ld",ITEMMETA_FILENAME,(long)getpid());
+  t= metanew(meta->slots*2,tmp,&len);
+  if (!t) { loge(ll_error,"Failed to make a bigger " ITEMMETA_FILENAME); return; }
+  for (i=0; i<meta->slots; i++) {
+    if (!meta->recs[i].id[0] || !meta->recs[i].status[0]) continue;
+    *metaslot(t,meta->recs[i].id,1)= meta->recs[i];
+    t->used++;
   }
+  if (metainstall(t,len,tmp)) loge(ll_error,"Failed to install a bigger " ITEMMETA_FILENAME);
+  metamap();
+}
 
-  sequence= getsequence();
-  currenttime= gettime();
-  makelock(olditem,F_WRLCK,oldidfile);
-  if (!checknocont(olditem,saveditemid)) {
-    ufclose(index,INDEX_FILENAME); ufclose(olditem,oldidfile); return;
+static void metaheal(void) {
+  /* If a writer died half way, forgets the item it was changing. */
+  struct itemmeta *m;
+
+  if (!(meta->count & 1)) return;
+  if (meta->busy[0] && (m= metaslot(meta,meta->busy,0))) m->status[0]= 0;
+  meta->busy[0]= 0;
+  __sync_synchronize();
+  meta->count++;
+}
+
+static void metabegin(const char *id) {
+  /* We're about to change item id, or if it's 0 just to make a new
+   * one; the index must be locked. */
+  if (!metamap()) return;
+  metaheal();
+  if ((meta->used+2)*2 > meta->slots) {
+    metagrow();
+    if (!meta) return;
   }
-  oldsubject= getitemsubject(olditem,&emsg);
-  if (!oldsubject) ohshit("Item %s %s",saveditemid,emsg);
-  newid= createitem(index,sequence,currenttime,cmd,'C',saveditemid);
-  indexentry(index,sequence,currenttime,saveditemid,'F',oldsubject);
-  if (ufclose(index,INDEX_FILENAME))
-    ohshite("AARGH! Failed to close index after entry about %s",newid);
+  meta->count++;
+  __sync_synchronize();
+  strcpy(meta->busy,id ? id : "");
+}
 
-  if (fseek(olditem,ITEMID_LEN+1,SEEK_SET))
-    ohshite("AARGH! Item %s unseekable for recording continuation",saveditemid);
-  errno=0;
-  if (fwrite(newid,1,ITEMID_LEN,olditem)!=ITEMID_LEN)
-    ohshite("AARGH! Item %s unwriteable for recording continuation",saveditemid);
-  maycontinue= 0;
-  if (fseek(olditem,0,SEEK_END))
-    ohshite("AARGH! Item %s unseekable for appending continuationmarker");
-  if (fprintf(olditem, "\n^%08lX %08lX\n[Continued in %s by %s.]\n",
-              sequence, currenttime, newid, userid) == EOF)
-    ohshite("AARGH! Item %s unwriteable for appending continuationmarker",
-            saveditemid);
+static void metaend(void) {
+  if (!meta || !(meta->count & 1)) return;
+  meta->busy[0]= 0;
+  __sync_synchronize();
+  meta->count++;
+}
 
-  if (ufclose(olditem,oldidfile))
-      ohshite("AARGH! Failed to close item %s after continuing in %s",
-             saveditemid,newid);
-  printf("220 %08lX  Continuation item inserted and index updated.\r\n",
-         sequence);
+static void metaput(const char *id, const char *buf, long len) {
+  /* Records item id, which is now the len bytes at buf; between
+   * metabegin and metaend. */
+  struct itemmeta new, *m;
+
+  if (!meta || !(meta->count & 1)) return;
+  m= metaslot(meta,id,1);
+  if (!m) return;
+  if (!m->id[0]) meta->used++;
+  memset(&new,0,sizeof(new));
+  memcpy(new.id,id,ITEMID_LEN);
+  metaparse(buf,len,&new);
+  *m= new;
 }
 
-static void cmd_data(char *cmd) {
-  char mybuf[INPUTLINE_MAXLEN+5];
-  char erbuf[INDEXENTRY_LENINF+100];
-  const char *msg;
-  const char *formaterror;
-  int firstline, l;
-  char *linestart;
+static void metaputfile(const char *id, const char *idfile) {
+  /* The same, for an item we've written and closed. */
+  struct stat stab;
+  char *buf;
+  int fd;
 
-  if (!(noargs(cmd))) return;
-  if (data) fclose(data);
-  data= tmpfile();
-  if (!data) ohshite("Failed to create temporary file");
-  firstline= lenbeforeedit==-1 || saveditemid[0]; *grogname= 0;
-  printf("150 Send %s; finish with `.'\r\n",
-         lenbeforeedit==-1 ? "grogname and text" :
-         saveditemid[0] ? "item status (ignored) and updated contents" :
-                          "updated index");
-  settimeout(0,DATA_TIMEOUT);
-  formaterror= 0;
-  for (;;) {
-    if (!fgets(mybuf,INPUTLINE_MAXLEN,stdin)) {
-      if (alarmclosefd == -1) wastimeout();
-      if (ferror(stdin)) { loge(ll_trace,"error reading data, closing"); }
-      log(ll_trace,"EOF in data, closing"); exit(0);
-    }
-    l= strlen(mybuf);
-    if (l==0) ohshit("Unexpectedly completely empty line from fgets");
-    if (mybuf[--l] != '\n') {
-      formaterror= "512 Line in transmitted data is far too long.";
-      skiptonewline();
-      continue;
-    }
-    while (l>0 && isspace(mybuf[l-1])) l--;
-    if (*mybuf=='.') {
-      if (l==1) break;
-      if (mybuf[1] != '.') {
-        protocolviolation("582 Line starting with `.' wasn't "
-                          "dot-doubled or endmarker.");
-        log(ll_trace,"Dot-doubling messed up, closing");
-        exit(0);
-      }
-      l--;
-      linestart= mybuf+1;
-    } else {
-      linestart= mybuf;
-    }
-    if (!formaterror) {
-      if (lenbeforeedit!=-1 && !saveditemid[0]) {
-        if (l < INDEXENTRY_LENINF-1) {
-          memset(linestart+l,' ',INDEXENTRY_LENINF-1-l);
-          l= INDEXENTRY_LENINF-1;
-        }
-        msg=
-          l >= INDEXENTRY_LENINF                            ? "line too long"      :
-          strspn(linestart,"0123456789ABCDEFabcdef") != 8   ? "gsn format"         :
-          linestart[8] != ' '                               ? "space after gsn"    :
-          strspn(linestart+9,"0123456789ABCDEFabcdef") != 8 ? "date format"        :
-          linestart[17] != ' '                              ? "space after date"   :
-          !strchr("RICFEM",linestart[28+USERID_MAXLEN])     ? "RICFEM character"   :
-          linestart[27+USERID_MAXLEN] != ' '                ? "space after userid" :
-          linestart[29+USERID_MAXLEN] != ' '                ? "space after RICFEM" :
-          (linestart[28+USERID_MAXLEN] == 'M' ?
-           (strspn(linestart+18," ") < 9                    ? "itemid blank in M"  :
-            0 ) :
-           (!isalpha(linestart[18])                         ? "itemid letter"      :
-            strspn(linestart+19,"0123456789") != 7          ? "itemid digits"      :
-            linestart[26] != ' '                            ? "space after itemid" :
-            0 ));
-        if (msg) {
-          linestart[l]= 0;
-          sprintf(erbuf,"423 Malformed index entry `%.*s': %s.\r\n",
-                  INPUTLINE_MAXLEN-125, linestart, msg);
-          formaterror= erbuf;
-        }
-      } else {/* not a replacement index */
-        if (l > TEXTLINE_MAXLEN) {
-          l= TEXTLINE_MAXLEN;
-          formaterror= "423 Line too long for text of item.\r\n";
-        }
-      }
-    } /* !formaterror */
-    linestart[l]= 0;
-    if (firstline) {
-      if (l + sizeof(LONGGROGNAME_PFXSTRING)-1 > TEXTLINE_MAXLEN) {
-        formaterror= "425 Grogname too long.\r\n";
-      } else {
-        strcpy(grogname,linestart);
-      }
-      firstline= 0;
-    } else if (!formaterror) {
-      if (*linestart) {
-        if (*linestart=='^' && lenbeforeedit==-1) {
-          if (fputc('^',data)==EOF)
-            ohshite("Write failed ^-stuff to temp file");
-        }
-        if (fputs(linestart,data)<0) ohshite("Write failed to temporary file");
-      }
-      if (fputc('\n',data)==EOF)
-        ohshite("Write newline to temporary file failed");
-    }
-  }
-  alarm(0); if (alarmclosefd == -1) wastimeout();
-  if (formaterror) {
-    if (formaterror[0] == '5') {
-      protocolviolation(formaterror);
-    } else {
-      fputs(formaterror,stdout);
-    }
-    fclose(data);
-    data= 0;
+  if (!meta || !(meta->count & 1)) return;
+  buf= 0;
+  fd= open(idfile,O_RDONLY);
+  if (fd == -1 || fstat(fd,&stab) || !(buf= malloc(stab.st_size+1)) ||
+      pread(fd,buf,stab.st_size,0) != stab.st_size) {
+    loge(ll_error,"Failed to read item to summarise it");
+    metaput(id,"",0);
   } else {
-    if (fflush(data)) ohshite("Flushing data to temporary file");
-    rewind(data);
-    if (fstat(fileno(data),&dstab) <0)
-      ohshite("Reply temporary file unstattable");
-    if (lenbeforeedit==-1 && dstab.st_size > CONTRIB_MAXLEN) {
-      fputs("423 Data is too long for a Reply or Contribution.\r\n",stdout);
-      fclose(data); data=0;
-      return;
-    }
-    fputs("350 Data received, thanks.  What shall I do with it?\r\n",stdout);
+    metaput(id,buf,stab.st_size);
   }
+  free(buf);
+  if (fd != -1) close(fd);
 }
 
-static void cmd_newi(char *cmd) {
-  FILE *index;
-  char *newid;
-  unsigned long sequence;
-  time_t currenttime;
+static void metaforget(const char *id) {
+  struct itemmeta *m;
 
-  if (!noeditinprogress() || !datadone() || !subjectok(&cmd)) return;
-    
-  maycontinue= 0; /* Cancel any pending CONT possibility */
-  index= fopen(INDEX_FILENAME,"a");
-  if (!index) ohshite("Index inaccessible for reply append");
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-  sequence= getsequence();
-  currenttime= gettime();
-  newid= createitem(index, sequence, currenttime, cmd, 'I', "");
-  if (ufclose(index,INDEX_FILENAME))
-    ohshite("AARGH! Failed to close index after entry about %s",newid);
-  printf("220 %08lX  Item inserted and index updated.\r\n",sequence);
+  if (meta && (meta->count & 1) && (m= metaslot(meta,id,0))) m->status[0]= 0;
 }
 
-static void cmd_repl(char *cmd) {
-  FILE *item,*index;
-  struct stat istab;
-  char *datestring, *id;
-  char idfile[ITEM_MAXFILENAMELEN+5];
-  char headbuf[USERID_MAXLEN+INPUTLINE_MAXLEN+TEXTLINE_MAXLEN+5];
-  char *subjstart;
-  const char *emsg;
-  unsigned long sequence;
-  time_t currenttime;
+static void metaadd(struct metatable *t, const char *id, int fd, long offset, long len) {
+  /* Adds item id, the len bytes at offset in fd, to the new table t. */
+  struct itemmeta *m;
+  char *buf;
+
+  m= metaslot(t,id,1);
+  if (!m || m->id[0]) return;
+  buf= malloc(len+1);
+  if (!buf) return;
+  if (pread(fd,buf,len,offset) == len && metaparse(buf,len,m)) {
+    memcpy(m->id,id,ITEMID_LEN);
+    t->used++;
+  } else {
+    memset(m,0,sizeof(*m));
+  }
+  free(buf);
+}
 
-  if (!noeditinprogress() || !datadone() || !(id=getitemid(cmd))) return;
+static void metabuild(void) {
+  /* Makes the table afresh from the items, in their files and packed. */
+  char tmp[sizeof(ITEMMETA_FILENAME)+30], line[ITEMPACK_ENTRYLEN];
+  char idfile[ITEM_MAXFILENAMELEN+5], name[ITEMPACK_MAXFILENAMELEN+5];
+  struct packentry e;
+  struct metatable *t;
+  struct dirent *de;
+  struct stat stab;
+  FILE *table;
+  long n, slots, used;
+  size_t len;
+  DIR *dir;
+  int fd;
 
-  if (dstab.st_size > REPLY_MAXLEN) {
-    fputs("423 Data is too long for a Reply.\r\n",stdout);
-    fclose(data); data=0;
+  dir= opendir(ITEM_FILENAMEPFX);
+  if (!dir) { loge(ll_error,"Failed to read " ITEM_FILENAMEPFX " to summarise items"); return; }
+  for (n=0; (de= readdir(dir)); ) n+= packisid(de->d_name);
+  table= fopen(ITEMPACK_TABLE,"r");
+  if (table && !fstat(fileno(table),&stab)) n+= stab.st_size / ITEMPACK_ENTRYLEN;
+  for (slots= ITEMMETA_MINSLOTS; slots < (n+2)*2; slots*= 2);
+  sprintf(tmp,"%s.%ld",ITEMMETA_FILENAME,(long)getpid());
+  t= metanew(slots,tmp,&len);
+  if (!t) {
+    loge(ll_error,"Failed to make " ITEMMETA_FILENAME);
+    closedir(dir); if (table) fclose(table);
     return;
   }
-  
-  maycontinue= 0; /* Cancel any pending CONT possibility */
-  index= fopen(INDEX_FILENAME,"a");
-  if (!index) ohshite("Index inaccessible for reply append");
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-
-  id2file(id,idfile);
-  item= fopen(idfile,"r+");
-  if (!item) {
-    if (errno!=ENOENT) ohshite("Item %s inaccessible for reply",id);
-    noitem(id); ufclose(index,INDEX_FILENAME); return;
-  }
-  makelock(item,F_WRLCK,idfile);
-
-  if (!checknocont(item,id)) {
-    ufclose(index,INDEX_FILENAME); ufclose(item,idfile); return;
+  rewinddir(dir);
+  while ((de= readdir(dir))) {
+    if (!packisid(de->d_name)) continue;
+    id2file(de->d_name,idfile);
+    fd= open(idfile,O_RDONLY);
+    if (fd == -1) continue;
+    if (!fstat(fd,&stab)) metaadd(t,de->d_name,fd,0,stab.st_size);
+    close(fd);
   }
-  if (fstat(fileno(item),&istab) <0)
-    ohshite("Item %s unstattable for reply",id);
-  if (istab.st_size + dstab.st_size > ITEM_MAXLEN) {
-    fputs("421 Reply is too long to fit in the same item.\r\n",stdout);
-    strcpy(saveditemid,id); maycontinue= 1;
-    ufclose(index,INDEX_FILENAME); ufclose(item,idfile); return;
+  closedir(dir);
+  while (table && fread(line,ITEMPACK_ENTRYLEN,1,table) == 1) {
+    if (packparse(line,&e)) continue;
+    id2file(e.id,idfile);
+    if (!access(idfile,F_OK)) continue; /* its file wins */
+    packfilename(name,e.seg);
+    fd= open(name,O_RDONLY);
+    if (fd == -1) continue;
+    metaadd(t,e.id,fd,e.offset,e.len);
+    close(fd);
   }
-  sequence= getsequence();
-  currenttime= gettime();
-  subjstart= getitemsubject(item,&emsg);
-  if (!subjstart) ohshit("Item %s %s",id,emsg);
-  if (fseek(item,ITEMID_LEN*2+11,SEEK_SET))
-    ohshite("Item %s unseekable for recording reply sequence",id);
-  if (fprintf(item,"%08lX",sequence) == EOF)
-    ohshite("AARGH! Item %s recording reply sequence failed",id);
-  if (fseek(item,0,SEEK_END)) ohshite("AARGH! Item %s unseekable to end",id);
+  if (table) fclose(table);
+  used= t->used;
+  if (metainstall(t,len,tmp)) { loge(ll_error,"Failed to install " ITEMMETA_FILENAME); return; }
+  log(ll_trace,"Summarised %ld items",used);
+}
 
-  datestring= makedatestring(currenttime);
-  if (!*grogname) {
-    sprintf(headbuf,REPLYSTART_PFXSTRING "from %s at %s\n",userid,datestring);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              REPLYSTART_PFXSTRING "submitted at %s by\n"
-              LONGUSERID_PFXSTRING "%s\n",
-              datestring,userid);
-  } else {
-    sprintf(headbuf,REPLYSTART_PFXSTRING "from %s (%s) at %s\n",
-            grogname,userid,datestring);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              REPLYSTART_PFXSTRING "from %s at %s\n"
-              LONGGROGNAME_PFXSTRING "%s\n",
-              userid,datestring,grogname);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              REPLYSTART_PFXSTRING "from %s at %s\n"
-              LONGUSERID_PFXSTRING "%s\n",
-              grogname,datestring,userid);
-    if (line1toolong(headbuf))
-      sprintf(headbuf,
-              REPLYSTART_PFXSTRING "submitted at %s\n"
-              LONGGROGNAME_PFXSTRING "%s\n"
-              LONGUSERID_PFXSTRING "%s\n",
-              datestring,grogname,userid);
-  }
-  if (fprintf(item,"\n^%08lX %08lX\n%s\n",sequence,currenttime,headbuf) == EOF)
-    ohshite("AARGH! Failed to write reply header to %s",id);
-  copycontrib(item,id);
-  unlock(item,idfile);
-  
-  indexentry(index, sequence, currenttime, id, 'R', subjstart);
-  if (ufclose(index,INDEX_FILENAME))
-    ohshite("AARGH! Failed to close index after reply to %s",id);
-  printf("220 %08lX  Reply to %s inserted and index updated.\r\n",sequence,id);
+static void metainit(void) {
+  /* Makes sure there's a table we can use before we start. */
+  FILE *index;
+
+  index= fopen(INDEX_FILENAME,"r+");
+  if (!index) { loge(ll_error,"Index inaccessible to summarise items"); return; }
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  if (metamap()) metaheal(); else metabuild();
+  ufclose(index,INDEX_FILENAME);
 }
 
 /*
- * Retreival
+ * Index segments
+ *
+ * The index is kept as a series of sealed segments in INDEXSEG_DIR,
+ * listed in order in the manifest, followed by the index file itself,
+ * which is the head segment: entries are only ever appended to the
+ * head, and it's the head that everyone locks.  When the head is full
+ * indexentry seals it, copying it to a new segment and truncating it.
+ * Sealed segments are never changed: EDCF of the index and withdrawal
+ * write replacements for just the ones they affect, under new numbers,
+ * and then a new manifest.  Taken together the segments are exactly
+ * the index as it always was, and that's what INDX and EDIX send.
+ *
+ * Next to each segment is a binary companion (with KEYS_FILENAMESFX)
+ * holding each entry's sequence number, date and type as a struct
+ * indexkey, so that searches needn't parse the text.  Like the wire
+ * twins it starts with the wirekey of the segment it was made from,
+ * and is remade by whoever finds it missing or stale; indexentry adds
+ * to the head's as it appends.  Making one checks every entry, so an
+ * index with a companion is known to be well-formed.
  */
 
-static void cmd_elog(char *cmd) {
-  FILE *elog;
+struct indexkey {
+  uint64_t sequence, date;
+  uint32_t offset;            /* of the entry in its segment */
+  char type, spare[3];
+};
 
-  if (!noargs(cmd)) return;
-  elog= fopen(EDITLOG_FILENAME,"r");
-  if (!elog) {
-    if (errno==ENOENT) {
-      fputs("250 No edits stored\r\n.\r\n",stdout); return;
-    }
-    ohshite("Edit log `" EDITLOG_FILENAME "' inaccessible");
-  }
-  copyfile(elog,EDITLOG_FILENAME);
-  fclose(elog);
+struct segment {
+  long num;                   /* file number, or -1 for the head */
+  long start, records;        /* start is the number of its first entry */
+  long firstseq, firstdate, lastseq, lastdate;
+  const char *map;
+  size_t maplen;
+  const char *keysmap;        /* 0 if not mapped yet, or nokeys */
+  size_t keyslen;
+  int nokeys;
+};
+
+struct indexview {
+  int nsegs;                  /* the head is the last */
+  struct segment *segs;
+  long records, nextnum;
+  int headfd;
+};
+
+static int indexfield(const char *p, const char *end, long *valuer) {
+  /* Reads the hex number at p, which must be followed by a space
+   * before end.  Returns 0 if it isn't. */
+  long v= 0;
+
+  for (; p < end && isxdigit((unsigned char)*p); p++)
+    v= v*16 + (isdigit((unsigned char)*p) ? *p-'0' : toupper((unsigned char)*p)-'A'+10);
+  *valuer= v;
+  return p < end && *p == ' ';
 }
 
-static void cmd_indx(char *cmd) {
-  FILE *index;
-  long datefrom,here;
-  int min,max,try,useseq=0;
-  struct stat stab;
-  char buf[INDEXENTRY_LENINF+5];
-  char *estr;
+static void segfilename(char *buf, long num) {
+  if (num < 0) strcpy(buf,INDEX_FILENAME);
+  else sprintf(buf,"%s%08lX",INDEXSEG_DIR,num);
+}
 
-  if (*cmd == '#') { cmd++; useseq=1; }
-  if (*cmd) {
-    datefrom= strtol(cmd,&estr,16);
-    if (*estr) { protocolviolation("511 Date must be only a hex number."); return; }
-  } else {
-    datefrom= 0;
+static int segvalues(struct segment *seg, const char *first, const char *last) {
+  /* Fills in seg's first and last sequence numbers and dates. */
+  return indexfield(first,first+INDEXENTRY_LENINF,&seg->firstseq) &&
+    indexfield(first+9,first+INDEXENTRY_LENINF,&seg->firstdate) &&
+    indexfield(last,last+INDEXENTRY_LENINF,&seg->lastseq) &&
+    indexfield(last+9,last+INDEXENTRY_LENINF,&seg->lastdate) ? 0 : -1;
+}
+
+static int ixopen(struct indexview *v, int headfd) {
+  /* Describes the index whose head is open and locked on headfd.
+   * Returns 0, or -1 with errno set. */
+  char first[INDEXENTRY_LENINF], last[INDEXENTRY_LENINF];
+  struct segment seg, *head;
+  struct stat stab;
+  FILE *manifest;
+  int size, r, esave;
+
+  v->nsegs= size= 0; v->segs= 0;
+  v->records= v->nextnum= 0; v->headfd= headfd;
+  manifest= fopen(INDEXSEG_MANIFEST,"r");
+  if (!manifest && errno != ENOENT) return -1;
+  for (;;) {
+    if (v->nsegs == size) {
+      size= size ? size*2 : 16;
+      v->segs= realloc(v->segs,size*sizeof(*v->segs));
+      if (!v->segs) goto x_fail;
+    }
+    if (!manifest) break;
+    memset(&seg,0,sizeof(seg));
+    r= fscanf(manifest,"%lx %ld %lx %lx %lx %lx\n",&seg.num,&seg.records,
+              &seg.firstseq,&seg.firstdate,&seg.lastseq,&seg.lastdate);
+    if (r == EOF && !ferror(manifest)) break;
+    if (r != 6 || seg.records <= 0) { errno= EINVAL; goto x_fail; }
+    seg.start= v->records;
+    v->segs[v->nsegs++]= seg;
+    v->records+= seg.records;
+    if (seg.num >= v->nextnum) v->nextnum= seg.num+1;
   }
-  index= fopen(INDEX_FILENAME,"r"); if (!index) ohshite("Index inaccessible");
-  makelock(index,F_RDLCK,INDEX_FILENAME);
-  if (fstat(fileno(index),&stab)) ohshite("Index unstattable");
-  if (stab.st_size % INDEXENTRY_LENINF)
-    ohshit("Index corrupt - invalid length %d",stab.st_size);
-  min=0; max= stab.st_size / INDEXENTRY_LENINF;
-  if (debuglevel > 2)
-    printf("119  min=%-2d  max=%-2d          want=%08lx\r\n",min,max,datefrom);
+  if (manifest) { fclose(manifest); manifest= 0; }
+
+  head= &v->segs[v->nsegs++];
+  memset(head,0,sizeof(*head));
+  head->num= -1;
+  head->start= v->records;
+  if (fstat(headfd,&stab)) goto x_fail;
+  if (stab.st_size % INDEXENTRY_LENINF) { errno= EINVAL; goto x_fail; }
+  head->records= stab.st_size / INDEXENTRY_LENINF;
+  if (head->records &&
+      (pread(headfd,first,sizeof(first),0) != sizeof(first) ||
+       pread(headfd,last,sizeof(last),stab.st_size-sizeof(last)) != sizeof(last) ||
+       segvalues(head,first,last))) {
+    errno= EINVAL; goto x_fail;
+  }
+  v->records+= head->records;
+  return 0;
+
+ x_fail:
+  esave= errno;
+  if (manifest) fclose(manifest);
+  free(v->segs); v->segs= 0; v->nsegs= 0;
+  errno= esave;
+  return -1;
+}
+
+static void ixclose(struct indexview *v) {
+  int i;
+
+  for (i=0; i<v->nsegs; i++) {
+    if (v->segs[i].map) munmap((void*)v->segs[i].map,v->segs[i].maplen);
+    if (v->segs[i].keysmap) munmap((void*)v->segs[i].keysmap,v->segs[i].keyslen);
+  }
+  free(v->segs);
+}
+
+static int ixseg(const struct indexview *v, long i) {
+  /* Returns the segment holding entry i (the head, if it's past the end). */
+  int min, max, try;
+
+  min= 0; max= v->nsegs-1;
+  while (min < max) {
+    try= (min+max+1)>>1;
+    if (v->segs[try].start <= i) { min=try; } else { max=try-1; }
+  }
+  return min;
+}
+
+static int ixfindseg(const struct indexview *v, int useseq, long want) {
+  /* Returns the first segment whose last entry is at or after want. */
+  const struct segment *seg;
+  int min, max, try;
+
+  min= 0; max= v->nsegs-1;
   while (min < max) {
     try= (min+max)>>1;
-    if (fseek(index,try*INDEXENTRY_LENINF,SEEK_SET))
-      ohshite("Index unseekable during search %d",try);
-    if (fread(buf,INDEXENTRY_LENINF,1,index) != 1)
-      ohshite("Index unreadable during search");
-    here= strtol(useseq ? buf : buf+9, &estr, 16);
-    if (debuglevel > 2)
-      printf("119  min=%-2d  max=%-2d  try=%-2d  here=%08lx\r\n",
-             min, max, try, here);
-    if (*estr != ' ') ohshit("Index has corrupted record %d",try);
-    if (here >= datefrom) { max=try; } else { min=try+1; }
-  }
-  if (debuglevel > 2)
-    printf("119  min=%-2d  max=%-2d\r\n",min,max);
-  if (fseek(index,min*INDEXENTRY_LENINF,SEEK_SET)) ohshite("Index unseekable");
-  copyfile(index,INDEX_FILENAME);
-  ufclose(index,INDEX_FILENAME);
+    seg= &v->segs[try];
+    if ((useseq ? seg->lastseq : seg->lastdate) >= want) { max=try; } else { min=try+1; }
+  }
+  return min;
 }
 
-static void cmd_motd(char *cmd) {
-  FILE *motd;
+static const char *ixrecord(struct indexview *v, long i) {
+  /* Returns entry i, mapping its segment if need be; or 0 with errno set. */
+  char name[INDEXSEG_MAXFILENAMELEN+5];
+  struct segment *seg;
+  struct stat stab;
+  void *p;
+  int fd;
 
-  if (!noargs(cmd)) return;
-  motd= fopen(MOTD_FILENAME,"r");
-  if (!motd) {
-    if (errno!=ENOENT) ohshite("Message of the Day inaccessible");
-    printf("410 There is no message of the day.\r\n");
-    return;
+  seg= &v->segs[ixseg(v,i)];
+  if (i < seg->start || i >= seg->start+seg->records) { errno= EINVAL; return 0; }
+  if (!seg->map) {
+    seg->maplen= (size_t)seg->records*INDEXENTRY_LENINF;
+    if (seg->num < 0) {
+      p= mmap(0,seg->maplen,PROT_READ,MAP_SHARED,v->headfd,0);
+    } else {
+      segfilename(name,seg->num);
+      fd= open(name,O_RDONLY);
+      if (fd == -1) return 0;
+      if (fstat(fd,&stab) || stab.st_size != seg->maplen) {
+        close(fd); errno= EINVAL; return 0;
+      }
+      p= mmap(0,seg->maplen,PROT_READ,MAP_SHARED,fd,0);
+      close(fd);
+    }
+    if (p == MAP_FAILED) return 0;
+    seg->map= p;
   }
-  makelock(motd,F_RDLCK,MOTD_FILENAME);
-  copyfile(motd,MOTD_FILENAME);
-  ufclose(motd,MOTD_FILENAME);
+  return seg->map + (size_t)(i - seg->start)*INDEXENTRY_LENINF;
 }
 
-static void cmd_item(char *cmd) {
-  FILE *item;
-  char idfile[ITEM_MAXFILENAMELEN+5], *id;
+static int ixread(struct indexview *v, long first, long n, char *buf) {
+  /* Copies n entries from first into buf.  Returns 0 or -1. */
+  const char *rec;
+  long i;
 
-  if (!(id=getitemid(cmd))) return;
-  id2file(id,idfile);
-  item= fopen(idfile,"r");
-  if (!item) {
-    if (errno!=ENOENT) ohshite("Item %s inaccessible",id);
-    noitem(id); return;
+  for (i=0; i<n; i++) {
+    rec= ixrecord(v,first+i);
+    if (!rec) return -1;
+    memcpy(buf+(size_t)i*INDEXENTRY_LENINF,rec,INDEXENTRY_LENINF);
   }
-  makelock(item,F_RDLCK,idfile);
-  copyfile(item,id);
-  ufclose(item,idfile);
+  return 0;
 }
 
-static void cmd_diff(char *cmd) {
-  FILE *file, *diff;
-  char *id;
-  char filename[ITEM_MAXFILENAMELEN+5];
-  char filename2[ITEM_MAXFILENAMELEN+sizeof(EDITED_FILENAMESFX)+5];
+static void keysfilename(char *buf, const char *name) {
+  strcpy(buf,name);
+  strcat(buf,KEYS_FILENAMESFX);
+}
 
-  if (*cmd) {
-    if (!(id=getitemid(cmd))) return;
-    id2file(id,filename);
-  } else {
-    strcpy(filename,INDEX_FILENAME);
-    id= 0;
+static int keyswrite(int fd, off_t from, off_t to, FILE *out) {
+  /* Writes the keys of the entries between from and to in the segment
+   * open on fd.  Returns 0, or -1 if we couldn't or one is corrupt. */
+  char buf[KEYS_READRECORDS*INDEXENTRY_LENINF], *rec;
+  struct indexkey key;
+  long sequence, date;
+  off_t pos;
+  int n, i;
+
+  memset(&key,0,sizeof(key));
+  for (pos=from; pos<to; pos+=n) {
+    n= pread(fd,buf, to-pos < sizeof(buf) ? to-pos : sizeof(buf), pos);
+    if (n<0 && errno == EINTR) { n= 0; continue; }
+    if (n<=0 || n % INDEXENTRY_LENINF) return -1;
+    for (i=0; i<n; i+=INDEXENTRY_LENINF) {
+      rec= buf+i;
+      if (!indexfield(rec,rec+INDEXENTRY_LENINF,&sequence) ||
+          !indexfield(rec+9,rec+INDEXENTRY_LENINF,&date) ||
+          rec[INDEXENTRY_LENINF-1] != '\n')
+        return -1;
+      key.sequence= sequence; key.date= date;
+      key.offset= pos+i;
+      key.type= rec[20+ITEMID_LEN+USERID_MAXLEN];
+      if (fwrite(&key,sizeof(key),1,out) != 1) return -1;
+    }
   }
-  strcpy(filename2,filename);
-  strcat(filename2,EDITED_FILENAMESFX);
-  
-  file= fopen(filename,"r");
-  if (file) {
-    makelock(file,F_RDLCK,filename);
-  } else if (errno!=ENOENT) {
-    ohshite("Item/index file %s inaccessible",filename);
+  return 0;
+}
+
+static int keysrender(int fd, const char *name) {
+  /* Makes a new companion for the segment name, open on fd.
+   * Returns 0, or -1 if we couldn't. */
+  char keys[KEYS_MAXFILENAMELEN+5];
+  char tmp[sizeof(keys)+30];
+  struct wirekey k;
+  FILE *out;
+
+  keysfilename(keys,name);
+  sprintf(tmp,"%s.%ld",keys,(long)getpid());
+  if (getwirekey(fd,&k) || k.size % INDEXENTRY_LENINF) return -1;
+  out= fopen(tmp,"w");
+  if (!out) { loge(ll_error,"Failed to create index companion"); return -1; }
+  if (fwrite(&k,sizeof(k),1,out) != 1 || keyswrite(fd,0,k.size,out)) {
+    fclose(out); unlink(tmp); unlink(keys);
+    log(ll_error,"Failed to make companion for %s",name);
+    return -1;
   }
+  if (fclose(out) || rename(tmp,keys)) {
+    loge(ll_error,"Failed to install index companion");
+    unlink(tmp); return -1;
+  }
+  return 0;
+}
 
-  diff= fopen(filename2,"r");
-  if (!diff) {
-    if (errno!=ENOENT) ohshite("Diff file %s inaccessible",filename2);
-    fputs("410 There are no relevant diffs.\r\n",stdout); ufclose(file,filename);
-  } else {
-    copyfile(diff,filename2);
-    fclose(diff);
+static void keysappend(int fd, const char *name, const struct wirekey *before) {
+  /* Brings the companion up to date after entries have been appended
+   * to the segment name, which looked like *before until then. */
+  char keys[KEYS_MAXFILENAMELEN+5];
+  struct wirekey k, oldk;
+  FILE *out;
+
+  keysfilename(keys,name);
+  out= fopen(keys,"r+");
+  if (!out ||
+      fread(&oldk,sizeof(oldk),1,out) != 1 || memcmp(&oldk,before,sizeof(oldk)) ||
+      getwirekey(fd,&k) || k.size % INDEXENTRY_LENINF || fseek(out,0,SEEK_END) ||
+      keyswrite(fd,before->size,k.size,out) ||
+      fseek(out,0,SEEK_SET) || fwrite(&k,sizeof(k),1,out) != 1) {
+    if (out) fclose(out);
+    keysrender(fd,name);
+    return;
   }
-  if (file) ufclose(file,filename);
+  if (fclose(out)) keysrender(fd,name);
 }
 
-static void cmd_stat(char *cmd) {
-  FILE *item;
-  char idfile[ITEM_MAXFILENAMELEN+5], *id;
-  char statusbuf[ITEMID_LEN*2+21+5];
-  char *subjstart;
-  const char *emsg;
-  
-  if (!(id=getitemid(cmd))) return;
-  maycontinue= 0; /* Cancel any pending CONT possibility */
-  id2file(id,idfile);
-  item= fopen(idfile,"r");
-  if (!item) {
-    if (errno!=ENOENT) ohshite("Item %s inaccessible",id);
-    noitem(id); return;
+static const struct indexkey *ixkey(struct indexview *v, long i) {
+  /* Returns entry i's key, or 0 if its segment has no usable companion. */
+  char name[INDEXSEG_MAXFILENAMELEN+5], keys[KEYS_MAXFILENAMELEN+5];
+  struct segment *seg;
+  struct wirekey k, kk;
+  struct stat stab;
+  void *p;
+  int fd, kfd, tries;
+
+  seg= &v->segs[ixseg(v,i)];
+  if (i < seg->start || i >= seg->start+seg->records) return 0;
+  if (!seg->keysmap) {
+    if (seg->nokeys) return 0;
+    seg->nokeys= 1;
+    segfilename(name,seg->num);
+    keysfilename(keys,name);
+    fd= seg->num < 0 ? v->headfd : open(name,O_RDONLY);
+    if (fd == -1 || getwirekey(fd,&k)) goto x_close;
+    for (tries=0; ; tries++) {
+      kfd= open(keys,O_RDONLY);
+      if (kfd != -1 &&
+          pread(kfd,&kk,sizeof(kk),0) == sizeof(kk) && !memcmp(&k,&kk,sizeof(k)) &&
+          !fstat(kfd,&stab) &&
+          stab.st_size == sizeof(kk) + (off_t)seg->records*sizeof(struct indexkey))
+        break;
+      if (kfd != -1) close(kfd);
+      if (tries || keysrender(fd,name)) goto x_close;
+    }
+    seg->keyslen= stab.st_size;
+    p= mmap(0,seg->keyslen,PROT_READ,MAP_SHARED,kfd,0);
+    close(kfd);
+    if (p == MAP_FAILED) goto x_close;
+    seg->keysmap= p;
+    seg->nokeys= 0;
+  x_close:
+    if (fd != -1 && fd != v->headfd) close(fd);
+    if (!seg->keysmap) return 0;
   }
-  makelock(item,F_RDLCK,idfile);
-  if (!fgets(statusbuf,ITEMID_LEN*2+21,item)) {
-    if (ferror(item)) ohshite("Item %s status unreadable",id);
-    noitem(id); return;
+  return (const struct indexkey*)(seg->keysmap + sizeof(struct wirekey)) + (i - seg->start);
+}
+
+static long ixvalue(struct indexview *v, long i, int useseq) {
+  /* Returns entry i's sequence number or date, from the companion if
+   * we can and from the text if not. */
+  const struct indexkey *key;
+  const char *rec;
+  long here;
+
+  key= ixkey(v,i);
+  if (key) return useseq ? key->sequence : key->date;
+  rec= ixrecord(v,i);
+  if (!rec) ohshite("Index unmappable");
+  if (!indexfield(useseq ? rec : rec+9, rec+INDEXENTRY_LENINF, &here))
+    ohshit("Index has corrupted record %ld",i);
+  return here;
+}
+
+static long ixsearch(struct indexview *v, int useseq, long want) {
+  /* Returns the first entry with a sequence number or date of want or
+   * later, or v->records if there isn't one. */
+  const struct segment *seg;
+  long min, max, try;
+
+  seg= &v->segs[ixfindseg(v,useseq,want)];
+  min= seg->start; max= seg->start+seg->records;
+  while (min < max) {
+    try= (min+max)>>1;
+    if (ixvalue(v,try,useseq) >= want) { max=try; } else { min=try+1; }
   }
-  if (strlen(statusbuf) != ITEMID_LEN*2+20 ||
-      statusbuf[ITEMID_LEN*2+19] != '\n')
-    ohshit("Item %s has corrupted status line",id);
-  statusbuf[ITEMID_LEN*2+19]= 0;
-  subjstart= getitemsubject(item,&emsg);
-  if (!subjstart) ohshit("Item %s %s",id,emsg);
-  ufclose(item,idfile);
-  printf("211 %s %s\r\n",statusbuf,subjstart);
+  return min;
 }
 
-/*
- * Editing
- */
+static void ixcopy(struct indexview *v, long first, long n, FILE *out) {
+  /* Writes n entries from first to out. */
+  const char *rec;
+  long i;
 
-static void cmd_edlk(char *cmd) {
-  struct flock fl;
-  char uidbuf[USERID_MAXLEN+1];
-  
-  if (!noargs(cmd)) return;
-  if (edit) { protocolviolation("500 EDLK already issued."); return; }
-  
-  edit= fopen(EDITLOCK_FILENAME,"r+");
-  if (!edit) ohshite("Edit lockfile `" EDITLOCK_FILENAME "' inaccessible");
-  
-  fl.l_type= F_WRLCK;
-  fl.l_whence= SEEK_SET;
-  fl.l_start= 0;
-  fl.l_len= USERID_MAXLEN;
-  if (fcntl(fileno(edit),F_SETLK,&fl) == -1) {
-    if (errno == EACCES || errno == EAGAIN) {
-      errno=0; if (fread(uidbuf,1,USERID_MAXLEN,edit) != USERID_MAXLEN)
-        ohshite("Failed to read userid of locking editor from "
-                EDITLOCK_FILENAME);
-      fclose(edit); edit=0; uidbuf[USERID_MAXLEN]=0;
-      printf("411 %s has locked the message area for editing\r\n",uidbuf);
-      return;
-    }
-    ohshite("Failed to lock " EDITLOCK_FILENAME);
+  for (i=0; i<n; i++) {
+    rec= ixrecord(v,first+i);
+    if (!rec) ohshite("Index unmappable");
+    if (fwrite(rec,INDEXENTRY_LENINF,1,out) != 1) ohshite("Failed to copy index");
   }
-  errno=0; if (fwrite(userid,1,USERID_MAXLEN,edit) != USERID_MAXLEN)
-    ohshite("Failed to write own userid to " EDITLOCK_FILENAME);
-  if (fflush(edit)) ohshite("Failed to flush userid into edit flag file");
-  fputs("200 Message area is now locked for editing.\r\n",stdout);
 }
 
-static void cmd_edul(char *cmd) {
-  if (!noargs(cmd) || !noeditinprogress()) return;
-  if (!edit) { protocolviolation("532 No lock held so can't unlock it."); return; }
-  
-  rewind(edit);
-  errno=0; if (fwrite("??",1,3,edit)!=3)
-    ohshite("Failed to erase own userid from " EDITLOCK_FILENAME);
-  if (fclose(edit))
-    ohshite("Failed to close " EDITLOCK_FILENAME " after erasing my userid");
-  edit=0;
-  fputs("200 Lock on edit area relinquished.\r\n",stdout);
+static void ixwriteseg(struct indexview *v, struct segment *seg,
+                       const char *recs, long n) {
+  /* Writes n entries from recs to a new sealed segment, described in seg. */
+  char name[INDEXSEG_MAXFILENAMELEN+5];
+  FILE *file;
+
+  memset(seg,0,sizeof(*seg));
+  seg->num= v->nextnum++;
+  seg->records= n;
+  if (segvalues(seg,recs,recs+(size_t)(n-1)*INDEXENTRY_LENINF))
+    ohshit("Index has a corrupted entry, can't write segment");
+  segfilename(name,seg->num);
+  file= fopen(name,"w+");
+  if (!file) ohshite("AARGH! Failed to create index segment %s",name);
+  if (fwrite(recs,INDEXENTRY_LENINF,n,file) != n || fflush(file))
+    ohshite("AARGH! Failed to write index segment %s",name);
+  wirerender(fileno(file),name);
+  keysrender(fileno(file),name);
+  if (fclose(file)) ohshite("AARGH! Failed to write index segment %s",name);
 }
 
-static void startedit(char *id) {
+static void ixwritemanifest(const struct segment *segs, int n) {
+  /* Installs a new manifest listing the n sealed segments at segs. */
+  char tmp[sizeof(INDEXSEG_MANIFEST)+30];
   FILE *file;
-  char idfile[ITEM_MAXFILENAMELEN+5];
-  const char *filename;
-  struct stat istab;
+  int i;
 
-  if (!noeditinprogress()) return;
-  if (!edit) { protocolviolation("532 EDLK required before EDIT/EDIX."); return; }
-  maycontinue= 0; /* Cancel any pending CONT possibility */
+  sprintf(tmp,"%s.%ld",INDEXSEG_MANIFEST,(long)getpid());
+  file= fopen(tmp,"w");
+  if (!file) ohshite("AARGH! Failed to create new index manifest");
+  for (i=0; i<n; i++)
+    if (fprintf(file,"%08lX %ld %08lX %08lX %08lX %08lX\n",
+                segs[i].num,segs[i].records,segs[i].firstseq,segs[i].firstdate,
+                segs[i].lastseq,segs[i].lastdate) == EOF)
+      ohshite("AARGH! Failed to write new index manifest");
+  if (fclose(file)) ohshite("AARGH! Failed to write new index manifest");
+  if (rename(tmp,INDEXSEG_MANIFEST)) ohshite("AARGH! Failed to install new index manifest");
+}
 
-  if (id) {
-    id2file(id,idfile); filename= idfile;
-  } else {
-    filename= INDEX_FILENAME;
+static void ixrewrite(struct indexview *v, int sa, int sb,
+                      const char *recs, long n, FILE *index) {
+  /* Replaces segments sa to sb with the n entries at recs, which mustn't
+   * be in any of v's mappings.  If sb is the head, the last entries go in
+   * the head, and any full segments' worth before them are sealed;
+   * index is the head, open and locked. */
+  char name[INDEXSEG_MAXFILENAMELEN+5], wire[WIRE_MAXFILENAMELEN+5];
+  char keys[KEYS_MAXFILENAMELEN+5];
+  struct segment *segs, *head;
+  long headn, i, chunk;
+  int nsegs, s, k;
+
+  head= sb == v->nsegs-1 ? &v->segs[sb] : 0;
+  headn= head ? n % INDEXSEG_RECORDS : 0;
+  nsegs= v->nsegs - (sb-sa+1) + (n-headn+INDEXSEG_RECORDS-1)/INDEXSEG_RECORDS + (head ? 1 : 0);
+  segs= malloc(nsegs*sizeof(*segs));
+  if (!segs) ohshite("No memory to rewrite index segments");
+  if (mkdir(INDEXSEG_DIR,0777) && errno != EEXIST)
+    ohshite("AARGH! Failed to make " INDEXSEG_DIR);
+
+  for (k=0; k<sa; k++) segs[k]= v->segs[k];
+  for (i=0; i<n-headn; i+=chunk) {
+    chunk= n-headn-i > INDEXSEG_RECORDS ? INDEXSEG_RECORDS : n-headn-i;
+    ixwriteseg(v,&segs[k++],recs+(size_t)i*INDEXENTRY_LENINF,chunk);
   }
-  file= fopen(filename,"r");
-  if (!file) {
-    if (errno!=ENOENT) ohshite("%s inaccessible",filename);
-    noitem(id); return;
+  for (s=sb+1; s<v->nsegs; s++) segs[k++]= v->segs[s];
+  if (head) {
+    memset(&segs[k],0,sizeof(segs[k]));
+    segs[k].num= -1;
+    segs[k].records= headn;
+    if (headn)
+      segvalues(&segs[k],recs+(size_t)(n-headn)*INDEXENTRY_LENINF,
+                recs+(size_t)(n-1)*INDEXENTRY_LENINF);
+    k++;
   }
-  makelock(file,F_RDLCK,filename);
-  if (fstat(fileno(file),&istab))
-    ohshite("%s unstattable before edit",filename);
-  lenbeforeedit= istab.st_size;
-  copyfile(file,filename);
-  ufclose(file,filename);
+  ixwritemanifest(segs,nsegs-1);
+
+  if (head) {
+    if (head->map) munmap((void*)head->map,head->maplen);
+    head->map= 0;
+    if (fflush(index) || ftruncate(fileno(index),0) || fseek(index,0,SEEK_SET) ||
+        fwrite(recs+(size_t)(n-headn)*INDEXENTRY_LENINF,INDEXENTRY_LENINF,headn,index) != headn ||
+        fflush(index))
+      ohshite("AARGH! Failed to rewrite index");
+    wirerender(fileno(index),INDEX_FILENAME);
+    keysrender(fileno(index),INDEX_FILENAME);
+  }
+  for (s=sa; s<=sb; s++) {
+    if (v->segs[s].map) munmap((void*)v->segs[s].map,v->segs[s].maplen);
+    if (v->segs[s].keysmap) munmap((void*)v->segs[s].keysmap,v->segs[s].keyslen);
+    if (v->segs[s].num < 0) continue;
+    segfilename(name,v->segs[s].num);
+    wirefilename(wire,name);
+    unlink(wire);
+    deflatedfilename(wire,name);
+    unlink(wire);
+    keysfilename(keys,name);
+    unlink(keys);
+    if (unlink(name)) loge(ll_error,"Failed to remove old index segment");
+  }
+  free(v->segs);
+  v->segs= segs; v->nsegs= nsegs;
+  for (s=0, v->records=0; s<nsegs; s++) {
+    segs[s].start= v->records;
+    v->records+= segs[s].records;
+  }
+}
 
-  log(ll_trace,"Editing %s",filename);
+static void snapindex(struct snapshot *snap, struct indexview *v,
+                      FILE *index, long from, long to) {
+  /* Snapshots the index entries from from to to-1. */
+  char name[INDEXSEG_MAXFILENAMELEN+5];
+  struct segment *seg;
+  const char *rec;
+  FILE *file, *mem;
+  long skip, n, i;
+  int s;
+
+  for (s= ixseg(v,from); s<v->nsegs && v->segs[s].start < to; s++) {
+    seg= &v->segs[s];
+    skip= from > seg->start ? from - seg->start : 0;
+    n= (to < seg->start+seg->records ? to - seg->start : seg->records) - skip;
+    if (n <= 0) continue;
+    segfilename(name,seg->num);
+    if (seg->num < 0) {
+      file= index;
+    } else {
+      file= fopen(name,"r");
+      if (!file) ohshite("Index segment %s inaccessible",name);
+    }
+    if (snapwire(snap,fileno(file),name,(off_t)skip*(INDEXENTRY_LENINF+1),
+                 (off_t)seg->records*(INDEXENTRY_LENINF+1))) {
+      snap->parts[snap->nparts-1].len= (off_t)n*(INDEXENTRY_LENINF+1);
+    } else {
+      /* no twin, or its lines aren't all the same length so skip is no use */
+      mem= snapstream(snap,name);
+      for (i=0; i<n; i++) {
+        rec= ixrecord(v,seg->start+skip+i);
+        if (!rec) ohshite("Index unmappable");
+        if (memchr(rec,0,INDEXENTRY_LENINF) || rec[INDEXENTRY_LENINF-1] != '\n')
+          ohshit("Index segment %s has corrupted record %ld",name,skip+i);
+        fwrite(rec,1,INDEXENTRY_LENINF-1,mem);
+        fputs("\r\n",mem);
+      }
+      if (fclose(mem)) ohshite("Failed to make snapshot of %s",name);
+    }
+    if (file != index) fclose(file);
+  }
+}
+
+/*
+ * Index mirror
+ *
+ * Nearly every INDX is a client polling for the last few entries, so
+ * the daemon keeps the tail of the index in shared memory which every
+ * session inherits.  Writers update it as they append to the index
+ * (they hold the index lock, so there's only ever one at a time), and
+ * INDX copies what it wants out of it without opening or locking
+ * anything.  The count is odd while the mirror is being changed, so a
+ * reader can tell if it raced with a writer.  The mirror also holds the
+ * wirekey of the index it matches, which readers check against the
+ * index itself: if they differ (after EDIX or a withdrawal, say) or the
+ * mirror doesn't go back far enough, INDX reads the file as before.
+ *
+ * Clients waiting for new entries use WAIT rather than polling.  Each
+ * change to the mirror bumps wake and wakes everyone blocked on it as
+ * a futex, who then look at the last entry in the mirror.  (The
+ * -multiplex engine can't block, so it looks at wake once a tick.)
+ */
+
+struct indexmirror {
+  volatile unsigned long count;
+  volatile int wake;          /* futex for WAIT; goes up with every change */
+  int valid;
+  struct wirekey key;
+  long first, n;              /* holds records first to n-1 */
+  char recs[INDEXMIRROR_RECORDS][INDEXENTRY_LENINF];
+};
 
-  if (data) { fclose(data); data=0; }
-  if (id) { strcpy(saveditemid,id); } else { saveditemid[0]= 0; }
+static struct indexmirror *mirror;
+
+static void mirrorbegin(void) { mirror->count++; __sync_synchronize(); }
+
+static void mirrorend(void) {
+  /* Also wakes everyone in WAIT, so they can look at what's changed. */
+  __sync_synchronize();
+  mirror->count++;
+  mirror->wake++;
+  syscall(SYS_futex,&mirror->wake,FUTEX_WAKE,INT_MAX,0,0,0);
 }
 
-static void cmd_edit(char *cmd) {
-  char *id;
+static int mirrorword(void) { return mirror ? mirror->wake : 0; }
 
-  if (!(id=getitemid(cmd))) return;
-  startedit(id);
+static void mirrorwait(int word, time_t secs) {
+  /* Waits up to secs, or until the mirror changes if mirrorword() has
+   * been word all along; without a mirror we can only look now and then. */
+  struct timespec ts;
+
+  if (!mirror) { sleep(secs < WAIT_POLL ? secs : WAIT_POLL); return; }
+  ts.tv_sec= secs; ts.tv_nsec= 0;
+  syscall(SYS_futex,&mirror->wake,FUTEX_WAIT,word,&ts,0,0);
 }
 
-static void cmd_edix(char *cmd) {
-  if (!noargs(cmd)) return;
-  startedit(0);
+static int mirrorrecord(const char *rec) {
+  long v;
+
+  return indexfield(rec,rec+INDEXENTRY_LENINF,&v) &&
+    indexfield(rec+9,rec+INDEXENTRY_LENINF,&v) &&
+    !memchr(rec,0,INDEXENTRY_LENINF) &&
+    memchr(rec,'\n',INDEXENTRY_LENINF) == rec+INDEXENTRY_LENINF-1;
 }
 
-static void cmd_edab(char *cmd) {
-  if (!noargs(cmd) || !editing()) return;
-  if (data) { fclose(data); data=0; }
-  lenbeforeedit= -1;
-  fputs("200 Edit operation aborted.\r\n",stdout);
+static void mirrorload(int fd) {
+  /* Refills the mirror from the index, whose head is open and locked
+   * on fd.  The mirror's key is that of the head. */
+  struct indexview v;
+  struct wirekey k;
+  const char *from;
+  long i;
+  char *rec;
+
+  if (!mirror) return;
+  mirrorbegin();
+  mirror->valid= 0;
+  if (getwirekey(fd,&k)) goto x_done;
+  if (ixopen(&v,fd)) goto x_done;
+  mirror->n= v.records;
+  mirror->first= mirror->n > INDEXMIRROR_RECORDS ? mirror->n - INDEXMIRROR_RECORDS : 0;
+  for (i= mirror->first; i < mirror->n; i++) {
+    rec= mirror->recs[i % INDEXMIRROR_RECORDS];
+    from= ixrecord(&v,i);
+    if (!from) goto x_close;
+    memcpy(rec,from,INDEXENTRY_LENINF);
+    if (!mirrorrecord(rec)) goto x_close;
+  }
+  mirror->key= k;
+  mirror->valid= 1;
+ x_close:
+  ixclose(&v);
+ x_done:
+  mirrorend();
 }
 
-static void run_diff(const char *itemid_or_index,
-                     const char *edited_or_withdrawn,
-                     unsigned long sequence,
-                     time_t currenttime,
-                     const char *datestring,
-                     const char *filename1_also_destbasename,
-                     const char *newbuf,
-                     long newlen) {
-  char label1[ITEMID_LEN+50], label2[ITEMID_LEN+DATESTRING_MAXLEN+50];
-  char destname[ITEM_MAXFILENAMELEN + sizeof(EDITED_FILENAMESFX) + 50];
-  FILE *f1, *dest, *diff;
-  int fdi[2];
-  int child, status;
+static void mirrorinit(void) {
+  FILE *index;
+  void *p;
 
-  sprintf(label1, "--label=%s Before %08lX %08lX",
-          itemid_or_index, sequence, currenttime);
-  sprintf(label2, "--label=%s %s at %s",
-          itemid_or_index, edited_or_withdrawn, datestring);
-  strcpy(destname,filename1_also_destbasename);
-  strcat(destname,EDITED_FILENAMESFX);
-  
-  f1= fopen(filename1_also_destbasename,"r");
-  if (!f1) ohshite("Failed to reopen %s for diff",filename1_also_destbasename);
-  dest= fopen(destname,"a");
-  if (!dest) ohshite("Failed to append to %s for diff",destname);
+  p= mmap(0,sizeof(*mirror),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+  if (p == MAP_FAILED) { loge(ll_error,"Failed to make index mirror"); return; }
+  mirror= p;
+  index= fopen(INDEX_FILENAME,"r");
+  if (!index) { loge(ll_error,"Index inaccessible to mirror"); return; }
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  mirrorload(fileno(index));
+  ufclose(index,INDEX_FILENAME);
+}
 
-  if (newlen) {
-    if (pipe(fdi)) ohshite("Failed to create pipe for diff of %s",itemid_or_index);
-  } else {
-    fdi[0]= open("/dev/null",O_RDONLY);
-    if (fdi[0] == -1) ohshite("Failed to open /dev/null for diff of %s",itemid_or_index);
+static void mirrorappend(int fd, const struct wirekey *before, const char *rec) {
+  /* We've just appended rec to the index, open and locked on fd. */
+  if (!mirror) return;
+  if (!mirror->valid || memcmp(&mirror->key,before,sizeof(*before))) {
+    mirrorload(fd); return;
   }
-    
-  if ((child= fork()) == -1) ohshite("Fork for diff of %s",itemid_or_index);
-  if (!child) {
-    if (dup2(fdi[0],0)) { perror("dup2 for diff stdin failed"); _exit(3); }
-    if (dup2(fileno(dest),1) != 1) { perror("dup2 for diff stdout failed"); _exit(3); }
-    close(fdi[0]); if (newlen) close(fdi[1]);
-    execlp(GNUDIFF_PROGRAM,
-           "diff","--text","--unified",label1,label2,
-           filename1_also_destbasename,"-",(char*)0);
-    perror("exec " GNUDIFF_PROGRAM " failed"); _exit(3);
+  mirrorbegin();
+  if (getwirekey(fd,&mirror->key) ||
+      mirror->key.size != before->size + INDEXENTRY_LENINF) {
+    mirror->valid= 0;
+  } else {
+    memcpy(mirror->recs[mirror->n % INDEXMIRROR_RECORDS],rec,INDEXENTRY_LENINF);
+    mirror->n++;
+    if (mirror->n - mirror->first > INDEXMIRROR_RECORDS) mirror->first++;
   }
-  close(fdi[0]);
-  fclose(dest);
-  fclose(f1);
-  
-  if (newlen) {
-    diff= fdopen(fdi[1],"w");
-    if (!diff) ohshite("Failed to fdopen diff pipe");
-    if (fwrite(newbuf,1,newlen,diff)!=newlen)
-      ohshite("Failed to write to pipe to diff of %s",itemid_or_index);
-    if (fclose(diff))
-      ohshite("Failed to close pipe to diff of %s",itemid_or_index);
-    close(fdi[1]);
+  mirrorend();
+}
+
+static int mirrorindx(long datefrom, int useseq) {
+  /* Answers INDX from the mirror if we can; returns 0 if not, having
+   * sent nothing. */
+  static char buf[INDEXMIRROR_RECORDS][INDEXENTRY_LENINF];
+  unsigned long count;
+  struct wirekey k, ik;
+  struct snapshot snap;
+  struct stat stab;
+  FILE *mem;
+  long first, n, min, max, try, here, i;
+  const char *rec;
+  int tries, ok;
+
+  if (!mirror) return 0;
+  for (tries=0; tries<INDEXMIRROR_TRIES; tries++) {
+    count= mirror->count;
+    __sync_synchronize();
+    if (count & 1) continue;
+    if (!mirror->valid) return 0;
+    k= mirror->key; first= mirror->first; n= mirror->n;
+    min= first; max= n; ok= 1;
+    while (ok && min < max) {
+      try= (min+max)>>1;
+      rec= mirror->recs[try % INDEXMIRROR_RECORDS];
+      ok= indexfield(useseq ? rec : rec+9, rec+INDEXENTRY_LENINF, &here);
+      if (here >= datefrom) { max=try; } else { min=try+1; }
+    }
+    for (i=min; ok && i<n; i++)
+      memcpy(buf[i-min],mirror->recs[i % INDEXMIRROR_RECORDS],INDEXENTRY_LENINF);
+    __sync_synchronize();
+    if (mirror->count != count) continue;
+    if (!ok || (min == first && first > 0)) return 0;
+    if (stat(INDEX_FILENAME,&stab)) return 0;
+    statwirekey(&stab,&ik);
+    if (memcmp(&k,&ik,sizeof(k))) return 0;
+    if (sess->debuglevel > 2)
+      printf("119  mirror first=%-2ld n=%-2ld  from=%-2ld\r\n",first,n,min);
+    snapinit(&snap);
+    mem= snapstream(&snap,INDEX_FILENAME);
+    for (i=min; i<n; i++) {
+      fwrite(buf[i-min],1,INDEXENTRY_LENINF-1,mem);
+      fputs("\r\n",mem);
+    }
+    if (fclose(mem)) ohshite("Failed to make snapshot of %s",INDEX_FILENAME);
+    sendsnapshot(&snap,INDEX_FILENAME);
+    return 1;
   }
-  if (waitpid(child,&status,0) != child)
-    ohshite("Failed to wait for diff of %s",itemid_or_index);
-  if (!WIFEXITED(status))
-    ohshit("diff of %s gave error wait code %d",itemid_or_index,status);
-  status= WEXITSTATUS(status);
-  if (status==0 || status==1) return;
-  ohshit("diff of %s gave error exit status %d",itemid_or_index,status);
+  return 0;
 }
 
-static void edcf_item(char *itemid, const char *reason) {
-  /* editing, rather than withdrawing */
-  FILE *index, *elog, *item;
-  const char *datestring;
-  const char *emsg;
-  unsigned long sequence;
-  time_t currenttime;
-  char idfile[ITEM_MAXFILENAMELEN+5];
-  char *subject;
-  struct stat istab;
-  long newlen;
-  char *newbuf;
+static long mirrorlast(void) {
+  /* Returns the sequence number of the last entry in the index, -1 if
+   * there are none, or -2 if the mirror can't say. */
+  unsigned long count;
+  struct wirekey k, ik;
+  struct stat stab;
+  long n, last;
+  int tries, ok;
+
+  if (!mirror) return -2;
+  for (tries=0; tries<INDEXMIRROR_TRIES; tries++) {
+    count= mirror->count;
+    __sync_synchronize();
+    if (count & 1) continue;
+    ok= mirror->valid; k= mirror->key; n= mirror->n; last= -1;
+    if (ok && n > 0)
+      ok= indexfield(mirror->recs[(n-1) % INDEXMIRROR_RECORDS],
+                     mirror->recs[(n-1) % INDEXMIRROR_RECORDS]+INDEXENTRY_LENINF,
+                     &last);
+    __sync_synchronize();
+    if (mirror->count != count) continue;
+    if (!ok || stat(INDEX_FILENAME,&stab)) return -2;
+    statwirekey(&stab,&ik);
+    return memcmp(&k,&ik,sizeof(k)) ? -2 : last;
+  }
+  return -2;
+}
 
-  index= fopen(INDEX_FILENAME,"a");
-  if (!index) ohshite("Index inaccessible for item edit entry");
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-  sequence= getsequence();
-  currenttime= gettime();
-  id2file(itemid,idfile);
-  datestring= makedatestring(currenttime);
+/*
+ * Cross-references
+ *
+ * To find the index entries about one item, by one user or of one
+ * type without reading the whole index, we keep postings in XREF_DIR
+ * listing the sequence numbers of each key's entries, which we look
+ * up in the index by binary search.  We record sequence numbers
+ * rather than positions because withdrawal takes entries out of the
+ * middle of the index; so a sequence number whose entry has gone, or
+ * which it shares with an entry that doesn't match, is just skipped.
+ *
+ * The postings file has each key's sequence numbers together, and the
+ * table says where, one XREF_ENTRYLEN line per key sorted by kind and
+ * padded key, so that it can be searched where it's mapped as the item
+ * pack table is.  Postings for entries added since go on the end of
+ * the recent file, which is read through for each lookup; once it has
+ * XREF_RECENTMAX of them the next entry remakes the lot instead.
+ *
+ * The stamp holds the wirekey of the index the postings describe.
+ * indexentry adds to the postings only if the stamp is current; EDCF
+ * of the index and the daemon at startup rebuild them, and until then
+ * INDX ITEM/USER/TYPE reads the whole index.  The stamp is of the head
+ * segment, so sealing it restamps the postings.  Everything here is
+ * done with the index locked.
+ */
 
-  item= fopen(idfile,"r+");
-  if (!item) {
-    if (errno!=ENOENT || !saveditemid[0])
-      ohshite("Failed to open %s for edit",idfile);
-    noitem(itemid); fclose(data); data=0; lenbeforeedit=-1; ufclose(index,INDEX_FILENAME); return;
-  }
-  subject= getitemsubject(data,&emsg);
-  if (!subject) {
-    fputs("423 Subject line missing from edited version.\r\n",stdout);
-    fclose(item); ufclose(index,INDEX_FILENAME); fclose(data); data=0; return;
-  }
-  if (fseek(data,0,SEEK_SET)) ohshite("Rewind data during %s EDCF",itemid);
-  
-  elog= fopen(EDITLOG_FILENAME,"a");
-  if (!elog) ohshite("Failed to open " EDITLOG_FILENAME " re item %s",itemid);
+static int xrefsortkind;
+static const char *xrefsortbuf;
 
-  if (fprintf(elog, "Item %s edited by %s at %s (#%08lX):\n%s\n\n",
-              saveditemid,userid,datestring,sequence,reason)
-      ==EOF) ohshite("Failed to write to " EDITLOG_FILENAME);
-  if (fclose(elog))
-    ohshite("Failed to close " EDITLOG_FILENAME " after write");
-  
-  makelock(item,F_WRLCK,idfile);
-  if (fstat(fileno(item),&istab)) ohshite("Failed to stat %s for EDCF",idfile);
-  if (lenbeforeedit > istab.st_size)
-    ohshit("Item %s has shrunk since EDIT",itemid);
+static void xrefrebuild(int fd);
 
-  newlen= istab.st_size - lenbeforeedit + dstab.st_size+ITEMID_LEN*2+20;
-  newbuf= malloc(newlen);
-  if (!newbuf) ohshite("No memory to contruct edited version");
-  errno=0; if (fread(newbuf,1,ITEMID_LEN*2+20,item) != ITEMID_LEN*2+20)
-    ohshite("Failed to read status line of %s for EDCF",saveditemid);
-  if (newbuf[ITEMID_LEN]!=' ' || newbuf[ITEMID_LEN*2+19]!='\n')
-    ohshit("Status line of %s corrupt before EDCF",saveditemid);
-  sprintf(newbuf+ITEMID_LEN*2+2,"%08lX",sequence);
-  newbuf[ITEMID_LEN*2+10]= ' '; /* undo the null from sprintf */
-  errno=0;
-  if (fread(newbuf+ITEMID_LEN*2+20,1,dstab.st_size,data) != dstab.st_size)
-    ohshite("Failed to block read data during EDCF of %s",itemid);
+static int xrefkey(int kind, const char *rec, char *buf) {
+  /* Puts the key of kind (i, u or t) for the index entry rec in buf,
+   * which must be XREF_KEYLEN long.  Returns 0 if rec hasn't one. */
+  int l;
 
-  if (lenbeforeedit < istab.st_size) {
-    if (fseek(item,lenbeforeedit,SEEK_SET))
-      ohshite("Seek to new data during EDCF of item %s",item);
-    errno= 0;
-    if (fread(newbuf + dstab.st_size+ITEMID_LEN*2+20, 1, istab.st_size -
-              lenbeforeedit, item) != istab.st_size - lenbeforeedit)
-      ohshite("Read new data during EDCF of item %s",itemid);
+  switch (kind) {
+  case 'i':
+    memcpy(buf,rec+18,ITEMID_LEN); l= ITEMID_LEN;
+    break;
+  case 'u':
+    memcpy(buf,rec+19+ITEMID_LEN,USERID_MAXLEN); l= USERID_MAXLEN;
+    break;
+  default:
+    buf[0]= rec[20+ITEMID_LEN+USERID_MAXLEN]; l= 1;
+    break;
   }
+  while (l>0 && buf[l-1]==' ') l--;
+  buf[l]= 0;
+  return l>0;
+}
 
-  run_diff(itemid,"Edited",sequence,currenttime,datestring,
-           idfile,newbuf,newlen);
+static void xrefpad(char *buf, int kind, const char *key) {
+  /* Puts kind and key as the table has them in buf, which must be
+   * XREF_PADLEN+1 long. */
+  sprintf(buf,"%c%-*s",kind,USERID_MAXLEN,key);
+}
 
-  if (fseek(item,0,SEEK_SET)) ohshite("Rewind %s for write edited",itemid);
-  if (fwrite(newbuf,1,newlen,item)!=newlen)
-    ohshite("AARGH! Failed to write edited version of %s",itemid);
-  if (ftruncate(fileno(item),newlen))
-    ohshite("AARGH! Failed to trunctate %s to correct length after edit",
-            itemid);
-  if (ufclose(item,idfile)) ohshite("AARGH! Failed to close %s after edit",itemid);
-  indexentry(index, sequence, currenttime, itemid, 'E', subject);
-  if (ufclose(index,INDEX_FILENAME))
-    ohshite("AARGH! Failed to close index after edit of %s",itemid);
-  fclose(data); data=0; lenbeforeedit=-1; free(newbuf);
-  printf("220 %08lX  Edit complete.\r\n",sequence);
+static int xreflookup(const char *pad, long *offsetr, long *countr) {
+  /* Looks pad up in the table.  Returns 1 if it's there, with where
+   * its postings are in *offsetr and how many in *countr. */
+  char buf[XREF_ENTRYLEN+1];
+  struct stat stab;
+  const char *map, *p;
+  long min, max, try;
+  int fd, c, found, bad;
+
+  fd= open(XREF_TABLE,O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) return 0;
+    ohshite("Failed to open " XREF_TABLE);
+  }
+  if (fstat(fd,&stab)) ohshite("Failed to stat " XREF_TABLE);
+  if (stab.st_size % XREF_ENTRYLEN)
+    ohshit(XREF_TABLE " corrupt - invalid length %ld",(long)stab.st_size);
+  if (!stab.st_size) { close(fd); return 0; }
+  map= mmap(0,stab.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if (map == MAP_FAILED) ohshite("Failed to map " XREF_TABLE);
+  close(fd);
+  min= 0; max= stab.st_size / XREF_ENTRYLEN;
+  found= bad= 0;
+  while (min < max) {
+    try= (min+max)>>1;
+    p= map + (size_t)try*XREF_ENTRYLEN;
+    c= memcmp(p,pad,XREF_PADLEN);
+    if (!c) {
+      found= 1;
+      memcpy(buf,p,XREF_ENTRYLEN); buf[XREF_ENTRYLEN]= 0;
+      bad= buf[XREF_ENTRYLEN-1] != '\n' ||
+        sscanf(buf+XREF_PADLEN," %ld %lx",offsetr,countr) != 2 ||
+        *offsetr < 0 || *countr < 0;
+      break;
+    }
+    if (c < 0) { min=try+1; } else { max=try; }
+  }
+  munmap((void*)map,stab.st_size);
+  if (bad) ohshit(XREF_TABLE " has a corrupted entry for %.*s",XREF_PADLEN,pad);
+  return found;
 }
-  
-static void edcf_index(const char *reason) {
-  /* editing the index */
-  FILE *index, *elog;
-  const char *datestring;
-  time_t currenttime;
-  unsigned long sequence;
-  long newlen;
-  char *newbuf;
-  struct stat istab;
-  
-  index= fopen(INDEX_FILENAME,"r+");
-  if (!index) ohshite("Failed to open index for EDCF of index edit");
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-  sequence= getsequence();
-  currenttime= gettime();
-  datestring= makedatestring(currenttime);
 
-  elog= fopen(EDITLOG_FILENAME,"a");
-  if (!elog) ohshite("Failed to open " EDITLOG_FILENAME " re index edit");
-  if (fprintf(elog, "Index edited by %s at %s (#%08lX):\n%s\n\n",
-              userid,datestring,sequence,reason) ==EOF)
-    ohshite("Failed to write to " EDITLOG_FILENAME);
-  if (fclose(elog))
-    ohshite("Failed to close " EDITLOG_FILENAME " after write");
-    
-  if (fstat(fileno(index),&istab)) ohshite("Failed to stat index for EDCF");
-  if (lenbeforeedit > istab.st_size) ohshit("Index has shrunk since EDIX");
+static int xrefcurrent(const struct wirekey *k) {
+  struct wirekey sk;
+  int fd, r;
 
-  newlen= istab.st_size - lenbeforeedit + dstab.st_size;
-  newbuf= malloc(newlen);
-  if (!newbuf) ohshite("No memory to contruct edited version");
-  errno=0; if (fread(newbuf, 1, dstab.st_size, data) != dstab.st_size)
-    ohshite("Failed to block read data during EDCF of index");
+  fd= open(XREF_STAMP,O_RDONLY);
+  if (fd == -1) return 0;
+  r= read(fd,&sk,sizeof(sk)) == sizeof(sk) && !memcmp(k,&sk,sizeof(sk));
+  close(fd);
+  return r;
+}
 
-  if (lenbeforeedit < istab.st_size) {
-    if (fseek(index, lenbeforeedit, SEEK_SET))
-      ohshite("Seek to new data during EDCF of index");
-    errno= 0;
-    if (fread(newbuf + dstab.st_size, 1, istab.st_size - lenbeforeedit, index)
-        != istab.st_size - lenbeforeedit)
-      ohshite("Read new data during EDCF of index");
-  }
+static void xrefstamp(int fd) {
+  /* Records that the postings describe the index open on fd. */
+  struct wirekey k;
+  FILE *stamp;
 
-  run_diff("index","Edited",sequence,currenttime,datestring,
-           INDEX_FILENAME,newbuf,newlen);
+  if (getwirekey(fd,&k)) goto x_error;
+  stamp= fopen(XREF_STAMP,"w");
+  if (!stamp) goto x_error;
+  if (fwrite(&k,sizeof(k),1,stamp) != 1) { fclose(stamp); goto x_error; }
+  if (fclose(stamp)) goto x_error;
+  return;
 
-  if (fseek(index,0,SEEK_SET)) ohshite("Rewind index for write edited");
-  if (fwrite(newbuf, 1, newlen, index) != newlen)
-    ohshite("AARGH! Failed to write edited version of index");
-  if (ftruncate(fileno(index),newlen))
-    ohshite("AARGH! Failed to trunctate index to correct length after edit");
-  if (ufclose(index,INDEX_FILENAME)) ohshite("AARGH! Failed to close index after edit");
-  fclose(data); data=0; lenbeforeedit=-1; free(newbuf);
-  printf("220 %08lX  Edit complete.\r\n",sequence);
+ x_error:
+  loge(ll_error,"Failed to write " XREF_STAMP);
+  unlink(XREF_STAMP);
 }
 
-static void edcf_withdraw(char *itemid, const char *reason) {
-  char idfile[ITEM_MAXFILENAMELEN+5];
-  struct stat istab;
-  unsigned long sequence;
-  int n, i, j;
-  time_t currenttime;
-  char *newbuf, *datestring;
-  FILE *index, *elog;
-  
-  index= fopen(INDEX_FILENAME,"r+");
-  if (!index) ohshite("Failed to open index to withdraw item %s",itemid);
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-  sequence= getsequence();
-  currenttime= gettime();
-  id2file(itemid,idfile);
-  datestring= makedatestring(currenttime);
+static void xrefappend(int fd, const struct wirekey *before,
+                       unsigned long sequence, const char *rec) {
+  /* We've just appended rec to the index, open and locked on fd. */
+  char key[XREF_KEYLEN], pad[XREF_PADLEN+1];
+  struct stat stab;
+  FILE *recent;
+  const char *kind;
 
-  elog= fopen(EDITLOG_FILENAME,"a");
-  if (!elog) ohshite("Failed to open " EDITLOG_FILENAME " re withdrawal");
-  if (fprintf(elog, "Item %s withdrawn by %s at %s (#%08lX):\n%s\n\n",
-              itemid,userid,datestring,sequence,reason) ==EOF)
-    ohshite("Failed to write to " EDITLOG_FILENAME);
-  if (fclose(elog))
-    ohshite("Failed to close " EDITLOG_FILENAME " after write");
-    
-  if (fstat(fileno(index),&istab))
-    ohshite("Failed to stat index for withdrawal");
-  if (istab.st_size % INDEXENTRY_LENINF)
-    ohshit("Index found corrupted before withdrawal (length=%ld)",
-           (long)istab.st_size);
-  newbuf= malloc(istab.st_size);
-  if (!newbuf)
-    ohshite("No memory to construct changed index for withdrawal");
-  
-  n= istab.st_size / INDEXENTRY_LENINF;
-  errno=0; if (fread(newbuf,INDEXENTRY_LENINF,n,index)!=n)
-    ohshite("Failed to read index during withdrawal");
-  for (i=0, j=0; i<n; i++) {
-    if (!memcmp(newbuf+i*INDEXENTRY_LENINF+18,saveditemid,ITEMID_LEN)) continue;
-    if (i != j)
-      memcpy(newbuf+j*INDEXENTRY_LENINF,newbuf+i*INDEXENTRY_LENINF,INDEXENTRY_LENINF);
-    j++;
+  if (!xrefcurrent(before)) return;
+  if (stat(XREF_RECENT,&stab)) {
+    if (errno != ENOENT) goto x_error;
+    stab.st_size= 0;
   }
-  run_diff(itemid,"Withdrawn",sequence,currenttime,datestring,
-           INDEX_FILENAME, newbuf,j*INDEXENTRY_LENINF);
-  run_diff(itemid,"Withdrawn",sequence,currenttime,datestring,
-           idfile, 0,0);
-
-  if (fseek(index,0,SEEK_SET)) ohshite("Rewind index for write withdrawn");
-  if (fwrite(newbuf,INDEXENTRY_LENINF,j,index)!=j)
-    ohshite("AARGH! Failed to write updated index for withdrawal of %s",
-            saveditemid);
-  if (ftruncate(fileno(index),j*INDEXENTRY_LENINF))
-    ohshite("AARGH! Failed to trunctate index after withdrawal of %s",
-            saveditemid);
-  if (ufclose(index,INDEX_FILENAME))
-    ohshite("AARGH! Failed to close index after withdrawal of %s",saveditemid);
-  free(newbuf);
+  if (stab.st_size >= (off_t)XREF_RECENTMAX*XREF_RECENTLEN) { xrefrebuild(fd); return; }
+  recent= fopen(XREF_RECENT,"a");
+  if (!recent) goto x_error;
+  for (kind= "iut"; *kind; kind++) {
+    if (!xrefkey(*kind,rec,key)) continue;
+    xrefpad(pad,*kind,key);
+    if (fprintf(recent,"%s %08lX\n",pad,sequence) == EOF) { fclose(recent); goto x_error; }
+  }
+  if (fclose(recent)) goto x_error;
+  xrefstamp(fd);
+  return;
 
-  if (unlink(idfile)) ohshite("Failed to remove withdrawn item %s",idfile);
-  lenbeforeedit=-1;
-  printf("220 %08lX  Item withdrawn.\r\n",sequence);
+ x_error:
+  loge(ll_error,"Failed to add to postings");
+  unlink(XREF_STAMP);
 }
 
-static void cmd_edcf(char *cmd) {
-  if (!*cmd) {
-    protocolviolation("511 A reason must be given for the edit."); return;
+static int xrefcompare(const void *a, const void *b) {
+  char ka[XREF_KEYLEN], kb[XREF_KEYLEN], pa[XREF_PADLEN+1], pb[XREF_PADLEN+1];
+  long ia= *(const long*)a, ib= *(const long*)b;
+  int r;
+
+  xrefkey(xrefsortkind,xrefsortbuf+ia*INDEXENTRY_LENINF,ka);
+  xrefkey(xrefsortkind,xrefsortbuf+ib*INDEXENTRY_LENINF,kb);
+  xrefpad(pa,xrefsortkind,ka);
+  xrefpad(pb,xrefsortkind,kb);
+  r= memcmp(pa,pb,XREF_PADLEN); /* the table's order */
+  return r ? r : ia < ib ? -1 : ia > ib;
+}
+
+static void xrefrebuild(int fd) {
+  /* Remakes all the postings from the index, whose head is open and
+   * locked on fd. */
+  char name[sizeof(XREF_DIR)+FILENAME_MAX];
+  char key[XREF_KEYLEN], pad[XREF_PADLEN+1], prevpad[XREF_PADLEN+1];
+  struct indexview v;
+  struct dirent *de;
+  DIR *dir;
+  FILE *table, *post;
+  char *buf;
+  long *ents, n, m, i, start, offset;
+  long seq;
+  const char *kind;
+
+  unlink(XREF_STAMP);
+  if (ixopen(&v,fd)) { loge(ll_error,"Index segments unreadable, not making postings"); return; }
+  n= v.records;
+  if (mkdir(XREF_DIR,0777) && errno != EEXIST) { loge(ll_error,"Failed to make " XREF_DIR); return; }
+  dir= opendir(XREF_DIR);
+  if (!dir) { loge(ll_error,"Failed to read " XREF_DIR); ixclose(&v); return; }
+  while ((de= readdir(dir))) {
+    if (de->d_name[0] == '.' || strlen(de->d_name) >= FILENAME_MAX) continue;
+    sprintf(name,"%s%s",XREF_DIR,de->d_name);
+    unlink(name);
   }
-  if (!editing()) return;
-  if (saveditemid[0]) {
-    if (data)
-      edcf_item(saveditemid,cmd);
-    else
-      edcf_withdraw(saveditemid,cmd);
-  } else {
-    if (!data) { protocolviolation("500 Cannot withdraw the index."); return; }
-    edcf_index(cmd);
+  closedir(dir);
+
+  buf= malloc((size_t)n*INDEXENTRY_LENINF+1); ents= malloc((n+1)*sizeof(*ents));
+  if (!buf || !ents) { loge(ll_error,"No memory to make postings"); goto x_free; }
+  if (ixread(&v,0,n,buf)) { loge(ll_error,"Failed to read index for postings"); goto x_free; }
+  for (i=0; i<n; i++) {
+    if (!indexfield(buf+i*INDEXENTRY_LENINF,buf+(i+1)*INDEXENTRY_LENINF,&seq)) {
+      log(ll_error,"Index has corrupted record %ld, not making postings",i);
+      goto x_free;
+    }
+  }
+  table= fopen(XREF_TABLE,"w");
+  if (!table) goto x_error;
+  post= fopen(XREF_POSTINGS,"w");
+  if (!post) { fclose(table); goto x_error; }
+  xrefsortbuf= buf;
+  offset= 0;
+  for (kind= "itu"; *kind; kind++) { /* in the table's order */
+    for (i=0, m=0; i<n; i++)
+      if (xrefkey(*kind,buf+i*INDEXENTRY_LENINF,key)) ents[m++]= i;
+    xrefsortkind= *kind;
+    qsort(ents,m,sizeof(*ents),xrefcompare);
+    for (i=0, start=0; i<=m; i++) {
+      if (i<m) {
+        xrefkey(*kind,buf+ents[i]*INDEXENTRY_LENINF,key);
+        xrefpad(pad,*kind,key);
+      }
+      if (i>start && (i==m || memcmp(pad,prevpad,XREF_PADLEN))) {
+        if (fprintf(table,"%s %010ld %08lX\n",prevpad,offset,i-start) == EOF)
+          goto x_errorclose;
+        offset+= (i-start)*9; /* "%08lX\n" each */
+        start= i;
+      }
+      if (i==m) break;
+      strcpy(prevpad,pad);
+      indexfield(buf+ents[i]*INDEXENTRY_LENINF,buf+(ents[i]+1)*INDEXENTRY_LENINF,&seq);
+      if (fprintf(post,"%08lX\n",seq) == EOF) goto x_errorclose;
+    }
   }
+  if (fclose(post)) { fclose(table); goto x_error; }
+  if (fclose(table)) goto x_error;
+  xrefstamp(fd);
+  goto x_free;
+
+ x_errorclose:
+  fclose(post); fclose(table);
+ x_error:
+  loge(ll_error,"Failed to write postings");
+ x_free:
+  free(buf); free(ents);
+  ixclose(&v);
 }
 
-/*
- * Management
- */
+static void xrefinit(void) {
+  /* Makes sure the postings are current before we start. */
+  FILE *index;
+  struct wirekey k;
 
-static void cmd_udbm(char *cmd) {
-  const char *args[UDBM_MAXARGS+1];
-  int nargs=0;
-  int fdi[2];
-  int child;
-  int status, c;
-  char *tosend=0, *p;
+  index= fopen(INDEX_FILENAME,"r+");
+  if (!index) { loge(ll_error,"Index inaccessible to make postings"); return; }
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  if (getwirekey(fileno(index),&k) || !xrefcurrent(&k)) xrefrebuild(fileno(index));
+  ufclose(index,INDEX_FILENAME);
+}
 
-  log(ll_trace,"UDBM `%s'",cmd);
-  args[nargs++]= "UDBM";
-  args[nargs++]= "--file";
-  args[nargs++]= USERDB_FILENAME;
-  args[nargs++]= "--restrict";
-  args[nargs++]= "--noprompt";
-  for (;;) {
-    skipspace(&cmd);
-    if (!*cmd) break;
-    if (*cmd == '<') { *cmd++=0; tosend= cmd; break; }
-    if (nargs == UDBM_MAXARGS) {
-      fputs("250 Too many arguments to UDBM.\r\n"
-            "Too many arguments to UDBM.\r\n.\r\n", stdout); return;
+static void xrefadd(long i, long **entsr, long *nentsr, long *sizer) {
+  if (*nentsr == *sizer) {
+    *sizer= *sizer ? *sizer*2 : 16;
+    *entsr= realloc(*entsr,*sizer*sizeof(**entsr));
+    if (!*entsr) ohshite("No memory for postings");
+  }
+  (*entsr)[(*nentsr)++]= i;
+}
+
+static long xreffind(int kind, const char *key, struct indexview *v,
+                     int postings, long **entsr) {
+  /* Finds the entries in the index about key, using the postings if
+   * they're current and scanning the whole index if not.  Returns how
+   * many, setting *entsr to a malloc'd array of their entry numbers,
+   * in order. */
+  char line[XREF_RECENTLEN+1], rkey[XREF_KEYLEN], pad[XREF_PADLEN+1];
+  unsigned long sequence, prev;
+  long *ents, nents, size, i, m;
+  long *seqs, nseqs, seqsize, offset, count;
+  const struct segment *seg;
+  struct indexquery q;
+  const char *rec;
+  FILE *post;
+  int any, s;
+
+  ents= 0; nents= size= 0;
+  if (!postings) {
+    indexscan_init(&q);
+    switch (kind) {
+    case 'i': indexscan_item(&q,key); break;
+    case 'u': indexscan_user(&q,key); break;
+    default: q.type= *key; break;
     }
-    if (*cmd == '"') {
-      p= ++cmd;
-      args[nargs++]= cmd;
-      while ((c= *cmd) && c != '"') {
-        if (c == '\\' && cmd[1]) c= *++cmd;
-        *p++= c; cmd++;
+    for (s=0; s<v->nsegs; s++) {
+      seg= &v->segs[s];
+      if (!seg->records) continue;
+      rec= ixrecord(v,seg->start);
+      if (!rec) ohshite("Index unmappable");
+      if (nents+seg->records > size) {
+        size= nents+seg->records;
+        ents= realloc(ents,size*sizeof(*ents));
+        if (!ents) ohshite("No memory for index scan");
       }
-      *p= 0;
-    } else {
-      args[nargs++]= cmd;
-      while ((c= *cmd) && !isspace(c)) cmd++;
-      *cmd= 0;
+      m= indexscan(rec,seg->records,&q,ents+nents);
+      for (i=nents; i<nents+m; i++) ents[i]+= seg->start;
+      nents+= m;
     }
-    if (c) cmd++;
+    *entsr= ents;
+    return nents;
   }
-  args[nargs]= 0;
-  if (pipe(fdi)) ohshite("Create pipe for stdin for UDBM");
-  if ((child= fork()) == -1) ohshite("Fork for UDBM");
-  if (!child) {
-    fputs("250 Response follows.\r\n",stdout);
-    close(0); dup(fdi[0]); close(2); dup(1); close(fdi[0]); close(fdi[1]);
-    execvp(UDBM_PROGRAM, (char**)args);
-    perror("exec " UDBM_PROGRAM " failed"); _exit(1);
+  seqs= 0; nseqs= seqsize= 0;
+  xrefpad(pad,kind,key);
+  if (xreflookup(pad,&offset,&count)) {
+    post= fopen(XREF_POSTINGS,"r");
+    if (!post) ohshite("Failed to open " XREF_POSTINGS);
+    if (fseek(post,offset,SEEK_SET)) ohshite("Failed to seek in " XREF_POSTINGS);
+    for (i=0; i<count; i++) {
+      if (!fgets(line,sizeof(line),post)) {
+        if (ferror(post)) ohshite("Error reading " XREF_POSTINGS);
+        ohshit(XREF_POSTINGS " truncated");
+      }
+      xrefadd(strtoul(line,0,16),&seqs,&nseqs,&seqsize);
+    }
+    fclose(post);
   }
-  if (tosend) {
-    int l;
-    l= strlen(tosend); tosend[l++]= '\n';
-    write(fdi[1],tosend,l);
+  post= fopen(XREF_RECENT,"r");
+  if (post) {
+    while (fread(line,XREF_RECENTLEN,1,post) == 1)
+      if (!memcmp(line,pad,XREF_PADLEN))
+        xrefadd(strtoul(line+XREF_PADLEN,0,16),&seqs,&nseqs,&seqsize);
+    if (ferror(post)) ohshite("Error reading " XREF_RECENT);
+    fclose(post);
+  } else if (errno != ENOENT) {
+    ohshite("Failed to open " XREF_RECENT);
   }
-  close(fdi[0]); close(fdi[1]);
-  if (waitpid(child,&status,0) != child) ohshite("Failed to wait for udbm subprocess");
-  if (WIFSIGNALED(status)) {
-    printf("(udbm subprocess died due to receiving signal %d!%s)\r\n",
-           WTERMSIG(status), WCOREDUMP(status) ? "  Core dumped!" : "");
-  } else if (!WIFEXITED(status)) {
-    printf("(udbm subprocess failed, `wait' code %d)\r\n",status);
-  } else if (WEXITSTATUS(status)) {
-    printf("(udbm subprocess exited with status %d)\r\n",WEXITSTATUS(status));
-  }    
-  fputs(".\r\n",stdout);
-  return;
-}
 
-static void sendparent(char *cmd, int sig) {
-  pid_t pid;
-  if (!noargs(cmd)) return;
-  log(ll_alert,"KILL/KILR (signal %d) issued and accepted",sig); tcpident();
-  pid= getppid();  if (pid==-1) ohshite("Failed to getppid");
-  if (kill(pid,sig))
-    ohshite("Failed to send signal %d to parent process (pid %ld)",
-            sig, (long)pid);
-  fputs("200 KILL/KILR command obeyed.\r\n",stdout);
+  prev= 0; any= 0;
+  for (m=0; m<nseqs; m++) {
+    sequence= (unsigned long)seqs[m];
+    if (any && sequence == prev) continue;
+    prev= sequence; any= 1;
+    for (i= ixsearch(v,1,sequence); i<v->records; i++) {
+      if ((unsigned long)ixvalue(v,i,1) != sequence) break;
+      rec= ixrecord(v,i);
+      if (!rec) ohshite("Index unmappable");
+      if (xrefkey(kind,rec,rkey) && !strcmp(rkey,key)) xrefadd(i,&ents,&nents,&size);
+    }
+  }
+  free(seqs);
+  *entsr= ents;
+  return nents;
 }
 
-void cmd_kill(char *cmd) { sendparent(cmd,SIGTERM); }
-void cmd_kilr(char *cmd) { sendparent(cmd,SIGUSR2); }
+static void xrefindx(int kind, const char *key) {
+  /* INDX ITEM, USER and TYPE. */
+  struct snapshot snap;
+  struct indexview v;
+  struct wirekey k;
+  FILE *index, *mem;
+  const char *rec;
+  long i, nents, *ents;
+  int postings;
 
-static void cmd_mots(char *cmd) {
-  FILE *motd, *index;
-  unsigned long sequence;
-  time_t currenttime;
-  static char nullsubject[]="";
+  index= fopen(INDEX_FILENAME,"r"); if (!index) ohshite("Index inaccessible");
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  if (ixopen(&v,fileno(index))) ohshite("Index segments unreadable");
+  if (getwirekey(fileno(index),&k)) ohshite("Index unstattable");
+  postings= xrefcurrent(&k);
+  if (sess->debuglevel > 2)
+    printf("119  %s %c %s\r\n", postings ? "postings" : "scanning", kind, key);
+
+  snapinit(&snap);
+  mem= snapstream(&snap,INDEX_FILENAME);
+  nents= xreffind(kind,key,&v,postings,&ents);
+  for (i=0; i<nents; i++) {
+    rec= ixrecord(&v,ents[i]);
+    fwrite(rec,1,INDEXENTRY_LENINF-1,mem);
+    fputs("\r\n",mem);
+  }
+  free(ents);
+  if (fclose(mem)) ohshite("Failed to make snapshot of index");
+  ixclose(&v);
+  ufclose(index,INDEX_FILENAME);
+  sendsnapshot(&snap,INDEX_FILENAME);
+}
 
-  if (!noargs(cmd) || !datadone()) return;
+static void ixseal(FILE *index) {
+  /* If the head segment is full, seals it.  index is the head, open
+   * and locked for writing. */
+  struct indexview v;
+  struct wirekey k;
+  struct segment *head;
+  char *buf;
+  int postings;
+
+  if (fflush(index) || getwirekey(fileno(index),&k))
+    ohshite("AARGH! Index unstattable");
+  if (k.size < (off_t)INDEXSEG_RECORDS*INDEXENTRY_LENINF) return;
+  postings= xrefcurrent(&k);
+  if (ixopen(&v,fileno(index))) ohshite("Index segments unreadable");
+  head= &v.segs[v.nsegs-1];
+  buf= malloc((size_t)head->records*INDEXENTRY_LENINF);
+  if (!buf) ohshite("No memory to seal index segment");
+  if (ixread(&v,head->start,head->records,buf)) ohshite("Failed to read index to seal it");
+  ixrewrite(&v,v.nsegs-1,v.nsegs-1,buf,head->records,index);
+  free(buf);
+  ixclose(&v);
+  log(ll_trace,"Sealed index segment");
+  mirrorload(fileno(index));
+  if (postings) xrefstamp(fileno(index));
+}
 
-  index= fopen(INDEX_FILENAME,"a");
-  makelock(index,F_WRLCK,INDEX_FILENAME);
-  currenttime= gettime();
-  sequence= getsequence();
-  
-  motd= fopen(MOTD_FILENAME,"a+");
-  makelock(motd,F_WRLCK,MOTD_FILENAME);
+static void editlogdone(FILE *elog, const struct wirekey *before) {
+  if (fflush(elog)) ohshite("Failed to close " EDITLOG_FILENAME " after write");
+  wireappend(fileno(elog),EDITLOG_FILENAME,before);
+  if (fclose(elog))
+    ohshite("Failed to close " EDITLOG_FILENAME " after write");
+}
 
-  rewind(motd);
+static void noitem(const char *id) {
+  printf("410 Item %s does not exist or has been archived.\r\n",id);
+  return;
+}
+
+static void copycontrib(FILE *item, const char *destid) {
+  /* copies data to the destination and closes both */
+  int c;
+  
+  while ((c= fgetc(sess->data)) != EOF) {
+    if (fputc(c,item)==EOF)
+      ohshite("AARGH! Failed to write all of reply to %s", destid);
+  }
+  if (ferror(sess->data))
+    ohshite("AARGH! Failed to read all of reply file for %s",destid);
+  fclose(sess->data); sess->data=0;
+  if (fclose(item))
+    ohshite("AARGH! Failed to close %s after reply",destid);
+}
+
+static void indexentry(FILE *index, unsigned long sequence,
+                       long timestamp, const char *refid,
+                       int type, const char *subject) {
+  /* makes an index entry */
+  char indexbuf[INDEXENTRY_LENINF+5];
+  struct wirekey before;
+  int l;
+
+  sprintf(indexbuf,"%08lX %08lX",sequence,timestamp);
+  memset(indexbuf+17,' ',INDEXENTRY_LENINF-17-1);
+  memcpy(indexbuf+18,refid,ITEMID_LEN);
+  memcpy(indexbuf+19+ITEMID_LEN,sess->userid,strlen(sess->userid));
+  indexbuf[20+ITEMID_LEN+USERID_MAXLEN]= type;
+
+  l= strlen(subject);
+  if (l > SUBJECTININDEX_MAXLEN) {
+    memcpy(indexbuf+22+ITEMID_LEN+USERID_MAXLEN, subject, SUBJECTININDEX_MAXLEN-3);
+    memcpy(indexbuf+22+ITEMID_LEN+USERID_MAXLEN+SUBJECTININDEX_MAXLEN-3, "...", 3);
+  } else {
+    memcpy(indexbuf+22+ITEMID_LEN+USERID_MAXLEN, subject, l);
+  }
+  
+  indexbuf[INDEXENTRY_LENINF-1]= '\n';
+  ixseal(index);
+  if (fflush(index) || getwirekey(fileno(index),&before) ||
+      fwrite(indexbuf,INDEXENTRY_LENINF,1,index) != 1 || fflush(index))
+    ohshite("AARGH! Failed to write index entry relating to %s",refid);
+  wireappend(fileno(index),INDEX_FILENAME,&before);
+  keysappend(fileno(index),INDEX_FILENAME,&before);
+  mirrorappend(fileno(index),&before,indexbuf);
+  xrefappend(fileno(index),&before,sequence,indexbuf);
+}  
+
+static int line1toolong(const char *p) {
+  return (strchr(p,'\n')-p) > TEXTLINE_MAXLEN;
+}
+
+static char *createitem(FILE *index, unsigned long sequence,
+                        time_t timestamp, const char *subject,
+                        int typecodechar, const char *continuing) {
+  /* NB the index file must have been locked.  The subject must already have
+   * been checked for length */
+  FILE *item;
+  char *newid, *datestring;
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  char headbuf[INPUTLINE_MAXLEN*5+5];
+  
+  newid= newitemid(); id2file(newid,idfile);
+  item= fopen(idfile,"w+");
+  if (!item) ohshite("File for new item %s uncreateable",newid);
+
+  datestring= makedatestring(timestamp);
+  if (!*sess->grogname) {
+    sprintf(headbuf, ITEMSTART_PFXSTRING "%s from %s at %s\n",
+            newid,sess->userid,datestring);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              ITEMSTART_PFXSTRING "%s submitted at %s by\n"
+              LONGUSERID_PFXSTRING "%s\n",
+              newid,datestring,sess->userid);
+  } else {
+    sprintf(headbuf,ITEMSTART_PFXSTRING "%s from %s (%s) at %s\n",
+            newid,sess->grogname,sess->userid,datestring);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              ITEMSTART_PFXSTRING "%s from %s at %s\n"
+              LONGGROGNAME_PFXSTRING "%s\n",
+              newid,sess->userid,datestring,sess->grogname);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              ITEMSTART_PFXSTRING "%s from %s at %s\n"
+              LONGUSERID_PFXSTRING "%s\n",
+              newid,sess->grogname,datestring,sess->userid);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              ITEMSTART_PFXSTRING "%s submitted at %s\n"
+              LONGGROGNAME_PFXSTRING "%s\n"
+              LONGUSERID_PFXSTRING "%s\n",
+              newid,datestring,sess->grogname,sess->userid);
+  }
+  if (fprintf(item,
+              "%*s %*s          %08lX\n"
+              "^%08lX %08lX\n"
+              "%s"
+              SUBJECT_PFXSTRING "%s\n\n",
+              ITEMID_LEN, continuing, ITEMID_LEN, "", sequence,
+              sequence, timestamp,
+              headbuf, subject) == EOF)
+    ohshite("Failed to write item header to %s",newid);
+  copycontrib(item,newid);
+  metaputfile(newid,idfile);
+  wirerenderfile(idfile);
+
+  indexentry(index, sequence, timestamp, newid, typecodechar, subject);
+  printf("120 %s\r\n",newid);
+  return newid;
+}
+
+static int statusnocont(const char *statusbuf) {
+  /* Says so, and returns 0, if the item with this status line has
+   * already been continued. */
+  if (statusbuf[ITEMID_LEN+1] != ' ') {
+    printf("122 %*.*s\r\n"
+           "422 Item has already been continued.\r\n",
+           ITEMID_LEN*2+10,ITEMID_LEN*2+10,statusbuf+ITEMID_LEN+1);
+    return 0;
+  }
+  return 1;
+}
+
+static long statusseq(const char *statusbuf) {
+  /* Returns the sequence number of the last change to the item with
+   * this status line: its last edit or its last contribution. */
+  char buf[9];
+  long edit, last;
+
+  memcpy(buf,statusbuf+ITEMID_LEN*2+2,8); buf[8]= 0;
+  edit= strtol(buf,0,16); /* blank if it's never been edited */
+  memcpy(buf,statusbuf+ITEMID_LEN*2+11,8);
+  last= strtol(buf,0,16);
+  return edit > last ? edit : last;
+}
+
+static int checknocont(FILE *item, char *id) {
+  char statusbuf[ITEMID_LEN*2+21+5];
+
+  if (fseek(item,0,SEEK_SET)) ohshite("Rewind failed for checknocont %s",id);
+  if (!fgets(statusbuf,ITEMID_LEN*2+21,item)) {
+    if (ferror(item)) ohshite("Item %s status unreadable",id);
+    noitem(id); return 0;
+  }
+  if (strlen(statusbuf) != ITEMID_LEN*2+20 ||
+      statusbuf[ITEMID_LEN*2+19] != '\n')
+    ohshit("Item %s has corrupted status line",id);
+  return statusnocont(statusbuf);
+}
+
+static int subjectok(char **cmdp) {
+  if (!**cmdp) {
+    protocolviolation("511 No Subject line specified for new item."); return 0;
+  }
+  if (strlen(*cmdp)+sizeof(SUBJECT_PFXSTRING)-1 > TEXTLINE_MAXLEN) {
+    fputs("424 Subject is too long.\r\n",stdout);
+    return 0;
+  }
+  return 1;
+}
+
+char *getitemsubject(FILE *item, const char **emsg) {
+  /* If incorrectly formatted sets *emsg and returns 0. */
+  int i;
+  static char subjbuf[INPUTLINE_MAXLEN+5];
+  char *subjstart;
+  int l;
+
+  if (fseek(item,ITEMID_LEN*2+20,SEEK_SET)) {
+    *emsg= "fseek for subject failed"; return 0;
+  }
+  i=0;
+  for (;;) {
+    if (++i>4) { *emsg= "has no subject (searched first 4 lines)"; return 0; }
+    if (fgets(subjbuf,INPUTLINE_MAXLEN,item) ==0) {
+      if (ferror(item)) ohshite("Reading file looking for subject");
+      *emsg= "has no subject (searched until early EOF)";
+      return 0;
+    }
+    if (!strncmp(subjbuf,SUBJECT_PFXSTRING,sizeof(SUBJECT_PFXSTRING)-1)) break;
+  }
+  subjstart= subjbuf + sizeof(SUBJECT_PFXSTRING) - 1;
+  l= strlen(subjstart);
+  while (l && isspace(subjstart[l-1])) l--;
+  if (!l) { *emsg= "has empty subject"; return 0; }
+  subjstart[l]= 0;
+  return subjstart;
+}
+
+static int getnewsecret(unsigned char *buf) {
+  FILE *file;
+  struct stat stab;
+  long truncto;
+  int bytes= DEFAULT_SECRETBYTES;
+  int n;
+
+  file= fopen(RANDOMSTUFF_FILENAME,"r+b");
+  if (!file) ohshite("Failed to open " RANDOMSTUFF_FILENAME);
+  makelock(file,F_WRLCK,RANDOMSTUFF_FILENAME);
+  if (fstat(fileno(file),&stab)) ohshite("Failed to fstat " RANDOMSTUFF_FILENAME);
+  truncto= stab.st_size - bytes;
+  if (truncto <= RANDOMSTUFF_LOW) {
+    fputs("484 I've run out of random numbers - please try tomorrow.\r\n",
+          stdout);
+    log(ll_error,"Random numbers down to low water, registration rejected");
+    endsession();
+  } else if (truncto <= RANDOMSTUFF_WARN) {
+    log(ll_error,"Random numbers running low");
+  }
+  if (fseek(file, truncto, SEEK_SET) == -1) ohshite("Failed to seek for random");
+  memset(buf,0,SECRET_MAXBYTES);
+  errno=0; n= fread(buf,1,bytes,file);
+  if (n != bytes) ohshite("Failed to read random");
+  if (ftruncate(fileno(file),truncto)) ohshite("Failed to truncate random");
+  if (ufclose(file,RANDOMSTUFF_FILENAME)) ohshite("Failed to close random");
+  return bytes;
+}
+
+static void regster(void) {
+  struct userentry ue;
+  FILE *file;
+  int rc, i, child, status;
+  char sbuf[10];
+
+  log(ll_trace,"Registration requested `%s'",sess->userid); tcpident();
+
+  memcpy(ue.userid, sess->userid, USERID_MAXLEN);
+  ue.access= DEFAULT_ACCESS;
+  ue.ident= uil_md5initial;
+  ue.secretbytes= getnewsecret(ue.secret);
+  ue.lastref= gettime();
+  ue.disabled= 0;
+
+  rc= userdb_change(USERDB_FILENAME,&ue,2);
+  if (rc==1) {
+    log(ll_alert,"Re-registration rejected");
+    fputs("482 Re-registration denied - contact the editors.\r\n",stdout);
+    endsession();
+  } else if (rc==2) {
+    log(ll_error,"User database is full!");
+    fputs("484 Sorry, user database is full.  Please try again later.\r\n",
+          stdout);
+    endsession();
+  }
+
+  file= tmpfile(); if (!file) ohshite("Failed to make tmp file for secret");
+  for (i=0; i < ue.secretbytes; i++)
+    if (fprintf(file, "%02X", ue.secret[i]) == EOF)
+      ohshite("Failed to write digits of secret to tmp file");
+  if (fflush(file)) ohshite("Failed to flush digits of secret to tmp file");
+  if (fseek(file,0,SEEK_SET) == -1) ohshite("Failed to fseek secret tmp file");
+  if (lseek(fileno(file),0,SEEK_SET)==-1) ohshite("Failed to lseek secret tmp file ");
+
+  sprintf(sbuf,"%d",ue.access);
+  log(ll_alert,"Registration - sending mail ...");
+
+  if ((child= fork()) == -1) ohshite("Fork for reguser");
+  if (!child) {
+    close(0); errno=0;
+    if (dup(fileno(file))) { perror("Failed to dup file to stdin"); _exit(1); }
+    execlp(REGUSER_PROGRAM,REGUSER_PROGRAM,sess->userid,sbuf,sess->clientid,(char*)0);
+    perror("exec " REGUSER_PROGRAM " failed"); _exit(1);
+  }
+  if (waitpid(child,&status,0) != child)
+    ohshite("Failed to wait for reguser process");
+  if (!WIFEXITED(status))
+    ohshit("reguser subprocess failed with code %d",status);
+  status= WEXITSTATUS(status);
+  if (status == 0) {
+    log(ll_trace,"reguser subprocess completed successfully");
+    endsession();
+  }
+  if (status != 11) ohshit("reguser subprocess returned exit status %d",status);
+  log(ll_trace,"reguser subprocess gave exit status 11, allowing go-around");
+
+  sess->userid[0]= 0;
+}
+  
+/*
+ * Command implementations
+ */
+
+struct commandinfo {
+  const char *command;
+  void (*function)(char*);
+  int alevel;
+};
+
+/* GCC won't let me declare this static because I don't say
+ * how big it is.  How do I simply _declare_ rather than define
+ * this array ?
+ */
+const struct commandinfo commandinfos[];
+
+/*
+ * Identification, session management, etc.
+ */
+
+static void cmd_dbug(char *cmd) {
+  if (!noargs(cmd)) return;
+  if (!debugserver) {
+    if (!sess->supertrace) {
+      log(ll_alert,"Debug requested"); tcpident(); setsupertrace();
+      fputs("200 Debug mode enabled.\r\n",stdout);
+    } else {
+      log(ll_trace,"DBUG reissued; giving `200 Already operative'");
+      fputs("200 Debug mode already operative.\r\n",stdout);
+    }
+  } else {
+    if (sess->debuglevel < 9) {
+      sess->debuglevel++;
+      log(ll_trace,"Entering debug level %d",sess->debuglevel);
+      printf("200 Debug level %d.\r\n",sess->debuglevel);
+   } else {
+      fputs("200 Debug level already at maximum.\r\n",stdout);
+    }
+  }
+}
+
+static void cmd_comp(char *cmd) {
+  if (!strcasecmp(cmd,"DEFLATE")) {
+    sess->deflate= 1;
+    fputs("200 Data responses will be deflated.\r\n",stdout);
+  } else if (!strcasecmp(cmd,"NONE")) {
+    sess->deflate= 0;
+    fputs("200 Data responses will be plain text.\r\n",stdout);
+  } else {
+    protocolviolation("511 COMP must be followed by DEFLATE or NONE.");
+  }
+}
+
+static void cmd_help(char *cmd) {
+  const struct commandinfo *cip;
+  int pil;
+  
+  if (!noargs(cmd)) return;
+  log(ll_trace,"HELP requested"); setsupertrace();
+  fputs("250 Help information follows ...\r\n"
+        " The commands supported by this server are:\r\n",stdout);
+  for (pil=0, cip=commandinfos; cip->command; cip++,pil++) {
+    if (pil > 4) { fputs("\r\n",stdout); pil=0; }
+    printf("    %-10s",cip->command);
+  }
+  fputs("\r\n",stdout);
+  fputs(".\r\n",stdout);
+}
+
+static void cmd_quit(char *cmd) {
+  if (!noargs(cmd)) return;
+  log(ll_trace,"QUIT, closing");
+  fputs("280 Goodbye.\r\n",stdout);
+  endsession();
+}
+
+static int mustscanhex(char **cmdp, int n, unsigned char *dest) {
+  if (scanhex(cmdp,n,dest)) return 1;
+  protocolviolation("511 Hex stream contained non-hex-digit or finished too early.");
+  return 0;
+}
+
+static void md5_sendchal(void) {
+  struct timeval timevab;
+  unsigned long ul;
+  unsigned short us;
+  
+  if (gettimeofday(&timevab,(void*)0)) ohshite("Failed gettimeofday for nonce");
+  memcpy(sess->servernonce,&timevab.tv_sec,4);
+  ul= (timevab.tv_usec << 12) + sess->servseq; memcpy(sess->servernonce+4,&ul,4);
+  memcpy(sess->servernonce+8,&sess->calleraddr.sin_addr,4);
+  memcpy(sess->servernonce+12,&sess->calleraddr.sin_port,2);
+  us= getpid(); memcpy(sess->servernonce+14,&us,2);
+
+  if (sess->identue.secretbytes < 0 || sess->identue.secretbytes > SECRET_MAXBYTES)
+    ohshit("User database corrupted - secret length out of range");
+  
+  fputs("333 ",stdout); sendhex(sess->servernonce,16); fputs("\r\n",stdout);
+}
+
+static void md5_copyuserid(unsigned char *dest, const char *src) {
+  memset(dest,0,16);
+  strncpy(dest,src,16);
+}
+
+static void authfailure(const char *msg, int twoorthree) {
+  /* NB! This function sometimes RETURNS! */
+  if (sess->alevel) {
+    fprintf(stdout,"43%d %s.\r\n",twoorthree,msg); return;
+  } else {
+    fprintf(stdout,"48%d %s.\r\n",twoorthree,msg);
+    log(ll_trace,"Closing due to auth failure");
+    endsession();
+  }
+}
+
+static void authorise(const char *userid, int ac) {
+  const struct userentry *uep;
+  struct userentry ue;
+
+  log(ll_trace,"Requested user `%.50s', access %d", userid, ac);
+  if (sess->debuglevel > 0) {
+    setstatus(al_edit,"Login successful - debug mode");
+    return;
+  }
+  uep= userdb_find(USERDB_FILENAME,userid,ac);
+  if (!uep) {
+    if (ac>=0 && (uep= userdb_find(USERDB_FILENAME,userid,-1))) {
+      if (uep->access > 0) {
+        log(ll_alert,"Wrong access level - can have %d",uep->access);
+        tcpident(); authfailure("You are denied that access level",2); return;
+      }
+    } else {
+      log(ll_alert,"Unknown user rejected"); tcpident();
+      authfailure("You are unknown to me - please ask the Editors for a userid",2);
+      return;
+    }
+  }
+  ue= *uep;  ue.lastref= gettime();  userdb_change(USERDB_FILENAME,&ue,0);
+  if (uep->disabled) {
+    log(ll_alert,"Disabled user rejected"); tcpident();
+    authfailure("That userid is disabled; contact the Editors",2);
+    endsession();
+  }
+  switch (uep->ident) {
+  case uil_none:
+    if (uep->access < 0 || uep->access > al_max)
+      ohshit("Unknown access level code `%d'",uep->access);
+    setstatus(uep->access,"Unconfirmed login OK");
+    return;
+  case uil_md5initial:
+    log(ll_trace,"This user still in `initial' registration state");
+  case uil_md5:
+    log(ll_trace,"Requested proof of identity");
+    fputs("130 MD5  Please provide proof of identity.\r\n",stdout);
+    memcpy(&sess->identue, uep, sizeof(sess->identue));
+    md5_sendchal();
+    return;
+  default:
+    ohshit("Unknown ident level code `%d'",uep->ident,userid);
+  }
+}
+
+static void cmd_auth(char *cmd) {
+  struct MD5Context md5ctx;
+  unsigned char clienthash[16], clientnonce[16], digest[16];
+  unsigned char messagebuf[16*3+SECRET_MAXBYTES];
+  char *hexp;
+  unsigned char *p, *q;
+  int i, rc;
+
+  if (!*sess->identue.userid) {
+    protocolviolation("500 AUTH not expected."); return;
+  }
+  hexp= cmd;
+  if (!mustscanhex(&cmd,16,clienthash)) return;
+  skipspace(&cmd);
+  if (!mustscanhex(&cmd,16,clientnonce) || !noargs(cmd)) return;
+
+  if (sess->supertrace) log(ll_debug,"AUTH was `%s'",hexp);
+
+  memcpy(messagebuf,clientnonce,16);
+  memcpy(messagebuf+16,sess->servernonce,16);
+  md5_copyuserid(messagebuf+32,sess->identue.userid);
+  for (p=sess->identue.secret, q=messagebuf+48, i=sess->identue.secretbytes;
+       /* We checked the value of identue.secretbytes in md5_sendchal. */
+       i>0;
+       i--) *q++= ~*p++;
+  MD5Init(&md5ctx);
+  if (sess->debuglevel > 0) {
+    fputs("119 clienthash=MD5(",stdout);
+    sendhex(messagebuf,48);
+    fprintf(stdout,"!!%d)\r\n",sess->identue.secretbytes);
+  }
+  MD5Update(&md5ctx,messagebuf,48+sess->identue.secretbytes);
+  MD5Final(digest,&md5ctx);
+  if (sess->debuglevel > 1) {
+    fputs("119 clienthash=",stdout);
+    sendhex(digest,16);
+    fputs("\r\n",stdout);
+  }
+  if (memcmp(digest,clienthash,16)) {
+    log(ll_alert,"Crypto mismatch - access denied"); tcpident();
+    authfailure("Identity confirmation failed",3); *sess->identue.userid=0; return;
+  }
+
+  memcpy(messagebuf,sess->servernonce,16);
+  memcpy(messagebuf+16,clientnonce,16);
+  md5_copyuserid(messagebuf+32,sess->identue.userid);
+  memcpy(messagebuf+48,sess->identue.secret,sess->identue.secretbytes);
+  MD5Init(&md5ctx);
+  if (sess->debuglevel > 0) {
+    fputs("119 serverhash=MD5(",stdout);
+    sendhex(messagebuf,48);
+    fprintf(stdout,"??%d)\r\n",sess->identue.secretbytes);
+  }
+  MD5Update(&md5ctx,messagebuf,48+sess->identue.secretbytes);
+  MD5Final(digest,&md5ctx);
+  fputs("133 ",stdout); sendhex(digest,16); fputs("\r\n",stdout);
+
+  if (sess->identue.ident==uil_md5initial) {
+    sess->identue.ident= uil_md5;
+    rc= userdb_change(USERDB_FILENAME,&sess->identue,0);
+    if (rc) ohshit("Change ident level status return %d",rc);
+    log(ll_trace,"Registration confirmed by successful login");
+    setstatus(sess->identue.access,"Registration complete");
+  } else {
+    setstatus(sess->identue.access,"Identity confirmed");
+  }
+  *sess->identue.userid= 0;
+}
+
+static void cmd_alvl(char *cmd) {
+  int ac;
+
+  ac= getalvl(&cmd); if (ac<-1) return;
+
+  if (!*sess->userid) {
+    protocolviolation("500 Need to be logged in using USER to use ALVL."); return;
+  }
+  if (*sess->identue.userid) {
+    protocolviolation("500 Authentication procedure in progress."); return;
+  }
+  if (ac == -1) {
+    fputs("432 Sorry, I don't do default levels.\r\n",stdout);
+  } else if (ac < sess->alevel) {
+    setstatus(ac,"Access downgraded on request");
+  } else if (ac == sess->alevel) {
+    fprintf(stdout,"23%d Access level unchanged.\r\n",sess->alevel);
+  } else {
+    authorise(sess->userid,ac);
+  }
+}
+
+static void cmd_user(char *cmd) {
+  int ac= -1;
+  char *p;
+  const char *e;
+  char violationbuf[512];
+  
+  p= strchr(cmd,' ');
+  if (p) {
+    *p++= 0;  skipspace(&p);
+    ac= getalvl(&p); if (ac<-1) return;
+    skipspace(&p); if (!noargs(p)) return;
+  }
+  if (*sess->userid) { protocolviolation("500 Already logged in."); return; }
+  sess->userid[USERID_MAXLEN]= 0;
+  if ((e= userdb_checkid(cmd,sess->userid))) {
+    sprintf(violationbuf,"511 Malformed or missing userid (`%.50s', %.200s)", cmd, e);
+    protocolviolation(violationbuf); *sess->userid= 0; return;
+  }
+  if (sess->registration) regster();
+  else authorise(sess->userid,ac);
+}
+
+static void cmd_regu(char *cmd) {
+  if (!noargs(cmd)) return;
+  if (sess->userid[0] || sess->registration) {
+    protocolviolation("500 REGU not allowed after USER or REGU."); return;
+  }
+
+  fputs("100 Processing registration request - please stand by.\r\n",stdout);
+  fputs(REGUWARNING_STRING,stdout);
+  sess->registration= 1;
+  log(ll_alert,"REGU accepted, warning issued"); tcpident();
+}
+
+/*
+ * Contributions and replies
+ */
+
+static void cmd_cont(char *cmd) {
+  FILE *olditem, *index;
+  char oldidfile[ITEM_MAXFILENAMELEN+5];
+  struct itemmeta m;
+  unsigned long sequence;
+  time_t currenttime;
+  char *newid, *oldsubject;
+  const char *emsg;
+  int known;
+
+  if (!datadone() || !subjectok(&cmd) || !noeditinprogress()) return;
+  if (!sess->maycontinue) {
+    protocolviolation("520 Continuation only allowed after "
+                      "an item found to be too full.");
+    return;
+  }
+  index= fopen(INDEX_FILENAME,"a+");
+  if (!index) ohshite("Index inaccessible for continuation");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  
+  id2file(sess->saveditemid,oldidfile);
+  itemunpack(sess->saveditemid,oldidfile);
+  olditem= fopen(oldidfile,"r+");
+  if (!olditem) {
+    if (errno!=ENOENT)
+      ohshite("Item %s inaccessible for continuation",sess->saveditemid);
+    noitem(sess->saveditemid); ufclose(index,INDEX_FILENAME); return;
+  }
+
+  sequence= getsequence();
+  currenttime= gettime();
+  makelock(olditem,F_WRLCK,oldidfile);
+  known= metaget(sess->saveditemid,&m);
+  if (known ? !statusnocont(m.status) : !checknocont(olditem,sess->saveditemid)) {
+    ufclose(index,INDEX_FILENAME); ufclose(olditem,oldidfile); return;
+  }
+  oldsubject= known ? m.subject : getitemsubject(olditem,&emsg);
+  if (!oldsubject) ohshit("Item %s %s",sess->saveditemid,emsg);
+  metabegin(sess->saveditemid);
+  newid= createitem(index,sequence,currenttime,cmd,'C',sess->saveditemid);
+  indexentry(index,sequence,currenttime,sess->saveditemid,'F',oldsubject);
+
+  if (fseek(olditem,ITEMID_LEN+1,SEEK_SET))
+    ohshite("AARGH! Item %s unseekable for recording continuation",sess->saveditemid);
+  errno=0;
+  if (fwrite(newid,1,ITEMID_LEN,olditem)!=ITEMID_LEN)
+    ohshite("AARGH! Item %s unwriteable for recording continuation",sess->saveditemid);
+  if (fseek(olditem,ITEMID_LEN*2+11,SEEK_SET))
+    ohshite("AARGH! Item %s unseekable for recording reply sequence",sess->saveditemid);
+  if (fprintf(olditem,"%08lX",sequence) == EOF)
+    ohshite("AARGH! Item %s recording reply sequence failed",sess->saveditemid);
+  sess->maycontinue= 0;
+  if (fseek(olditem,0,SEEK_END))
+    ohshite("AARGH! Item %s unseekable for appending continuationmarker");
+  if (fprintf(olditem, "\n^%08lX %08lX\n[Continued in %s by %s.]\n",
+              sequence, currenttime, newid, sess->userid) == EOF)
+    ohshite("AARGH! Item %s unwriteable for appending continuationmarker",
+            sess->saveditemid);
+
+  if (fflush(olditem))
+    ohshite("AARGH! Failed to write item %s after continuing in %s",
+            sess->saveditemid,newid);
+  wirerender(fileno(olditem),oldidfile);
+  if (ufclose(olditem,oldidfile))
+      ohshite("AARGH! Failed to close item %s after continuing in %s",
+             sess->saveditemid,newid);
+  metaputfile(sess->saveditemid,oldidfile);
+  metaend();
+  if (ufclose(index,INDEX_FILENAME))
+    ohshite("AARGH! Failed to close index after entry about %s",newid);
+  printf("220 %08lX  Continuation item inserted and index updated.\r\n",
+         sequence);
+}
+
+static FILE *datafile(void) {
+  /* Makes the scratch file for DATA, in memory if we can. */
+  FILE *file;
+  int fd;
+
+  fd= syscall(SYS_memfd_create,"rgtpd-data",MFD_CLOEXEC);
+  if (fd == -1) return tmpfile();
+  file= fdopen(fd,"w+");
+  if (!file) close(fd);
+  return file;
+}
+
+static void cmd_data(char *cmd) {
+  /* DATA REPL itemid and DATA NEWI subject are followed straight away
+   * by the data, and do the REPL or NEWI at the end of it, so a post
+   * is one exchange: no 150 or 350, just the 220 (or the error). */
+  if (*cmd && strncasecmp(cmd,"REPL ",5) && strncasecmp(cmd,"NEWI ",5) &&
+      !noargs(cmd)) return;
+  if (*cmd && sess->lenbeforeedit!=-1) {
+    /* The data's on its way regardless; ignore it, rather than take
+     * it as the edit, and leave any DATA for the edit alone. */
+    sess->indata= 2;
+    return;
+  }
+  if (sess->data) fclose(sess->data);
+  sess->data= datafile();
+  if (!sess->data) ohshite("Failed to create temporary file");
+  strcpy(sess->datacmd,cmd);
+  sess->datafirstline= sess->lenbeforeedit==-1 || sess->saveditemid[0];
+  *sess->grogname= 0;
+  sess->dataerror= 0;
+  sess->indata= 1;
+  if (*sess->datacmd) return;
+  printf("150 Send %s; finish with `.'\r\n",
+         sess->lenbeforeedit==-1 ? "grogname and text" :
+         sess->saveditemid[0] ? "item status (ignored) and updated contents" :
+                          "updated index");
+}
+
+static void cmd_newi(char *cmd);
+static void cmd_repl(char *cmd);
+
+static void dataend(void) {
+  char *cmd;
+
+  if (sess->indata == 2) {
+    sess->indata= 0;
+    noeditinprogress();
+    return;
+  }
+  sess->indata= 0;
+  if (sess->dataerror) {
+    if (sess->dataerror[0] == '5') {
+      protocolviolation(sess->dataerror);
+    } else {
+      fputs(sess->dataerror,stdout);
+    }
+    fclose(sess->data);
+    sess->data= 0;
+  } else {
+    if (fflush(sess->data)) ohshite("Flushing data to temporary file");
+    rewind(sess->data);
+    if (fstat(fileno(sess->data),&sess->dstab) <0)
+      ohshite("Reply temporary file unstattable");
+    if (sess->lenbeforeedit==-1 && sess->dstab.st_size > CONTRIB_MAXLEN) {
+      fputs("423 Data is too long for a Reply or Contribution.\r\n",stdout);
+      fclose(sess->data); sess->data=0;
+      return;
+    }
+    if (*sess->datacmd) {
+      cmd= sess->datacmd+5; skipspace(&cmd);
+      if (toupper(*sess->datacmd) == 'R') cmd_repl(cmd); else cmd_newi(cmd);
+      return;
+    }
+    fputs("350 Data received, thanks.  What shall I do with it?\r\n",stdout);
+  }
+}
+
+static void dataline(char *mybuf, int toolong) {
+  /* Deals with one line sent after DATA; mybuf has had its newline
+   * removed.  toolong means the line was truncated.
+   */
+  const char *msg;
+  int l;
+  char *linestart;
+
+  if (toolong) {
+    sess->dataerror= "512 Line in transmitted data is far too long.";
+    return;
+  }
+  l= strlen(mybuf);
+  while (l>0 && isspace(mybuf[l-1])) l--;
+  if (*mybuf=='.') {
+    if (l==1) { dataend(); return; }
+    if (mybuf[1] != '.') {
+      protocolviolation("582 Line starting with `.' wasn't "
+                        "dot-doubled or endmarker.");
+      log(ll_trace,"Dot-doubling messed up, closing");
+      endsession();
+    }
+    l--;
+    linestart= mybuf+1;
+  } else {
+    linestart= mybuf;
+  }
+  if (sess->indata == 2) return;
+  if (!sess->dataerror) {
+    if (sess->lenbeforeedit!=-1 && !sess->saveditemid[0]) {
+      if (l < INDEXENTRY_LENINF-1) {
+        memset(linestart+l,' ',INDEXENTRY_LENINF-1-l);
+        l= INDEXENTRY_LENINF-1;
+      }
+      msg=
+        l >= INDEXENTRY_LENINF                            ? "line too long"      :
+        strspn(linestart,"0123456789ABCDEFabcdef") != 8   ? "gsn format"         :
+        linestart[8] != ' '                               ? "space after gsn"    :
+        strspn(linestart+9,"0123456789ABCDEFabcdef") != 8 ? "date format"        :
+        linestart[17] != ' '                              ? "space after date"   :
+        !strchr("RICFEM",linestart[28+USERID_MAXLEN])     ? "RICFEM character"   :
+        linestart[27+USERID_MAXLEN] != ' '                ? "space after userid" :
+        linestart[29+USERID_MAXLEN] != ' '                ? "space after RICFEM" :
+        (linestart[28+USERID_MAXLEN] == 'M' ?
+         (strspn(linestart+18," ") < 9                    ? "itemid blank in M"  :
+          0 ) :
+         (!isalpha(linestart[18])                         ? "itemid letter"      :
+          strspn(linestart+19,"0123456789") != 7          ? "itemid digits"      :
+          linestart[26] != ' '                            ? "space after itemid" :
+          0 ));
+      if (msg) {
+        linestart[l]= 0;
+        sprintf(sess->dataerbuf,"423 Malformed index entry `%.*s': %s.\r\n",
+                INPUTLINE_MAXLEN-125, linestart, msg);
+        sess->dataerror= sess->dataerbuf;
+      }
+    } else {/* not a replacement index */
+      if (l > TEXTLINE_MAXLEN) {
+        l= TEXTLINE_MAXLEN;
+        sess->dataerror= "423 Line too long for text of item.\r\n";
+      }
+    }
+  } /* !dataerror */
+  linestart[l]= 0;
+  if (sess->datafirstline) {
+    if (l + sizeof(LONGGROGNAME_PFXSTRING)-1 > TEXTLINE_MAXLEN) {
+      sess->dataerror= "425 Grogname too long.\r\n";
+    } else {
+      strcpy(sess->grogname,linestart);
+    }
+    sess->datafirstline= 0;
+  } else if (!sess->dataerror) {
+    if (*linestart) {
+      if (*linestart=='^' && sess->lenbeforeedit==-1) {
+        if (fputc('^',sess->data)==EOF)
+          ohshite("Write failed ^-stuff to temp file");
+      }
+      if (fputs(linestart,sess->data)<0) ohshite("Write failed to temporary file");
+    }
+    if (fputc('\n',sess->data)==EOF)
+      ohshite("Write newline to temporary file failed");
+  }
+}
+
+static void cmd_newi(char *cmd) {
+  FILE *index;
+  char *newid;
+  unsigned long sequence;
+  time_t currenttime;
+
+  if (!noeditinprogress() || !datadone() || !subjectok(&cmd)) return;
+    
+  sess->maycontinue= 0; /* Cancel any pending CONT possibility */
+  index= fopen(INDEX_FILENAME,"a+");
+  if (!index) ohshite("Index inaccessible for reply append");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  sequence= getsequence();
+  currenttime= gettime();
+  metabegin(0);
+  newid= createitem(index, sequence, currenttime, cmd, 'I', "");
+  metaend();
+  if (ufclose(index,INDEX_FILENAME))
+    ohshite("AARGH! Failed to close index after entry about %s",newid);
+  printf("220 %08lX  Item inserted and index updated.\r\n",sequence);
+}
+
+static void cmd_repl(char *cmd) {
+  FILE *item,*index;
+  struct stat istab;
+  struct itemmeta m;
+  char *datestring, *id;
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  char headbuf[USERID_MAXLEN+INPUTLINE_MAXLEN+TEXTLINE_MAXLEN+5];
+  char *subjstart;
+  const char *emsg;
+  unsigned long sequence;
+  time_t currenttime;
+  int known;
+
+  if (!noeditinprogress() || !datadone() || !(id=getitemid(cmd))) return;
+
+  if (sess->dstab.st_size > REPLY_MAXLEN) {
+    fputs("423 Data is too long for a Reply.\r\n",stdout);
+    fclose(sess->data); sess->data=0;
+    return;
+  }
+  
+  sess->maycontinue= 0; /* Cancel any pending CONT possibility */
+  index= fopen(INDEX_FILENAME,"a+");
+  if (!index) ohshite("Index inaccessible for reply append");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+
+  id2file(id,idfile);
+  itemunpack(id,idfile);
+  item= fopen(idfile,"r+");
+  if (!item) {
+    if (errno!=ENOENT) ohshite("Item %s inaccessible for reply",id);
+    noitem(id); ufclose(index,INDEX_FILENAME); return;
+  }
+  makelock(item,F_WRLCK,idfile);
+
+  known= metaget(id,&m);
+  if (known ? !statusnocont(m.status) : !checknocont(item,id)) {
+    ufclose(index,INDEX_FILENAME); ufclose(item,idfile); return;
+  }
+  if (known) {
+    istab.st_size= m.length;
+  } else if (fstat(fileno(item),&istab) <0) {
+    ohshite("Item %s unstattable for reply",id);
+  }
+  if (istab.st_size + sess->dstab.st_size > ITEM_MAXLEN) {
+    fputs("421 Reply is too long to fit in the same item.\r\n",stdout);
+    strcpy(sess->saveditemid,id); sess->maycontinue= 1;
+    ufclose(index,INDEX_FILENAME); ufclose(item,idfile); return;
+  }
+  sequence= getsequence();
+  currenttime= gettime();
+  subjstart= known ? m.subject : getitemsubject(item,&emsg);
+  if (!subjstart) ohshit("Item %s %s",id,emsg);
+  metabegin(id);
+  if (fseek(item,ITEMID_LEN*2+11,SEEK_SET))
+    ohshite("Item %s unseekable for recording reply sequence",id);
+  if (fprintf(item,"%08lX",sequence) == EOF)
+    ohshite("AARGH! Item %s recording reply sequence failed",id);
+  if (fseek(item,0,SEEK_END)) ohshite("AARGH! Item %s unseekable to end",id);
+
+  datestring= makedatestring(currenttime);
+  if (!*sess->grogname) {
+    sprintf(headbuf,REPLYSTART_PFXSTRING "from %s at %s\n",sess->userid,datestring);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              REPLYSTART_PFXSTRING "submitted at %s by\n"
+              LONGUSERID_PFXSTRING "%s\n",
+              datestring,sess->userid);
+  } else {
+    sprintf(headbuf,REPLYSTART_PFXSTRING "from %s (%s) at %s\n",
+            sess->grogname,sess->userid,datestring);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              REPLYSTART_PFXSTRING "from %s at %s\n"
+              LONGGROGNAME_PFXSTRING "%s\n",
+              sess->userid,datestring,sess->grogname);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              REPLYSTART_PFXSTRING "from %s at %s\n"
+              LONGUSERID_PFXSTRING "%s\n",
+              sess->grogname,datestring,sess->userid);
+    if (line1toolong(headbuf))
+      sprintf(headbuf,
+              REPLYSTART_PFXSTRING "submitted at %s\n"
+              LONGGROGNAME_PFXSTRING "%s\n"
+              LONGUSERID_PFXSTRING "%s\n",
+              datestring,sess->grogname,sess->userid);
+  }
+  if (fprintf(item,"\n^%08lX %08lX\n%s\n",sequence,currenttime,headbuf) == EOF)
+    ohshite("AARGH! Failed to write reply header to %s",id);
+  copycontrib(item,id);
+  unlock(item,idfile);
+  metaputfile(id,idfile);
+  metaend();
+  wirerenderfile(idfile);
+  
+  indexentry(index, sequence, currenttime, id, 'R', subjstart);
+  if (ufclose(index,INDEX_FILENAME))
+    ohshite("AARGH! Failed to close index after reply to %s",id);
+  printf("220 %08lX  Reply to %s inserted and index updated.\r\n",sequence,id);
+}
+
+/*
+ * Retreival
+ */
+
+static void cmd_elog(char *cmd) {
+  struct snapshot snap;
+  FILE *elog;
+
+  if (!noargs(cmd)) return;
+  elog= fopen(EDITLOG_FILENAME,"r");
+  if (!elog) {
+    if (errno==ENOENT) {
+      fputs("250 No edits stored\r\n.\r\n",stdout); return;
+    }
+    ohshite("Edit log `" EDITLOG_FILENAME "' inaccessible");
+  }
+  snapinit(&snap);
+  if (!snapwire(&snap,fileno(elog),EDITLOG_FILENAME,0,-1))
+    snapcopy(&snap,elog,EDITLOG_FILENAME);
+  fclose(elog);
+  sendsnapshot(&snap,EDITLOG_FILENAME);
+}
+
+static long indexchanged(void) {
+  /* Returns the sequence number of the last change to the index.
+   * Everything that takes a sequence number either makes an entry or
+   * edits the index, so that's the last one taken. */
+  FILE *index, *seqfile;
+  unsigned long v;
+
+  index= fopen(INDEX_FILENAME,"r"); if (!index) ohshite("Index inaccessible");
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  seqfile= fopen(SEQUENCE_FILENAME,"r");
+  if (!seqfile) ohshite("Failed to open " SEQUENCE_FILENAME);
+  errno=0; if (fscanf(seqfile,"%lx",&v) != 1)
+    ohshite("Failed to read " SEQUENCE_FILENAME);
+  fclose(seqfile);
+  ufclose(index,INDEX_FILENAME);
+  return (long)v-1;
+}
+
+static void cmd_indx(char *cmd) {
+  /* INDX [[#]from] [TO [#]upto] [MAX count]; if MAX cuts it short, a
+   * 121 line says where the next INDX should start from.  INDX IF #seq
+   * is the whole index, with a 123 line saying how up to date it is. */
+  FILE *index;
+  long datefrom,upto,limit,min,max,end,next,since,last;
+  int useseq=0,toseq=0,hasto=0;
+  struct indexview v;
+  struct snapshot snap;
+  char *estr;
+
+  if (!strncasecmp(cmd,"ITEM ",5)) {
+    if ((estr= getitemid(cmd+5))) xrefindx('i',estr);
+    return;
+  }
+  if (!strncasecmp(cmd,"USER ",5)) {
+    cmd+= 5;
+    if (!*cmd || strlen(cmd) > USERID_MAXLEN || strchr(cmd,' ')) {
+      protocolviolation("511 Userid must be given, without spaces."); return;
+    }
+    xrefindx('u',cmd);
+    return;
+  }
+  if (!strncasecmp(cmd,"TYPE ",5)) {
+    cmd+= 5;
+    if (!*cmd || cmd[1]) { protocolviolation("511 Type must be one character."); return; }
+    *cmd= toupper(*cmd);
+    xrefindx('t',cmd);
+    return;
+  }
+  if (!strncasecmp(cmd,"IF ",3)) {
+    /* The whole index, if it's changed since seq. */
+    if (!ifchanged(cmd,&since)) return;
+    last= indexchanged();
+    if (last <= since) { notchanged(last); return; }
+    printf("123 #%08lX Index as of this sequence number.\r\n",last);
+    cmd+= strlen(cmd);
+  }
+  if (*cmd == '#') { cmd++; useseq=1; }
+  datefrom= 0;
+  if (*cmd && *cmd != ' ') {
+    datefrom= strtol(cmd,&estr,16);
+    if (estr == cmd || (*estr && *estr != ' ')) {
+      protocolviolation("511 Date must be only a hex number."); return;
+    }
+    cmd= estr;
+  }
+  upto= limit= 0;
+  while (*cmd == ' ') {
+    cmd++;
+    if (!hasto && !strncasecmp(cmd,"TO ",3)) {
+      cmd+= 3;
+      if (*cmd == '#') { cmd++; toseq=1; }
+      upto= strtol(cmd,&estr,16);
+      if (estr == cmd || (*estr && *estr != ' ')) {
+        protocolviolation("511 TO must be followed by a hex date or #sequence number."); return;
+      }
+      cmd= estr; hasto= 1;
+    } else if (!limit && !strncasecmp(cmd,"MAX ",4)) {
+      cmd+= 4;
+      limit= strtol(cmd,&estr,10);
+      if (estr == cmd || limit <= 0 || (*estr && *estr != ' ')) {
+        protocolviolation("511 MAX must be followed by a positive count."); return;
+      }
+      cmd= estr;
+    } else {
+      protocolviolation("511 Date must be only a hex number."); return;
+    }
+  }
+  if (*cmd) { protocolviolation("511 Date must be only a hex number."); return; }
+  if (!hasto && !limit && mirrorindx(datefrom,useseq)) return;
+  index= fopen(INDEX_FILENAME,"r"); if (!index) ohshite("Index inaccessible");
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  if (ixopen(&v,fileno(index))) {
+    if (errno == EINVAL) ohshit("Index corrupt - invalid length or manifest");
+    ohshite("Index segments unreadable");
+  }
+  min= ixsearch(&v,useseq,datefrom);
+  max= hasto ? ixsearch(&v,toseq,upto+1) : v.records;
+  if (max < min) max= min;
+  next= -1;
+  if (limit && max-min > limit) {
+    /* Don't stop among entries with the same sequence number, or the
+     * next INDX would send some of them again. */
+    end= min+limit;
+    next= ixvalue(&v,end,1);
+    while (end > min && ixvalue(&v,end-1,1) == next) end--;
+    if (end == min)
+      while (end < max && ixvalue(&v,end,1) == next) end++;
+    next= end < max ? ixvalue(&v,end,1) : -1;
+    max= end;
+  }
+  if (sess->debuglevel > 2)
+    printf("119  from=%-2ld  to=%-2ld  of=%-2ld\r\n",min,max,v.records);
+  snapinit(&snap);
+  snapindex(&snap,&v,index,min,max);
+  ixclose(&v);
+  ufclose(index,INDEX_FILENAME);
+  if (next != -1) printf("121 #%08lX More entries follow.\r\n",next);
+  sendsnapshot(&snap,INDEX_FILENAME);
+}
+
+static long indexlast(void) {
+  /* Returns the sequence number of the last entry in the index, or -1
+   * if there are none. */
+  FILE *index;
+  struct indexview v;
+  long last;
+
+  last= mirrorlast();
+  if (last != -2) return last;
+  index= fopen(INDEX_FILENAME,"r"); if (!index) ohshite("Index inaccessible");
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  if (ixopen(&v,fileno(index))) {
+    if (errno == EINVAL) ohshit("Index corrupt - invalid length or manifest");
+    ohshite("Index segments unreadable");
+  }
+  last= v.records ? ixvalue(&v,v.records-1,1) : -1;
+  ixclose(&v);
+  ufclose(index,INDEX_FILENAME);
+  return last;
+}
+
+static void waitreply(void) {
+  char buf[20];
+
+  sprintf(buf,"#%lX",sess->waitfor);
+  cmd_indx(buf);
+}
+
+static void engineinterest(struct session *s);
+
+static void waitagain(void) {
+  /* -multiplex: enginewaits thinks sess's WAIT might be over. */
+  sess->waitword= mirrorword();
+  if (gettime() < sess->waituntil && indexlast() < sess->waitfor) {
+    sess->waiting= 1; return;
+  }
+  sess->waiting= 0; nwaiting--;
+  engineinterest(sess);
+  waitreply();
+}
+
+static void cmd_wait(char *cmd) {
+  /* WAIT [#]seq [secs]: waits until the index has an entry numbered seq
+   * or later, and then (or when secs is up) answers as INDX #seq. */
+  time_t now, secs;
+  int word;
+  char *estr;
+
+  if (*cmd == '#') cmd++;
+  sess->waitfor= strtol(cmd,&estr,16);
+  if (estr == cmd || (*estr && *estr != ' ')) {
+    protocolviolation("511 WAIT must be followed by a sequence number."); return;
+  }
+  cmd= estr; skipspace(&cmd);
+  secs= WAIT_TIMEOUT;
+  if (*cmd) {
+    secs= strtol(cmd,&estr,10);
+    if (estr == cmd || *estr || secs < 0) {
+      protocolviolation("511 WAIT's timeout must be a number of seconds."); return;
+    }
+    if (secs > WAIT_MAXTIMEOUT) secs= WAIT_MAXTIMEOUT;
+  }
+  now= gettime();
+  sess->waituntil= now+secs;
+  for (;;) {
+    word= mirrorword();
+    if (indexlast() >= sess->waitfor || now >= sess->waituntil) break;
+    if (multiplex) {
+      /* enginewaits will finish it */
+      sess->waiting= 1; sess->waitword= word; nwaiting++;
+      engineinterest(sess);
+      return;
+    }
+    clientflush(); /* answers to anything sent before the WAIT */
+    mirrorwait(word,sess->waituntil-now);
+    now= gettime();
+  }
+  waitreply();
+}
+
+static void cmd_motd(char *cmd) {
+  /* MOTD [IF #seq] */
+  struct snapshot snap;
+  FILE *motd;
+  char buf[18];
+  long since, last;
+
+  if (!ifchanged(cmd,&since)) return;
+  motd= fopen(MOTD_FILENAME,"r");
+  if (!motd) {
+    if (errno!=ENOENT) ohshite("Message of the Day inaccessible");
+    printf("410 There is no message of the day.\r\n");
+    return;
+  }
+  makelock(motd,F_RDLCK,MOTD_FILENAME);
+  /* It starts with the date and the sequence number it was set at. */
+  if (since != -1 && pread(fileno(motd),buf,18,0) == 18 &&
+      buf[8] == ' ' && buf[17] == '\n') {
+    buf[17]= 0;
+    last= strtol(buf+9,0,16);
+    if (last <= since) { ufclose(motd,MOTD_FILENAME); notchanged(last); return; }
+  }
+  snapinit(&snap);
+  if (!snapwire(&snap,fileno(motd),MOTD_FILENAME,0,-1))
+    snapcopy(&snap,motd,MOTD_FILENAME);
+  ufclose(motd,MOTD_FILENAME);
+  sendsnapshot(&snap,MOTD_FILENAME);
+}
+
+static void copyafter(FILE *item, const char *filename, long seq, FILE *out) {
+  /* Writes item's status line, and then what was appended to it with
+   * the contributions after seq, as copyfile would. */
+  char buf[INPUTLINE_MAXLEN+5];
+  int l, first, sending, blank;
+
+  first= 1; sending= blank= 0;
+  while (fgets(buf,INPUTLINE_MAXLEN,item)) {
+    l= strlen(buf);
+    if (!l || buf[l-1] != '\n')
+      ohshit("File containing %s is corrupted",filename);
+    if (!first && !sending && buf[0] == '^' && isxdigit((unsigned char)buf[1]) &&
+        strtol(buf+1,0,16) > seq) {
+      sending= 1;
+      if (blank) fputs("\r\n",out);
+    }
+    if (first || sending) {
+      if (buf[0]=='.') fputc('.',out);
+      fwrite(buf,1,l-1,out);
+      fputs("\r\n",out);
+    }
+    blank= l == 1;
+    first= 0;
+  }
+  if (ferror(item)) ohshite("Error reading %s",filename);
+}
+
+static void cmd_item(char *cmd) {
+  /* ITEM id [#seq] [IF #seq]: with #seq, just the status line and
+   * what's been appended since the contribution numbered seq, so that
+   * a client with the item as it was then can bring it up to date
+   * (unless the status line says it's been edited since).  IF looks
+   * only at the status line, in the summary if we have one. */
+  const struct itemmark *mark;
+  struct snapshot snap;
+  struct itemmeta m;
+  struct stat stab;
+  FILE *item, *mem;
+  char idfile[ITEM_MAXFILENAMELEN+5], *id, *estr, *p;
+  char statusbuf[ITEMID_LEN*2+21+5];
+  long packed, seq, since, last;
+  int known;
+
+  seq= -1;
+  p= strchr(cmd,' ');
+  if (p) {
+    *p++= 0; skipspace(&p);
+    if (*p == '#') {
+      seq= strtol(p+1,&estr,16);
+      if (estr == p+1 || (*estr && *estr != ' ') || seq < 0) {
+        protocolviolation("511 ITEM's # must be followed by a sequence number."); return;
+      }
+      p= estr; skipspace(&p);
+    }
+  }
+  if (!ifchanged(p ? p : "",&since)) return;
+  if (!(id=getitemid(cmd))) return;
+  known= metaget(id,&m);
+  if (since != -1 && known && (last= statusseq(m.status)) <= since) {
+    notchanged(last); return;
+  }
+  id2file(id,idfile);
+  item= itemopen(id,idfile,&packed);
+  if (!item) { noitem(id); return; }
+  if (since != -1 && !known) {
+    if (!fgets(statusbuf,ITEMID_LEN*2+21,item)) {
+      if (ferror(item)) ohshite("Item %s status unreadable",id);
+      ufclose(item,idfile); noitem(id); return;
+    }
+    if (strlen(statusbuf) != ITEMID_LEN*2+20 ||
+        statusbuf[ITEMID_LEN*2+19] != '\n')
+      ohshit("Item %s has corrupted status line",id);
+    last= statusseq(statusbuf);
+    if (last <= since) { ufclose(item,idfile); notchanged(last); return; }
+    rewind(item);
+  }
+  snapinit(&snap);
+  if (seq == -1) {
+    if (packed >= 0 || !snapwire(&snap,fileno(item),idfile,0,-1))
+      snapcopy(&snap,item,id);
+  } else if (metaget(id,&m) && metamark(&m,seq,&mark) &&
+             (packed >= 0 ? packed : fstat(fileno(item),&stab) ? -1 : stab.st_size)
+             == m.length) {
+    /* We have the item locked, so this is its summary as it is now. */
+    mem= snapstream(&snap,idfile);
+    fprintf(mem,"%s\r\n",m.status);
+    if (fclose(mem)) ohshite("Failed to make snapshot of %s",idfile);
+    if (mark && (packed >= 0 ||
+                 !snapwire(&snap,fileno(item),idfile,mark->wire,m.wirelen))) {
+      if (fseek(item,mark->offset,SEEK_SET)) ohshite("Failed to seek in item %s",id);
+      snapcopy(&snap,item,id);
+    }
+  } else {
+    mem= snapstream(&snap,idfile);
+    copyafter(item,id,seq,mem);
+    if (fclose(mem)) ohshite("Failed to make snapshot of %s",idfile);
+  }
+  ufclose(item,idfile);
+  sendsnapshot(&snap,idfile);
+}
+
+static void cmd_diff(char *cmd) {
+  struct snapshot snap;
+  FILE *file, *diff;
+  char *id;
+  char filename[ITEM_MAXFILENAMELEN+5];
+  char filename2[ITEM_MAXFILENAMELEN+sizeof(EDITED_FILENAMESFX)+5];
+
+  if (*cmd) {
+    if (!(id=getitemid(cmd))) return;
+    id2file(id,filename);
+  } else {
+    strcpy(filename,INDEX_FILENAME);
+    id= 0;
+  }
+  strcpy(filename2,filename);
+  strcat(filename2,EDITED_FILENAMESFX);
+  
+  file= fopen(filename,"r");
+  if (file) {
+    makelock(file,F_RDLCK,filename);
+  } else if (errno!=ENOENT) {
+    ohshite("Item/index file %s inaccessible",filename);
+  }
+
+  diff= fopen(filename2,"r");
+  if (!diff) {
+    if (errno!=ENOENT) ohshite("Diff file %s inaccessible",filename2);
+    fputs("410 There are no relevant diffs.\r\n",stdout);
+    if (file) ufclose(file,filename);
+  } else {
+    snapinit(&snap);
+    snapcopy(&snap,diff,filename2);
+    fclose(diff);
+    if (file) ufclose(file,filename);
+    sendsnapshot(&snap,filename2);
+  }
+}
+
+static int itemstatus(const char *id, FILE *out) {
+  /* Writes STAT's 211 line for id to out; returns 0 if there's no
+   * such item. */
+  FILE *item;
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  char statusbuf[ITEMID_LEN*2+21+5];
+  char *subjstart;
+  const char *emsg;
+  struct itemmeta m;
+  long packed;
+
+  if (metaget(id,&m)) { fprintf(out,"211 %s %s\r\n",m.status,m.subject); return 1; }
+  id2file(id,idfile);
+  item= itemopen(id,idfile,&packed);
+  if (!item) return 0;
+  if (!fgets(statusbuf,ITEMID_LEN*2+21,item)) {
+    if (ferror(item)) ohshite("Item %s status unreadable",id);
+    ufclose(item,idfile); return 0;
+  }
+  if (strlen(statusbuf) != ITEMID_LEN*2+20 ||
+      statusbuf[ITEMID_LEN*2+19] != '\n')
+    ohshit("Item %s has corrupted status line",id);
+  statusbuf[ITEMID_LEN*2+19]= 0;
+  subjstart= getitemsubject(item,&emsg);
+  if (!subjstart) ohshit("Item %s %s",id,emsg);
+  ufclose(item,idfile);
+  fprintf(out,"211 %s %s\r\n",statusbuf,subjstart);
+  return 1;
+}
+
+struct statid {
+  char id[ITEMID_LEN+1];      /* first, for statidcmp */
+  long pos;
+};
+
+static int statidcmp(const void *a, const void *b) {
+  const struct statid *sa= a, *sb= b;
+  int r;
+
+  r= strcmp(sa->id,sb->id);
+  return r ? r : sa->pos < sb->pos ? -1 : sa->pos > sb->pos;
+}
+
+static int statposcmp(const void *a, const void *b) {
+  const struct statid *sa= a, *sb= b;
+
+  return sa->pos < sb->pos ? -1 : sa->pos > sb->pos;
+}
+
+static struct statid *statactive(long seq, long *nr) {
+  /* Returns the items with index entries numbered seq or later, each
+   * once, in the order they first appear; *nr says how many. */
+  FILE *index;
+  struct indexview v;
+  struct statid *ids;
+  const char *rec;
+  long i, n, m;
+
+  index= fopen(INDEX_FILENAME,"r"); if (!index) ohshite("Index inaccessible");
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  if (ixopen(&v,fileno(index))) {
+    if (errno == EINVAL) ohshit("Index corrupt - invalid length or manifest");
+    ohshite("Index segments unreadable");
+  }
+  i= ixsearch(&v,1,seq);
+  ids= malloc((v.records-i+1)*sizeof(*ids));
+  if (!ids) ohshite("No memory for item list");
+  for (n=0; i<v.records; i++) {
+    rec= ixrecord(&v,i);
+    if (!rec) ohshite("Index unmappable");
+    if (!isalpha(rec[18])) continue; /* not about an item */
+    memcpy(ids[n].id,rec+18,ITEMID_LEN); ids[n].id[ITEMID_LEN]= 0;
+    ids[n].pos= n; n++;
+  }
+  ixclose(&v);
+  ufclose(index,INDEX_FILENAME);
+  qsort(ids,n,sizeof(*ids),statidcmp);
+  for (i=0, m=0; i<n; i++)
+    if (!m || strcmp(ids[i].id,ids[m-1].id)) ids[m++]= ids[i];
+  qsort(ids,m,sizeof(*ids),statposcmp);
+  *nr= m;
+  return ids;
+}
+
+static void statmany(char *cmd) {
+  /* STAT id id ... or STAT #seq: a 211 line for each item (or a 410
+   * line if there isn't one), or for each item with index entries
+   * numbered seq or later, all in one response.  The items' files are
+   * only read for items missing from the summaries. */
+  struct snapshot snap;
+  struct statid *ids;
+  long seq, i, n;
+  char *id, *estr, *p;
+  FILE *mem;
+
+  if (*cmd == '#') {
+    cmd++;
+    seq= strtol(cmd,&estr,16);
+    if (estr == cmd || *estr || seq < 0) {
+      protocolviolation("511 STAT # must be followed by a sequence number."); return;
+    }
+    ids= statactive(seq,&n);
+  } else {
+    ids= malloc((strlen(cmd)/(ITEMID_LEN+1)+1)*sizeof(*ids));
+    if (!ids) ohshite("No memory for item list");
+    for (n=0; *cmd; n++) {
+      p= strchr(cmd,' ');
+      if (p) *p++= 0; else p= cmd+strlen(cmd);
+      if (!(id=getitemid(cmd))) { free(ids); return; }
+      strcpy(ids[n].id,id);
+      cmd= p; skipspace(&cmd);
+    }
+  }
+  sess->maycontinue= 0; /* Cancel any pending CONT possibility */
+  snapinit(&snap);
+  mem= snapstream(&snap,"item status");
+  for (i=0; i<n; i++)
+    if (!itemstatus(ids[i].id,mem))
+      fprintf(mem,"410 Item %s does not exist or has been archived.\r\n",ids[i].id);
+  if (fclose(mem)) ohshite("Failed to make snapshot of item status");
+  free(ids);
+  sendsnapshot(&snap,"item status");
+}
+
+static void cmd_stat(char *cmd) {
+  char *id;
+
+  if (*cmd == '#' || strchr(cmd,' ')) { statmany(cmd); return; }
+  if (!(id=getitemid(cmd))) return;
+  sess->maycontinue= 0; /* Cancel any pending CONT possibility */
+  if (!itemstatus(id,stdout)) noitem(id);
+}
+
+/*
+ * Editing
+ */
+
+static void cmd_edlk(char *cmd) {
+  struct flock fl;
+  char uidbuf[USERID_MAXLEN+1];
+  struct session *s;
+  
+  if (!noargs(cmd)) return;
+  if (sess->edit) { protocolviolation("500 EDLK already issued."); return; }
+
+  /* fcntl locks don't exclude other sessions in this same process
+   * (and closing the file would lose theirs), so check those first. */
+  for (s= sessions; s; s= s->next) {
+    if (s == sess || !s->edit) continue;
+    printf("411 %s has locked the message area for editing\r\n",s->userid);
+    return;
+  }
+  
+  sess->edit= fopen(EDITLOCK_FILENAME,"r+");
+  if (!sess->edit) ohshite("Edit lockfile `" EDITLOCK_FILENAME "' inaccessible");
+  
+  fl.l_type= F_WRLCK;
+  fl.l_whence= SEEK_SET;
+  fl.l_start= 0;
+  fl.l_len= USERID_MAXLEN;
+  if (fcntl(fileno(sess->edit),F_SETLK,&fl) == -1) {
+    if (errno == EACCES || errno == EAGAIN) {
+      errno=0; if (fread(uidbuf,1,USERID_MAXLEN,sess->edit) != USERID_MAXLEN)
+        ohshite("Failed to read userid of locking editor from "
+                EDITLOCK_FILENAME);
+      fclose(sess->edit); sess->edit=0; uidbuf[USERID_MAXLEN]=0;
+      printf("411 %s has locked the message area for editing\r\n",uidbuf);
+      return;
+    }
+    ohshite("Failed to lock " EDITLOCK_FILENAME);
+  }
+  errno=0; if (fwrite(sess->userid,1,USERID_MAXLEN,sess->edit) != USERID_MAXLEN)
+    ohshite("Failed to write own userid to " EDITLOCK_FILENAME);
+  if (fflush(sess->edit)) ohshite("Failed to flush userid into edit flag file");
+  fputs("200 Message area is now locked for editing.\r\n",stdout);
+}
+
+static void cmd_edul(char *cmd) {
+  if (!noargs(cmd) || !noeditinprogress()) return;
+  if (!sess->edit) { protocolviolation("532 No lock held so can't unlock it."); return; }
+  
+  rewind(sess->edit);
+  errno=0; if (fwrite("??",1,3,sess->edit)!=3)
+    ohshite("Failed to erase own userid from " EDITLOCK_FILENAME);
+  if (fclose(sess->edit))
+    ohshite("Failed to close " EDITLOCK_FILENAME " after erasing my userid");
+  sess->edit=0;
+  fputs("200 Lock on edit area relinquished.\r\n",stdout);
+}
+
+static void startedit(char *id) {
+  struct snapshot snap;
+  struct indexview v;
+  FILE *file;
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  const char *filename;
+  struct stat istab;
+  long packed;
+
+  if (!noeditinprogress()) return;
+  if (!sess->edit) { protocolviolation("532 EDLK required before EDIT/EDIX."); return; }
+  sess->maycontinue= 0; /* Cancel any pending CONT possibility */
+
+  if (id) {
+    id2file(id,idfile); filename= idfile;
+    file= itemopen(id,idfile,&packed);
+    if (!file) { noitem(id); return; }
+  } else {
+    filename= INDEX_FILENAME;
+    file= fopen(filename,"r");
+    if (!file) ohshite("%s inaccessible",filename);
+    makelock(file,F_RDLCK,filename);
+    packed= -1;
+  }
+  if (packed >= 0) istab.st_size= packed;
+  else if (fstat(fileno(file),&istab))
+    ohshite("%s unstattable before edit",filename);
+  snapinit(&snap);
+  if (id) {
+    sess->lenbeforeedit= istab.st_size;
+    if (packed >= 0 || !snapwire(&snap,fileno(file),filename,0,-1))
+      snapcopy(&snap,file,filename);
+  } else {
+    if (ixopen(&v,fileno(file))) ohshite("Index segments unreadable");
+    sess->lenbeforeedit= v.records*INDEXENTRY_LENINF;
+    snapindex(&snap,&v,file,0,v.records);
+    ixclose(&v);
+  }
+  ufclose(file,filename);
+  sendsnapshot(&snap,filename);
+
+  log(ll_trace,"Editing %s",filename);
+
+  if (sess->data) { fclose(sess->data); sess->data=0; }
+  if (id) { strcpy(sess->saveditemid,id); } else { sess->saveditemid[0]= 0; }
+}
+
+static void cmd_edit(char *cmd) {
+  char *id;
+
+  if (!(id=getitemid(cmd))) return;
+  startedit(id);
+}
+
+static void cmd_edix(char *cmd) {
+  if (!noargs(cmd)) return;
+  startedit(0);
+}
+
+static void cmd_edab(char *cmd) {
+  if (!noargs(cmd) || !editing()) return;
+  if (sess->data) { fclose(sess->data); sess->data=0; }
+  sess->lenbeforeedit= -1;
+  fputs("200 Edit operation aborted.\r\n",stdout);
+}
+
+static void diffshift(FILE *from, FILE *to, long lineoffset) {
+  /* Copies diff --unified output from from to to, adding lineoffset to
+   * the line numbers in the hunk headers. */
+  char buf[INPUTLINE_MAXLEN+5], *p;
+  long a, b, c, d;
+  int atstart, l, nb, nd;
+
+  atstart= 1;
+  while (fgets(buf,sizeof(buf),from)) {
+    l= strlen(buf);
+    p= buf;
+    if (atstart && !strncmp(buf,"@@ -",4)) {
+      a= strtol(buf+4,&p,10); nb= *p == ','; b= nb ? strtol(p+1,&p,10) : 0;
+      if (strncmp(p," +",2)) goto x_copy;
+      c= strtol(p+2,&p,10); nd= *p == ','; d= nd ? strtol(p+1,&p,10) : 0;
+      if (strncmp(p," @@",3)) goto x_copy;
+      fprintf(to,"@@ -%ld",a+lineoffset); if (nb) fprintf(to,",%ld",b);
+      fprintf(to," +%ld",c+lineoffset); if (nd) fprintf(to,",%ld",d);
+    } else {
+    x_copy:
+      p= buf;
+    }
+    fputs(p,to);
+    atstart= l && buf[l-1] == '\n';
+  }
+  if (ferror(from) || ferror(to)) ohshite("Failed to copy diff");
+}
+
+static void run_diff(const char *itemid_or_index,
+                     const char *edited_or_withdrawn,
+                     unsigned long sequence,
+                     time_t currenttime,
+                     const char *datestring,
+                     const char *filename1_also_destbasename,
+                     const char *newbuf,
+                     long newlen,
+                     FILE *oldpart,
+                     long lineoffset) {
+  /* If oldpart isn't 0 it's what we diff against, rather than the
+   * file, and it starts lineoffset lines into the file. */
+  char label1[ITEMID_LEN+50], label2[ITEMID_LEN+DATESTRING_MAXLEN+50];
+  char destname[ITEM_MAXFILENAMELEN + sizeof(EDITED_FILENAMESFX) + 50];
+  FILE *f1, *dest, *diff, *out;
+  int fdi[2];
+  int child, status;
+
+  sprintf(label1, "--label=%s Before %08lX %08lX",
+          itemid_or_index, sequence, currenttime);
+  sprintf(label2, "--label=%s %s at %s",
+          itemid_or_index, edited_or_withdrawn, datestring);
+  strcpy(destname,filename1_also_destbasename);
+  strcat(destname,EDITED_FILENAMESFX);
+  
+  f1= 0;
+  if (!oldpart) {
+    f1= fopen(filename1_also_destbasename,"r");
+    if (!f1) ohshite("Failed to reopen %s for diff",filename1_also_destbasename);
+  }
+  dest= fopen(destname,"a");
+  if (!dest) ohshite("Failed to append to %s for diff",destname);
+  out= dest;
+  if (lineoffset) {
+    out= tmpfile();
+    if (!out) ohshite("Failed to make temporary file for diff of %s",itemid_or_index);
+  }
+
+  if (newlen) {
+    if (pipe(fdi)) ohshite("Failed to create pipe for diff of %s",itemid_or_index);
+  } else {
+    fdi[0]= open("/dev/null",O_RDONLY);
+    if (fdi[0] == -1) ohshite("Failed to open /dev/null for diff of %s",itemid_or_index);
+  }
+    
+  if ((child= fork()) == -1) ohshite("Fork for diff of %s",itemid_or_index);
+  if (!child) {
+    if (dup2(fdi[0],0)) { perror("dup2 for diff stdin failed"); _exit(3); }
+    if (dup2(fileno(out),1) != 1) { perror("dup2 for diff stdout failed"); _exit(3); }
+    if (oldpart && dup2(fileno(oldpart),3) != 3) { perror("dup2 for diff old failed"); _exit(3); }
+    close(fdi[0]); if (newlen) close(fdi[1]);
+    execlp(GNUDIFF_PROGRAM,
+           "diff","--text","--unified",label1,label2,
+           oldpart ? "/dev/fd/3" : filename1_also_destbasename,"-",(char*)0);
+    perror("exec " GNUDIFF_PROGRAM " failed"); _exit(3);
+  }
+  close(fdi[0]);
+  if (out == dest) fclose(dest);
+  if (f1) fclose(f1);
+  
+  if (newlen) {
+    diff= fdopen(fdi[1],"w");
+    if (!diff) ohshite("Failed to fdopen diff pipe");
+    if (fwrite(newbuf,1,newlen,diff)!=newlen)
+      ohshite("Failed to write to pipe to diff of %s",itemid_or_index);
+    if (fclose(diff))
+      ohshite("Failed to close pipe to diff of %s",itemid_or_index);
+    close(fdi[1]);
+  }
+  if (waitpid(child,&status,0) != child)
+    ohshite("Failed to wait for diff of %s",itemid_or_index);
+  if (!WIFEXITED(status))
+    ohshit("diff of %s gave error wait code %d",itemid_or_index,status);
+  status= WEXITSTATUS(status);
+  if (status!=0 && status!=1)
+    ohshit("diff of %s gave error exit status %d",itemid_or_index,status);
+  if (out != dest) {
+    if (fseek(out,0,SEEK_SET)) ohshite("Rewind diff of %s",itemid_or_index);
+    diffshift(out,dest,lineoffset);
+    fclose(out);
+    if (fclose(dest)) ohshite("Failed to append to %s for diff",destname);
+  }
+}
+
+static void edcf_item(char *itemid, const char *reason) {
+  /* editing, rather than withdrawing */
+  FILE *index, *elog, *item;
+  struct wirekey elogkey;
+  const char *datestring;
+  const char *emsg;
+  unsigned long sequence;
+  time_t currenttime;
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  char *subject;
+  struct stat istab;
+  long newlen;
+  char *newbuf;
+
+  index= fopen(INDEX_FILENAME,"a+");
+  if (!index) ohshite("Index inaccessible for item edit entry");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  sequence= getsequence();
+  currenttime= gettime();
+  id2file(itemid,idfile);
+  datestring= makedatestring(currenttime);
+
+  itemunpack(itemid,idfile);
+  item= fopen(idfile,"r+");
+  if (!item) {
+    if (errno!=ENOENT || !sess->saveditemid[0])
+      ohshite("Failed to open %s for edit",idfile);
+    noitem(itemid); fclose(sess->data); sess->data=0; sess->lenbeforeedit=-1; ufclose(index,INDEX_FILENAME); return;
+  }
+  subject= getitemsubject(sess->data,&emsg);
+  if (!subject) {
+    fputs("423 Subject line missing from edited version.\r\n",stdout);
+    fclose(item); ufclose(index,INDEX_FILENAME); fclose(sess->data); sess->data=0; return;
+  }
+  if (fseek(sess->data,0,SEEK_SET)) ohshite("Rewind data during %s EDCF",itemid);
+  
+  elog= fopen(EDITLOG_FILENAME,"a+");
+  if (!elog) ohshite("Failed to open " EDITLOG_FILENAME " re item %s",itemid);
+  getwirekey(fileno(elog),&elogkey);
+
+  if (fprintf(elog, "Item %s edited by %s at %s (#%08lX):\n%s\n\n",
+              sess->saveditemid,sess->userid,datestring,sequence,reason)
+      ==EOF) ohshite("Failed to write to " EDITLOG_FILENAME);
+  editlogdone(elog,&elogkey);
+  
+  makelock(item,F_WRLCK,idfile);
+  if (fstat(fileno(item),&istab)) ohshite("Failed to stat %s for EDCF",idfile);
+  if (sess->lenbeforeedit > istab.st_size)
+    ohshit("Item %s has shrunk since EDIT",itemid);
+
+  newlen= istab.st_size - sess->lenbeforeedit + sess->dstab.st_size+ITEMID_LEN*2+20;
+  newbuf= malloc(newlen);
+  if (!newbuf) ohshite("No memory to contruct edited version");
+  errno=0; if (fread(newbuf,1,ITEMID_LEN*2+20,item) != ITEMID_LEN*2+20)
+    ohshite("Failed to read status line of %s for EDCF",sess->saveditemid);
+  if (newbuf[ITEMID_LEN]!=' ' || newbuf[ITEMID_LEN*2+19]!='\n')
+    ohshit("Status line of %s corrupt before EDCF",sess->saveditemid);
+  sprintf(newbuf+ITEMID_LEN*2+2,"%08lX",sequence);
+  newbuf[ITEMID_LEN*2+10]= ' '; /* undo the null from sprintf */
+  errno=0;
+  if (fread(newbuf+ITEMID_LEN*2+20,1,sess->dstab.st_size,sess->data) != sess->dstab.st_size)
+    ohshite("Failed to block read data during EDCF of %s",itemid);
+
+  if (sess->lenbeforeedit < istab.st_size) {
+    if (fseek(item,sess->lenbeforeedit,SEEK_SET))
+      ohshite("Seek to new data during EDCF of item %s",item);
+    errno= 0;
+    if (fread(newbuf + sess->dstab.st_size+ITEMID_LEN*2+20, 1, istab.st_size -
+              sess->lenbeforeedit, item) != istab.st_size - sess->lenbeforeedit)
+      ohshite("Read new data during EDCF of item %s",itemid);
+  }
+
+  run_diff(itemid,"Edited",sequence,currenttime,datestring,
+           idfile,newbuf,newlen,0,0);
+
+  metabegin(itemid);
+  if (fseek(item,0,SEEK_SET)) ohshite("Rewind %s for write edited",itemid);
+  if (fwrite(newbuf,1,newlen,item)!=newlen)
+    ohshite("AARGH! Failed to write edited version of %s",itemid);
+  if (ftruncate(fileno(item),newlen))
+    ohshite("AARGH! Failed to trunctate %s to correct length after edit",
+            itemid);
+  if (fflush(item)) ohshite("AARGH! Failed to write edited version of %s",itemid);
+  metaput(itemid,newbuf,newlen);
+  metaend();
+  wirerender(fileno(item),idfile);
+  if (ufclose(item,idfile)) ohshite("AARGH! Failed to close %s after edit",itemid);
+  indexentry(index, sequence, currenttime, itemid, 'E', subject);
+  if (ufclose(index,INDEX_FILENAME))
+    ohshite("AARGH! Failed to close index after edit of %s",itemid);
+  fclose(sess->data); sess->data=0; sess->lenbeforeedit=-1; free(newbuf);
+  printf("220 %08lX  Edit complete.\r\n",sequence);
+}
+  
+static void edcf_index(const char *reason) {
+  /* editing the index */
+  FILE *index, *elog, *oldpart;
+  struct wirekey elogkey;
+  struct indexview v;
+  const char *datestring, *rec;
+  time_t currenttime;
+  unsigned long sequence;
+  long newlen, oldn, newn, lo, hi, ctxa, ctxb, a, b;
+  int sa, sb;
+  char *newbuf;
+  
+  index= fopen(INDEX_FILENAME,"r+");
+  if (!index) ohshite("Failed to open index for EDCF of index edit");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  sequence= getsequence();
+  currenttime= gettime();
+  datestring= makedatestring(currenttime);
+
+  elog= fopen(EDITLOG_FILENAME,"a+");
+  if (!elog) ohshite("Failed to open " EDITLOG_FILENAME " re index edit");
+  getwirekey(fileno(elog),&elogkey);
+  if (fprintf(elog, "Index edited by %s at %s (#%08lX):\n%s\n\n",
+              sess->userid,datestring,sequence,reason) ==EOF)
+    ohshite("Failed to write to " EDITLOG_FILENAME);
+  editlogdone(elog,&elogkey);
+    
+  if (ixopen(&v,fileno(index))) ohshite("Failed to read index segments for EDCF");
+  oldn= v.records;
+  if (sess->lenbeforeedit > oldn*INDEXENTRY_LENINF) ohshit("Index has shrunk since EDIX");
+  if (sess->dstab.st_size % INDEXENTRY_LENINF) ohshit("Edited index has ragged entries");
+
+  newlen= oldn*INDEXENTRY_LENINF - sess->lenbeforeedit + sess->dstab.st_size;
+  newn= newlen / INDEXENTRY_LENINF;
+  newbuf= malloc(newlen+1);
+  if (!newbuf) ohshite("No memory to contruct edited version");
+  errno=0; if (fread(newbuf, 1, sess->dstab.st_size, sess->data) != sess->dstab.st_size)
+    ohshite("Failed to block read data during EDCF of index");
+  if (ixread(&v, sess->lenbeforeedit/INDEXENTRY_LENINF,
+             oldn - sess->lenbeforeedit/INDEXENTRY_LENINF,
+             newbuf + sess->dstab.st_size))
+    ohshite("Read new data during EDCF of index");
+
+  /* Only the segments between the first and last changed entries
+   * are rewritten, and diff only sees those entries and their context. */
+  for (lo=0; lo<oldn && lo<newn; lo++) {
+    rec= ixrecord(&v,lo); if (!rec) ohshite("Index unmappable");
+    if (memcmp(rec,newbuf+lo*INDEXENTRY_LENINF,INDEXENTRY_LENINF)) break;
+  }
+  for (hi=0; hi<oldn-lo && hi<newn-lo; hi++) {
+    rec= ixrecord(&v,oldn-hi-1); if (!rec) ohshite("Index unmappable");
+    if (memcmp(rec,newbuf+(newn-hi-1)*INDEXENTRY_LENINF,INDEXENTRY_LENINF)) break;
+  }
+  ctxa= lo < INDEXDIFF_CONTEXT ? lo : INDEXDIFF_CONTEXT;
+  ctxb= hi < INDEXDIFF_CONTEXT ? hi : INDEXDIFF_CONTEXT;
+  oldpart= tmpfile();
+  if (!oldpart) ohshite("Failed to make temporary file for diff of index");
+  ixcopy(&v,lo-ctxa,oldn-hi+ctxb-(lo-ctxa),oldpart);
+  if (fflush(oldpart) || fseek(oldpart,0,SEEK_SET))
+    ohshite("Failed to write temporary file for diff of index");
+  run_diff("index","Edited",sequence,currenttime,datestring,
+           INDEX_FILENAME,newbuf+(lo-ctxa)*INDEXENTRY_LENINF,
+           (newn-hi+ctxb-(lo-ctxa))*INDEXENTRY_LENINF,oldpart,lo-ctxa);
+  fclose(oldpart);
+
+  sa= ixseg(&v,lo);
+  sb= oldn-hi > lo ? ixseg(&v,oldn-hi-1) : sa;
+  a= v.segs[sa].start;
+  b= v.segs[sb].start + v.segs[sb].records;
+  ixrewrite(&v,sa,sb,newbuf+a*INDEXENTRY_LENINF,b-a+newn-oldn,index);
+  ixclose(&v);
+  mirrorload(fileno(index));
+  xrefrebuild(fileno(index));
+  if (ufclose(index,INDEX_FILENAME)) ohshite("AARGH! Failed to close index after edit");
+  fclose(sess->data); sess->data=0; sess->lenbeforeedit=-1; free(newbuf);
+  printf("220 %08lX  Edit complete.\r\n",sequence);
+}
+
+static void edcf_withdraw(char *itemid, const char *reason) {
+  char idfile[ITEM_MAXFILENAMELEN+5];
+  unsigned long sequence;
+  time_t currenttime;
+  char *newbuf, *datestring;
+  char wire[WIRE_MAXFILENAMELEN+5];
+  FILE *index, *elog, *oldpart;
+  struct wirekey elogkey, indexkey;
+  struct indexview v;
+  const struct segment *seg;
+  const char *rec;
+  long nents, *ents, oldn, from, to, i, j, k, kstart, m;
+  int postings, s;
+  
+  index= fopen(INDEX_FILENAME,"r+");
+  if (!index) ohshite("Failed to open index to withdraw item %s",itemid);
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  sequence= getsequence();
+  currenttime= gettime();
+  id2file(itemid,idfile);
+  itemunpack(itemid,idfile);
+  datestring= makedatestring(currenttime);
+
+  elog= fopen(EDITLOG_FILENAME,"a+");
+  if (!elog) ohshite("Failed to open " EDITLOG_FILENAME " re withdrawal");
+  getwirekey(fileno(elog),&elogkey);
+  if (fprintf(elog, "Item %s withdrawn by %s at %s (#%08lX):\n%s\n\n",
+              itemid,sess->userid,datestring,sequence,reason) ==EOF)
+    ohshite("Failed to write to " EDITLOG_FILENAME);
+  editlogdone(elog,&elogkey);
+    
+  if (ixopen(&v,fileno(index))) {
+    if (errno == EINVAL) ohshit("Index found corrupted before withdrawal");
+    ohshite("Failed to read index segments for withdrawal");
+  }
+  oldn= v.records;
+  if (getwirekey(fileno(index),&indexkey)) ohshite("Failed to stat index for withdrawal");
+  postings= xrefcurrent(&indexkey);
+  nents= xreffind('i',sess->saveditemid,&v,postings,&ents);
+
+  if (nents) {
+    from= ents[0] < INDEXDIFF_CONTEXT ? 0 : ents[0]-INDEXDIFF_CONTEXT;
+    to= oldn-ents[nents-1]-1 < INDEXDIFF_CONTEXT ? oldn : ents[nents-1]+1+INDEXDIFF_CONTEXT;
+    newbuf= malloc((to-from)*INDEXENTRY_LENINF+1);
+    if (!newbuf)
+      ohshite("No memory to construct changed index for withdrawal");
+    for (i=from, j=0, k=0; i<to; i++) {
+      if (k<nents && ents[k] == i) { k++; continue; }
+      rec= ixrecord(&v,i); if (!rec) ohshite("Index unmappable");
+      memcpy(newbuf+j*INDEXENTRY_LENINF,rec,INDEXENTRY_LENINF);
+      j++;
+    }
+    oldpart= tmpfile();
+    if (!oldpart) ohshite("Failed to make temporary file for diff of index");
+    ixcopy(&v,from,to-from,oldpart);
+    if (fflush(oldpart) || fseek(oldpart,0,SEEK_SET))
+      ohshite("Failed to write temporary file for diff of index");
+    run_diff(itemid,"Withdrawn",sequence,currenttime,datestring,
+             INDEX_FILENAME,newbuf,j*INDEXENTRY_LENINF,oldpart,from);
+    fclose(oldpart);
+    free(newbuf);
+
+    /* rewrite each segment the item was in, last first so that the
+     * entry numbers of the ones before still hold */
+    for (k=nents; k>0; k=kstart) {
+      s= ixseg(&v,ents[k-1]);
+      seg= &v.segs[s];
+      for (kstart=k; kstart>0 && ents[kstart-1] >= seg->start; kstart--);
+      newbuf= malloc(seg->records*INDEXENTRY_LENINF+1);
+      if (!newbuf)
+        ohshite("No memory to construct changed index for withdrawal");
+      for (i=seg->start, j=0, m=kstart; i<seg->start+seg->records; i++) {
+        if (m<k && ents[m] == i) { m++; continue; }
+        rec= ixrecord(&v,i); if (!rec) ohshite("Index unmappable");
+        memcpy(newbuf+j*INDEXENTRY_LENINF,rec,INDEXENTRY_LENINF);
+        j++;
+      }
+      ixrewrite(&v,s,s,newbuf,j,index);
+      free(newbuf);
+    }
+  }
+  run_diff(itemid,"Withdrawn",sequence,currenttime,datestring,
+           idfile, 0,0, 0,0);
+  free(ents);
+  ixclose(&v);
+  mirrorload(fileno(index));
+  /* the postings still hold, as they're by sequence number; the item's
+   * own just name entries that have gone */
+  if (postings) xrefstamp(fileno(index));
+  metabegin(itemid);
+  packforget(itemid);
+  if (unlink(idfile)) ohshite("Failed to remove withdrawn item %s",idfile);
+  metaforget(itemid);
+  metaend();
+  if (ufclose(index,INDEX_FILENAME))
+    ohshite("AARGH! Failed to close index after withdrawal of %s",sess->saveditemid);
+
+  wirefilename(wire,idfile);
+  if (unlink(wire) && errno != ENOENT)
+    loge(ll_error,"Failed to remove wire format of withdrawn item");
+  deflatedfilename(wire,idfile);
+  if (unlink(wire) && errno != ENOENT)
+    loge(ll_error,"Failed to remove deflated wire format of withdrawn item");
+  sess->lenbeforeedit=-1;
+  printf("220 %08lX  Item withdrawn.\r\n",sequence);
+}
+
+static void cmd_edcf(char *cmd) {
+  if (!*cmd) {
+    protocolviolation("511 A reason must be given for the edit."); return;
+  }
+  if (!editing()) return;
+  if (sess->saveditemid[0]) {
+    if (sess->data)
+      edcf_item(sess->saveditemid,cmd);
+    else
+      edcf_withdraw(sess->saveditemid,cmd);
+  } else {
+    if (!sess->data) { protocolviolation("500 Cannot withdraw the index."); return; }
+    edcf_index(cmd);
+  }
+}
+
+/*
+ * Management
+ */
+
+static void cmd_udbm(char *cmd) {
+  const char *args[UDBM_MAXARGS+1];
+  int nargs=0;
+  int fdi[2];
+  int child;
+  int status, c;
+  char *tosend=0, *p;
+
+  log(ll_trace,"UDBM `%s'",cmd);
+  args[nargs++]= "UDBM";
+  args[nargs++]= "--file";
+  args[nargs++]= USERDB_FILENAME;
+  args[nargs++]= "--restrict";
+  args[nargs++]= "--noprompt";
+  for (;;) {
+    skipspace(&cmd);
+    if (!*cmd) break;
+    if (*cmd == '<') { *cmd++=0; tosend= cmd; break; }
+    if (nargs == UDBM_MAXARGS) {
+      fputs("250 Too many arguments to UDBM.\r\n"
+            "Too many arguments to UDBM.\r\n.\r\n", stdout); return;
+    }
+    if (*cmd == '"') {
+      p= ++cmd;
+      args[nargs++]= cmd;
+      while ((c= *cmd) && c != '"') {
+        if (c == '\\' && cmd[1]) c= *++cmd;
+        *p++= c; cmd++;
+      }
+      *p= 0;
+    } else {
+      args[nargs++]= cmd;
+      while ((c= *cmd) && !isspace(c)) cmd++;
+      *cmd= 0;
+    }
+    if (c) cmd++;
+  }
+  args[nargs]= 0;
+  if (pipe(fdi)) ohshite("Create pipe for stdin for UDBM");
+  fflush(stdout);
+  if ((child= fork()) == -1) ohshite("Fork for UDBM");
+  if (!child) {
+    fputs("250 Response follows.\r\n",stdout); fflush(stdout);
+    close(0); dup(fdi[0]); close(2); dup(1); close(fdi[0]); close(fdi[1]);
+    execvp(UDBM_PROGRAM, (char**)args);
+    perror("exec " UDBM_PROGRAM " failed"); _exit(1);
+  }
+  if (tosend) {
+    int l;
+    l= strlen(tosend); tosend[l++]= '\n';
+    write(fdi[1],tosend,l);
+  }
+  close(fdi[0]); close(fdi[1]);
+  if (waitpid(child,&status,0) != child) ohshite("Failed to wait for udbm subprocess");
+  if (WIFSIGNALED(status)) {
+    printf("(udbm subprocess died due to receiving signal %d!%s)\r\n",
+           WTERMSIG(status), WCOREDUMP(status) ? "  Core dumped!" : "");
+  } else if (!WIFEXITED(status)) {
+    printf("(udbm subprocess failed, `wait' code %d)\r\n",status);
+  } else if (WEXITSTATUS(status)) {
+    printf("(udbm subprocess exited with status %d)\r\n",WEXITSTATUS(status));
+  }    
+  fputs(".\r\n",stdout);
+  return;
+}
+
+static void sendparent(char *cmd, int sig) {
+  pid_t pid;
+  if (!noargs(cmd)) return;
+  log(ll_alert,"KILL/KILR (signal %d) issued and accepted",sig); tcpident();
+  pid= daemonpid;
+  if (kill(pid,sig))
+    ohshite("Failed to send signal %d to parent process (pid %ld)",
+            sig, (long)pid);
+  fputs("200 KILL/KILR command obeyed.\r\n",stdout);
+}
+
+void cmd_kill(char *cmd) { sendparent(cmd,SIGTERM); }
+void cmd_kilr(char *cmd) { sendparent(cmd,SIGUSR2); }
+
+static void cmd_mots(char *cmd) {
+  FILE *motd, *index;
+  unsigned long sequence;
+  time_t currenttime;
+  static char nullsubject[]="";
+
+  if (!noargs(cmd) || !datadone()) return;
+
+  index= fopen(INDEX_FILENAME,"a+");
+  makelock(index,F_WRLCK,INDEX_FILENAME);
+  currenttime= gettime();
+  sequence= getsequence();
+  
+  motd= fopen(MOTD_FILENAME,"a+");
+  makelock(motd,F_WRLCK,MOTD_FILENAME);
+
+  rewind(motd);
   if (ftruncate(fileno(motd),0))
     ohshite("AARGH! Failed to trunctate motd before replace");
 
-  if (fprintf(motd, "%08lX %08lX\n", currenttime, sequence) ==EOF)
-    ohshite("Failed to write to " EDITLOG_FILENAME);
-  copycontrib(motd,"motd");
-  unlock(motd,MOTD_FILENAME);
+  if (fprintf(motd, "%08lX %08lX\n", currenttime, sequence) ==EOF)
+    ohshite("Failed to write to " EDITLOG_FILENAME);
+  copycontrib(motd,"motd");
+  unlock(motd,MOTD_FILENAME);
+  wirerenderfile(MOTD_FILENAME);
+
+  indexentry(index,sequence,currenttime, "        ", 'M', nullsubject);
+  if (ufclose(index,INDEX_FILENAME)) ohshite("AARGH! Failed to close index after motd update");
+  printf("220 %08lX  Message of the Day updated.\r\n",sequence);
+}
+
+void cmd_noop(char *cmd) {
+  if (!noargs(cmd)) return;
+  fputs("200 NOOP command received.\r\n",stdout);
+}
+
+/*
+ * Command table and main program
+ */
+
+const struct commandinfo commandinfos[]= {
+  { "AUTH", cmd_auth, al_none  },
+  { "ALVL", cmd_alvl, al_none  },
+  { "COMP", cmd_comp, al_none  },
+  { "DBUG", cmd_dbug, al_none  },
+  { "HELP", cmd_help, al_none  },
+  { "MOTD", cmd_motd, al_none  },
+  { "NOOP", cmd_noop, al_none  },
+  { "QUIT", cmd_quit, al_none  },
+  { "REGU", cmd_regu, al_none  },
+  { "USER", cmd_user, al_none  },
+  
+  { "ELOG", cmd_elog, al_read  },
+  { "INDX", cmd_indx, al_read  },
+  { "ITEM", cmd_item, al_read  },
+  { "STAT", cmd_stat, al_read  },
+  { "WAIT", cmd_wait, al_read  },
+  
+  { "CONT", cmd_cont, al_write },
+  { "DATA", cmd_data, al_write },
+  { "NEWI", cmd_newi, al_write },
+  { "REPL", cmd_repl, al_write },
+  
+  { "DIFF", cmd_diff, al_edit  },
+  { "EDLK", cmd_edlk, al_edit  },
+  { "EDUL", cmd_edul, al_edit  },
+  { "EDIT", cmd_edit, al_edit  },
+  { "EDIX", cmd_edix, al_edit  },
+  { "EDAB", cmd_edab, al_edit  },
+  { "EDCF", cmd_edcf, al_edit  },
+  { "KILL", cmd_kill, al_edit  },
+  { "KILR", cmd_kilr, al_edit  },
+  { "MOTS", cmd_mots, al_edit  },
+  { "UDBM", cmd_udbm, al_edit  },
+
+  { 0 }
+};
+
+static struct session *newsession(int fd) {
+  /* Uses servseq and calleraddr, which describe the connection just
+   * accepted.  Returns 0 if we're out of memory. */
+  struct session *s;
+
+  s= malloc(sizeof(*s));
+  if (!s) return 0;
+  memset(s,0,sizeof(*s));
+  s->fd= fd;
+  s->servseq= servseq;
+  s->calleraddr= calleraddr;
+  sprintf(s->clientid, "%ld %s,%d",
+          s->servseq, inet_ntoa(s->calleraddr.sin_addr),
+          ntohs(s->calleraddr.sin_port));
+  s->lenbeforeedit= -1;
+  s->alevel= al_none;
+  s->lastinput= gettime();
+  s->started= s->lastinput;
+  s->outfd= -1;
+  s->next= sessions; sessions= s;
+  return s;
+}
+
+static int sesstimeout(struct session *s) {
+  return s->indata ? DATA_TIMEOUT :
+         s->edit ? EDITORINACTIVITY_TIMEOUT : INACTIVITY_TIMEOUT;
+}
+
+static int getinputline(struct session *s, char *buf, int *toolong) {
+  /* Takes the next line out of s->inbuf and copies it to buf without
+   * its newline.  Returns 0 if there isn't a whole line there yet.  A
+   * line which won't fit in inbuf is returned truncated, with *toolong
+   * set; the rest of it is thrown away as it arrives.
+   */
+  char *nl;
+  int l, used, wasskipping;
+
+  for (;;) {
+    nl= memchr(s->inbuf,'\n',
+               s->inlen < INPUTLINE_MAXLEN-1 ? s->inlen : INPUTLINE_MAXLEN-1);
+    if (nl) {
+      l= nl - s->inbuf; used= l+1;
+    } else if (s->inlen >= INPUTLINE_MAXLEN-1) {
+      l= used= INPUTLINE_MAXLEN-1;
+    } else {
+      return 0;
+    }
+    wasskipping= s->skipping;
+    s->skipping= !nl;
+    if (!wasskipping) {
+      memcpy(buf,s->inbuf,l); buf[l]= 0;
+      *toolong= !nl;
+    }
+    s->inlen-= used;
+    memmove(s->inbuf,s->inbuf+used,s->inlen);
+    if (!wasskipping) return 1;
+  }
+}
+
+static void processline(char *linebuf, int toolong) {
+  const struct commandinfo *cip;
+  const char *p;
+  char *q;
+  int l;
+
+  if (sess->indata) { dataline(linebuf,toolong); return; }
+  if (toolong) {
+    log(ll_trace,"Line too long (`%.50s...')", linebuf);
+    setsupertrace(); fputs("512 Line far too long.\r\n",stdout);
+    return;
+  }
+  l= strlen(linebuf);
+  while (l>0 && isspace(linebuf[l-1])) l--;
+  if (!l) return;
+  linebuf[l]= 0;
+  sess->commands++;
+  if (sess->supertrace) log(ll_debug,"<<< %s",linebuf);
+  else strcpy(sess->loglinebuf,linebuf);
+  for (cip= commandinfos; cip->command; cip++) {
+    for (p= cip->command, q=linebuf;
+         *p && toupper(*p) == toupper(*q);
+         p++, q++);
+    if (!*p && (!*q || isspace(*q))) break;
+  }
+  if (!cip->command) {
+    setsupertrace(); log(ll_trace,"Unknown command `%.40s[...]'",linebuf);
+    fputs("510 Unknown command.\r\n",stdout);
+  } else if (sess->alevel < cip->alevel) {
+    ensurelogcmdline();
+    log(ll_alert,"530 response to %s.",cip->command); tcpident(); setsupertrace();
+    fputs("530 Permission denied as specified in 230/231/232 response.\r\n",
+          stdout);
+  } else {
+    skipspace(&q);
+    (cip->function)(q);
+  }
+}
+
+static void clientflush(void) {
+  /* The client has no more commands waiting: send them everything
+   * we've said.  We keep the socket corked, so that large responses
+   * go out in full segments; setting TCP_NODELAY pushes out the
+   * remainder. */
+  int one= 1;
+
+  fflush(stdout);
+  setsockopt(1,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+}
+
+static void clientstdio(void) {
+  /* Makes slave our stdin and stdout. */
+  static char stdoutbuf[SESSION_OUTBUF];
+  int flags, one= 1;
+
+  close(0); errno=0;
+  if (dup(slave)) {
+    perror("groggsd: ERROR dup(slave)!=0");
+    write(slave,
+          "484 Server unexpected error: Failed to reassign stdin.\r\n",56);
+    exit(1);
+  }
+  close(1); errno=0;
+  if (dup(slave)!=1) {
+    perror("groggsd: ERROR dup(slave)!=1");
+    write(slave,
+          "484 Server unexpected error: Failed to reassign stdout\r\n",56);
+    exit(1);
+  }
+  setvbuf(stdout,stdoutbuf,_IOFBF,sizeof(stdoutbuf));
+  setsockopt(1,IPPROTO_TCP,TCP_CORK,&one,sizeof(one));
+
+  signal(SIGPIPE,&sigpipehandler);
+  
+  flags= fcntl(0,F_GETFL,0);
+  if (flags == -1) ohshite("Failed fcntl GETFL on client socket");
+  flags &= ~O_NDELAY;
+  if (fcntl(0,F_SETFL,flags)==-1)
+    ohshite("Failed fcntl SETFL on client socket");
+}
+
+static int parkable(void);
+static void waitorpark(void);
+
+static void serve(void) {
+  /* Runs the session in sess, whose client is on stdin/stdout. */
+  char linebuf[INPUTLINE_MAXLEN+5];
+  int l, toolong;
+
+  for (;;) {
+    while (getinputline(sess,linebuf,&toolong)) processline(linebuf,toolong);
+    clientflush();
+    if (parkable()) waitorpark();
+    errno= 0;
+    settimeout(0,sesstimeout(sess));
+    l= read(0,sess->inbuf+sess->inlen,sizeof(sess->inbuf)-sess->inlen);
+    alarm(0); if (alarmclosefd == -1) wastimeout();
+    if (l<0) {
+      if (errno == EINTR) continue;
+      loge(ll_trace,"Read error, closing"); endsession();
+    }
+    if (!l) {
+      log(ll_trace,sess->indata ? "EOF in data, closing" : "End of file, closing");
+      endsession();
+    }
+    sess->inlen+= l;
+    sess->lastinput= gettime();
+  }    
+}
+
+static void server(void) {
+  mypid= getpid();
+  clientstdio();
+  sess= newsession(0);
+  if (!sess) {
+    loge(ll_error,"No memory for session");
+    fputs("484 Server system error: Out of memory\r\n",stdout);
+    exit(1);
+  }
+  setstatus(0,"Experimental GROGGS system RGTP server ready");
+  serve();
+}
 
-  indexentry(index,sequence,currenttime, "        ", 'M', nullsubject);
-  if (ufclose(index,INDEX_FILENAME)) ohshite("AARGH! Failed to close index after motd update");
-  printf("220 %08lX  Message of the Day updated.\r\n",sequence);
+/*
+ * Admission control
+ *
+ * Whoever accepts connections (the forking daemon, or the -multiplex
+ * engine) asks admit() before starting a session, and tells
+ * admitdone() when it has finished.  We can limit the number of
+ * sessions at once (-maxsessions), and from any one address
+ * (-maxperip), and the rate of new connections overall (-rate) and
+ * from any one address (-iprate), each rate being a token bucket.
+ * Rejected clients just get a 484 greeting; we log how many there
+ * were every ADMIT_LOGINTERVAL.  A restart hands the buckets and the
+ * forked sessions on to the new daemon (-admitstate), so that waiting
+ * for one doesn't give anyone a fresh allowance.  The sessions a
+ * -multiplex engine leaves to its draining child go over as that
+ * child's, and so count until it has finished them all.  -park can't
+ * be used with the session limits, as a parked session is no longer
+ * our child but is still open.
+ */
+
+struct bucket {
+  double tokens;                  /* connections we'd allow right now */
+  double stamp;                   /* when tokens was last brought up to date */
+};
+
+struct ipentry {
+  struct ipentry *next;           /* in iptab hash chain */
+  struct in_addr addr;
+  int sessions;                   /* admitted and not yet finished */
+  struct bucket bucket;
+};
+
+struct admittedchild {
+  struct admittedchild *next;     /* in childtab hash chain */
+  long pid;
+  struct ipentry *ip;
+};
+
+enum rejection { rj_busy, rj_perip, rj_rate, rj_iprate, rj_max };
+static const char *const rejectionmsgs[]= {
+  "484 Server is too busy - please try again later.\r\n",
+  "484 Too many sessions from your address - please try again later.\r\n",
+  "484 Server is too busy - please try again later.\r\n",
+  "484 Too many connections from your address - please try again later.\r\n"
+};
+
+static int maxsessions, maxperip; /* -maxsessions, -maxperip; 0 means no limit  */
+static double rate, rateburst;    /* -rate: connections/s and burst; 0 no limit  */
+static double iprate, iprateburst; /* -iprate: likewise, for each address        */
+static int nadmitted;             /* sessions admitted and not yet finished       */
+static struct bucket ratebucket;
+static struct ipentry *iptab[ADMIT_HASHSIZE];
+static struct admittedchild *childtab[ADMIT_HASHSIZE];
+static long drainpid;             /* -multiplex: child keeping our sessions on restart */
+static unsigned long rejections[rj_max], admissions;
+
+static int limiting(void) {
+  return maxsessions || maxperip || rate || iprate;
 }
 
-void cmd_noop(char *cmd) {
-  if (!noargs(cmd)) return;
-  fputs("200 NOOP command received.\r\n",stdout);
+static int fillbucket(struct bucket *b, double r, double burst, double now) {
+  /* Refills b; returns 1 if it has a token to take. */
+  b->tokens+= (now - b->stamp) * r;
+  if (b->tokens > burst) b->tokens= burst;
+  b->stamp= now;
+  return b->tokens >= 1;
+}
+
+static struct ipentry *admitip(struct in_addr addr, double now) {
+  /* Finds or makes addr's entry; returns 0 if we've no memory. */
+  struct ipentry *ip;
+
+  for (ip= iptab[addr.s_addr % ADMIT_HASHSIZE];
+       ip && ip->addr.s_addr != addr.s_addr;
+       ip= ip->next);
+  if (ip) return ip;
+  ip= malloc(sizeof(*ip));
+  if (!ip) { loge(ll_error,"No memory for admission table"); return 0; }
+  ip->addr= addr;
+  ip->sessions= 0;
+  ip->bucket.tokens= iprateburst;
+  ip->bucket.stamp= now;
+  ip->next= iptab[addr.s_addr % ADMIT_HASHSIZE];
+  iptab[addr.s_addr % ADMIT_HASHSIZE]= ip;
+  return ip;
+}
+
+static int admit(struct in_addr addr, struct ipentry **ipr, const char **why) {
+  /* Returns 1 and sets *ipr (which should be passed to admitdone) if
+   * the client may have a session; or returns 0 and sets *why to the
+   * greeting to give them before closing. */
+  struct ipentry *ip;
+  struct timeval tv;
+  double now;
+  enum rejection rj;
+
+  *ipr= 0;
+  if (!limiting()) return 1;
+  if (gettimeofday(&tv,(void*)0)) { loge(ll_error,"Failed gettimeofday for admission"); return 1; }
+  now= tv.tv_sec + tv.tv_usec/1e6;
+
+  ip= admitip(addr,now);
+  if (!ip) return 1;
+  if (maxsessions && nadmitted >= maxsessions) rj= rj_busy;
+  else if (maxperip && ip->sessions >= maxperip) rj= rj_perip;
+  else if (rate && !fillbucket(&ratebucket,rate,rateburst,now)) rj= rj_rate;
+  else if (iprate && !fillbucket(&ip->bucket,iprate,iprateburst,now)) rj= rj_iprate;
+  else {
+    /* Only now take the tokens, so that a connection one limit turns
+     * away doesn't use up its allowance under the other. */
+    if (rate) ratebucket.tokens--;
+    if (iprate) ip->bucket.tokens--;
+    ip->sessions++; nadmitted++; admissions++;
+    *ipr= ip;
+    return 1;
+  }
+  rejections[rj]++;
+  *why= rejectionmsgs[rj];
+  return 0;
+}
+
+static void admitdone(struct ipentry *ip) {
+  if (!ip) return;
+  ip->sessions--; nadmitted--;
+}
+
+static void admitchild(long pid, struct ipentry *ip) {
+  struct admittedchild *ac;
+
+  if (!ip) return;
+  ac= malloc(sizeof(*ac));
+  if (!ac) { loge(ll_error,"No memory for admission table"); admitdone(ip); return; }
+  ac->pid= pid;
+  ac->ip= ip;
+  ac->next= childtab[pid % ADMIT_HASHSIZE];
+  childtab[pid % ADMIT_HASHSIZE]= ac;
+}
+
+static void admitreaped(long pid) {
+  /* A draining -multiplex engine has an entry for each of its sessions. */
+  struct admittedchild **acp, *ac;
+
+  for (acp= &childtab[pid % ADMIT_HASHSIZE]; (ac= *acp); ) {
+    if (ac->pid != pid) { acp= &ac->next; continue; }
+    admitdone(ac->ip);
+    *acp= ac->next;
+    free(ac);
+  }
+}
+
+static int admitsave(void) {
+  /* Writes the admission state to an unlinked file for the daemon
+   * we're about to exec; returns an fd on it, or -1. */
+  struct admittedchild *ac;
+  struct ipentry *ip;
+  struct session *s;
+  FILE *file;
+  int i, fd;
+
+  if (!limiting()) return -1;
+  file= tmpfile();
+  if (!file) { loge(ll_error,"Failed to make file to keep admission state"); return -1; }
+  fprintf(file,"R %.17g %.17g\n",ratebucket.tokens,ratebucket.stamp);
+  for (i=0; i<ADMIT_HASHSIZE; i++)
+    for (ip= iptab[i]; ip; ip= ip->next)
+      fprintf(file,"I %08lx %.17g %.17g\n",(unsigned long)ip->addr.s_addr,
+              ip->bucket.tokens,ip->bucket.stamp);
+  for (i=0; i<ADMIT_HASHSIZE; i++)
+    for (ac= childtab[i]; ac; ac= ac->next)
+      fprintf(file,"C %ld %08lx\n",ac->pid,(unsigned long)ac->ip->addr.s_addr);
+  if (drainpid)
+    for (s= sessions; s; s= s->next)
+      if (s->ip)
+        fprintf(file,"C %ld %08lx\n",drainpid,(unsigned long)s->ip->addr.s_addr);
+  fd= fflush(file) ? -1 : dup(fileno(file)); /* without close-on-exec */
+  if (fd == -1) loge(ll_error,"Failed to keep admission state");
+  fclose(file);
+  return fd;
+}
+
+static void admitload(int fd) {
+  /* Takes up what admitsave left for us; our own sessions' children
+   * are still ours, and will be reaped by us. */
+  char line[100];
+  struct in_addr addr;
+  struct ipentry *ip;
+  unsigned long a;
+  double tokens, stamp;
+  long pid;
+  FILE *file;
+
+  file= fdopen(fd,"r");
+  if (!file || fseek(file,0,SEEK_SET)) {
+    loge(ll_error,"Failed to read admission state");
+    if (file) fclose(file); else close(fd);
+    return;
+  }
+  while (fgets(line,sizeof(line),file)) {
+    if (sscanf(line,"R %lg %lg",&tokens,&stamp) == 2) {
+      ratebucket.tokens= tokens; ratebucket.stamp= stamp;
+    } else if (sscanf(line,"I %lx %lg %lg",&a,&tokens,&stamp) == 3) {
+      addr.s_addr= a;
+      if (!(ip= admitip(addr,stamp))) break;
+      ip->bucket.tokens= tokens; ip->bucket.stamp= stamp;
+    } else if (sscanf(line,"C %ld %lx",&pid,&a) == 2) {
+      addr.s_addr= a;
+      if (!(ip= admitip(addr,0))) break;
+      ip->sessions++; nadmitted++;
+      admitchild(pid,ip);
+    }
+  }
+  fclose(file);
+}
+
+static void admitlog(void) {
+  /* Logs the rejections since last time, and forgets addresses we no
+   * longer need to remember. */
+  static time_t nextlog;
+  struct ipentry **ipp, *ip;
+  struct timeval tv;
+  double now;
+  int i;
+
+  if (!limiting() || gettime() < nextlog) return;
+  nextlog= gettime() + ADMIT_LOGINTERVAL;
+  for (i=0; i<rj_max && !rejections[i]; i++);
+  if (i<rj_max) {
+    log(ll_alert,"Admitted %lu, rejected %lu too busy, %lu too many from address, "
+        "%lu rate, %lu rate from address; %d sessions now",
+        admissions, rejections[rj_busy], rejections[rj_perip],
+        rejections[rj_rate], rejections[rj_iprate], nadmitted);
+    memset(rejections,0,sizeof(rejections));
+    admissions= 0;
+  }
+  if (gettimeofday(&tv,(void*)0)) return;
+  now= tv.tv_sec + tv.tv_usec/1e6;
+  for (i=0; i<ADMIT_HASHSIZE; i++) {
+    for (ipp= &iptab[i]; (ip= *ipp); ) {
+      if (ip->sessions || (iprate && ip->bucket.tokens + (now-ip->bucket.stamp)*iprate < iprateburst)) {
+        ipp= &ip->next;
+      } else {
+        *ipp= ip->next;
+        free(ip);
+      }
+    }
+  }
+}
+
+/*
+ * Session accounting
+ *
+ * When a session ends we report what it cost: how long it lasted, how
+ * many commands it ran, the bytes the kernel says went each way on
+ * the connection, and its CPU time and peak RSS.  A forked server
+ * process reports down statspipe to the daemon just before it exits;
+ * the -multiplex engine and the parking process keep the books for
+ * their own sessions.  Either way statsrecord() logs a `stats' line
+ * and adds the session into totals, which statslog() reports every
+ * STATS_LOGINTERVAL.  Children which die without reporting are still
+ * counted, from what wait4 tells us.
+ */
+
+struct sessionstats {
+  long pid;
+  unsigned long servseq;
+  struct in_addr addr;
+  char userid[USERID_MAXLEN+1];
+  time_t started, ended;
+  unsigned long commands;
+  unsigned long long bytesin, bytesout;
+  struct timeval utime, stime;
+  long maxrss;                    /* kilobytes; 0 if unknown */
+};
+
+struct tcpinfobytes {
+  /* The kernel's struct tcp_info carries on past the end of the one
+   * in <netinet/tcp.h>. */
+  struct tcp_info ti;
+  uint64_t pacingrate, maxpacingrate;
+  uint64_t bytesacked, bytesreceived;
+};
+
+static struct {
+  unsigned long sessions, unreported, commands;
+  unsigned long long bytesin, bytesout;
+  double wall, utime, stime;
+  long maxrss;
+} totals;
+
+static void addtimeval(struct timeval *to, const struct timeval *a, int sign) {
+  /* *to+= sign * *a */
+  to->tv_sec+= sign*a->tv_sec;
+  to->tv_usec+= sign*a->tv_usec;
+  while (to->tv_usec < 0) { to->tv_usec+= 1000000; to->tv_sec--; }
+  while (to->tv_usec >= 1000000) { to->tv_usec-= 1000000; to->tv_sec++; }
+}
+
+static void statscpu(struct session *s, struct rusage *since) {
+  /* -multiplex: charges s with the CPU we've used since *since, and
+   * moves *since on to now. */
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF,&ru)) return;
+  addtimeval(&s->utime,&ru.ru_utime,1); addtimeval(&s->utime,&since->ru_utime,-1);
+  addtimeval(&s->stime,&ru.ru_stime,1); addtimeval(&s->stime,&since->ru_stime,-1);
+  *since= ru;
+}
+
+static void statsrecord(const struct sessionstats *st) {
+  log(ll_trace,"stats pid=%ld seq=%lu addr=%s user=%s secs=%ld cmds=%lu "
+      "in=%llu out=%llu utime=%ld.%03ld stime=%ld.%03ld maxrss=%ld",
+      st->pid, st->servseq, inet_ntoa(st->addr), *st->userid ? st->userid : "-",
+      (long)(st->ended - st->started), st->commands, st->bytesin, st->bytesout,
+      (long)st->utime.tv_sec, (long)st->utime.tv_usec/1000,
+      (long)st->stime.tv_sec, (long)st->stime.tv_usec/1000, st->maxrss);
+  totals.sessions++;
+  totals.commands+= st->commands;
+  totals.bytesin+= st->bytesin;
+  totals.bytesout+= st->bytesout;
+  totals.wall+= st->ended - st->started;
+  totals.utime+= st->utime.tv_sec + st->utime.tv_usec/1e6;
+  totals.stime+= st->stime.tv_sec + st->stime.tv_usec/1e6;
+  if (st->maxrss > totals.maxrss) totals.maxrss= st->maxrss;
+}
+
+static void statsreport(struct session *s, int self) {
+  /* The session is over.  If self, the whole of this process was the
+   * session, so we add in its own CPU time and size. */
+  struct sessionstats st;
+  struct tcpinfobytes tib;
+  struct rusage ru;
+  socklen_t l;
+
+  memset(&st,0,sizeof(st));
+  st.pid= getpid();
+  st.servseq= s->servseq;
+  st.addr= s->calleraddr.sin_addr;
+  strcpy(st.userid,s->userid);
+  st.started= s->started;
+  st.ended= gettime();
+  st.commands= s->commands;
+  st.utime= s->utime; st.stime= s->stime;
+  st.maxrss= s->maxrss;
+  if (self && !getrusage(RUSAGE_SELF,&ru)) {
+    addtimeval(&st.utime,&ru.ru_utime,1);
+    addtimeval(&st.stime,&ru.ru_stime,1);
+    if (ru.ru_maxrss > st.maxrss) st.maxrss= ru.ru_maxrss;
+  }
+  l= sizeof(tib);
+  if (!getsockopt(s->fd,IPPROTO_TCP,TCP_INFO,&tib,&l) &&
+      l >= offsetof(struct tcpinfobytes,bytesreceived) + sizeof(tib.bytesreceived)) {
+    st.bytesin= tib.bytesreceived;
+    st.bytesout= tib.bytesacked;
+  }
+  if (statspipe[1] == -1) { statsrecord(&st); return; }
+  if (write(statspipe[1],&st,sizeof(st)) != sizeof(st))
+    loge(ll_error,"Failed to report session accounting");
+}
+
+static void statsreadreports(void) {
+  struct sessionstats st;
+  int r;
+
+  if (statspipe[0] == -1) return;
+  for (;;) {
+    r= read(statspipe[0],&st,sizeof(st));
+    if (r == sizeof(st)) { statsrecord(&st); continue; }
+    if (r<0 && errno == EINTR) continue;
+    if (r<0 && errno != EWOULDBLOCK) loge(ll_error,"Failed to read session accounting");
+    else if (r>0) log(ll_error,"Session accounting report was %d bytes, expected %d",
+                      r,(int)sizeof(st));
+    return;
+  }
+}
+
+static void statsunreported(long pid, int status, const struct rusage *ru) {
+  /* A child died without reporting; count what wait4 told us. */
+  log(ll_trace,"stats pid=%ld unreported status=%d utime=%ld.%03ld stime=%ld.%03ld maxrss=%ld",
+      pid, status,
+      (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec/1000,
+      (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec/1000, ru->ru_maxrss);
+  totals.unreported++;
+  totals.utime+= ru->ru_utime.tv_sec + ru->ru_utime.tv_usec/1e6;
+  totals.stime+= ru->ru_stime.tv_sec + ru->ru_stime.tv_usec/1e6;
+  if (ru->ru_maxrss > totals.maxrss) totals.maxrss= ru->ru_maxrss;
+}
+
+static void statslog(void) {
+  static time_t nextlog;
+
+  if (gettime() < nextlog) return;
+  if (nextlog && (totals.sessions || totals.unreported))
+    log(ll_trace,"totals secs=%d sessions=%lu unreported=%lu wall=%.0f cmds=%lu "
+        "in=%llu out=%llu utime=%.3f stime=%.3f maxrss=%ld",
+        STATS_LOGINTERVAL, totals.sessions, totals.unreported, totals.wall,
+        totals.commands, totals.bytesin, totals.bytesout,
+        totals.utime, totals.stime, totals.maxrss);
+  memset(&totals,0,sizeof(totals));
+  nextlog= gettime() + STATS_LOGINTERVAL;
+}
+
+/*
+ * Multiplexed session engine
+ *
+ * With -multiplex we don't fork for each connection: this one process
+ * keeps all the sessions, with nonblocking sockets in an epoll set,
+ * and runs the commands of whichever has complete lines waiting.  A
+ * command still runs to completion, and may wait for file locks just
+ * as it would in its own process.
+ *
+ * The commands write their responses with stdio as usual.  fd 1 is a
+ * scratch file, which we sendfile to the client after each batch of
+ * commands.  If the client isn't reading fast enough the scratch file
+ * becomes that session's outfd, we start a new one, and we read no
+ * more from that client until it has taken what we've said so far.
+ */
+
+static void reopenstderr(void);
+static void setcloexec(int fd, const char *what);
+static void setnonblock(int fd, const char *what);
+static void checkacceptq(const int *masters, int n);
+
+static int epfd= -1;              /* the epoll set                            */
+static int acceptpaused;          /* master taken out of epfd, eg for EMFILE   */
+static int draining;              /* we're the old engine after a restart      */
+
+static void newscratch(void) {
+  FILE *file;
+
+  file= tmpfile();
+  if (!file) { loge(ll_fatal,"Failed to create output scratch file"); exit(1); }
+  if (dup2(fileno(file),1) != 1) {
+    loge(ll_fatal,"Failed to dup2 output scratch file"); exit(1);
+  }
+  fclose(file);
+}
+
+static void engineinterest(struct session *s) {
+  struct epoll_event ev;
+
+  ev.events= s->outfd != -1 ? EPOLLOUT : s->waiting ? 0 : EPOLLIN;
+  ev.data.ptr= s;
+  if (epoll_ctl(epfd,EPOLL_CTL_MOD,s->fd,&ev)) {
+    loge(ll_fatal,"Failed to modify epoll interest"); exit(1);
+  }
+}
+
+static int sendsome(struct session *s, int fd) {
+  /* Sends from fd until s->outdone reaches s->outlen.  Returns 0 if the
+   * socket is full, or 1 if we've finished (perhaps because the client
+   * has gone away, in which case s->closing is now set). */
+  ssize_t r;
+
+  while (s->outdone < s->outlen) {
+    r= sendfile(s->fd,fd,&s->outdone,s->outlen-s->outdone);
+    if (r>0) continue;
+    if (r<0 && errno == EINTR) continue;
+    if (r<0 && errno == EWOULDBLOCK) return 0;
+    if (r) loge(ll_trace,"Write error, closing");
+    else log(ll_trace,"Output file truncated, closing");
+    s->closing= 1; break;
+  }
+  return 1;
+}
+
+static void engineflush(struct session *s) {
+  /* Sends (or arranges to send) what the session's commands just wrote. */
+  off_t len;
+
+  if (fflush(stdout)) { loge(ll_fatal,"Failed to write output scratch file"); exit(1); }
+  len= lseek(1,0,SEEK_CUR);
+  if (len == -1) { loge(ll_fatal,"Failed to lseek output scratch file"); exit(1); }
+  if (!len) return;
+  s->outdone= 0; s->outlen= len;
+  if (s->outfd != -1 || sendsome(s,1)) {
+    if (ftruncate(1,0) || lseek(1,0,SEEK_SET)) {
+      loge(ll_fatal,"Failed to empty output scratch file"); exit(1);
+    }
+    return;
+  }
+  s->outfd= fcntl(1,F_DUPFD_CLOEXEC,0);
+  if (s->outfd == -1) { loge(ll_fatal,"Failed to dup output scratch file"); exit(1); }
+  newscratch();
+  engineinterest(s);
+}
+
+static void closesession(struct session *s) {
+  struct session **sp;
+
+  if (s->data) fclose(s->data);
+  if (s->edit) fclose(s->edit);
+  if (s->outfd != -1) close(s->outfd);
+  if (s->waiting) nwaiting--;
+  admitdone(s->ip);
+  epoll_ctl(epfd,EPOLL_CTL_DEL,s->fd,0);
+  close(s->fd);
+  for (sp= &sessions; *sp != s; sp= &(*sp)->next);
+  *sp= s->next;
+  free(s);
+}
+
+static void sessinput(struct session *s, int canread) {
+  /* Runs the commands waiting in s->inbuf, and reads once more from
+   * the client if canread. */
+  char linebuf[INPUTLINE_MAXLEN+5];
+  int l, toolong;
+
+  sess= s;
+  for (;;) {
+    while (!s->closing && s->outfd == -1 &&
+           (s->waiting == 2 ||
+            (!s->waiting && getinputline(s,linebuf,&toolong)))) {
+      if (setjmp(sessionabort)) {
+        /* endsession() was called, perhaps in the middle of a command */
+        unlockall();
+        s->closing= 1;
+        break;
+      }
+      if (s->waiting) { waitagain(); continue; }
+      processline(linebuf,toolong);
+    }
+    if (s->closing || !canread) break;
+    canread= 0;
+    l= read(s->fd,s->inbuf+s->inlen,sizeof(s->inbuf)-s->inlen);
+    if (l<0) {
+      if (errno == EINTR || errno == EWOULDBLOCK) break;
+      loge(ll_trace,"Read error, closing"); s->closing= 1; break;
+    }
+    if (!l) {
+      log(ll_trace,s->indata ? "EOF in data, closing" : "End of file, closing");
+      s->closing= 1; break;
+    }
+    s->inlen+= l;
+    s->lastinput= gettime();
+  }
+  engineflush(s);
+  sess= 0;
+}
+
+static void sessoutput(struct session *s) {
+  sess= s;
+  if (sendsome(s,s->outfd)) {
+    close(s->outfd); s->outfd= -1;
+    if (!s->closing) { engineinterest(s); sessinput(s,0); }
+  }
+  sess= 0;
+}
+
+static void sessdone(struct session *s) {
+  if (s->closing && s->outfd == -1) { statsreport(s,0); closesession(s); }
+}
+
+static void enginewaits(void) {
+  /* Has each WAIT whose entries might have arrived, or whose time is
+   * up, look again. */
+  struct session *s, *next;
+  time_t now;
+  int word;
+
+  if (!nwaiting) return;
+  word= mirrorword();
+  now= gettime();
+  for (s= sessions; s; s= next) {
+    next= s->next;
+    if (s->waiting != 1 || s->closing) continue;
+    if (mirror && word == s->waitword && now < s->waituntil) continue;
+    s->waiting= 2;
+    sessinput(s,0);
+    sessdone(s);
+  }
+}
+
+static void engineaccept(int master) {
+  struct epoll_event ev;
+  struct session *s;
+  struct ipentry *ip;
+  const char *why;
+  socklen_t cal;
+  int fd, one= 1;
+
+  for (;;) {
+    cal= sizeof(calleraddr);
+    fd= accept(master,(struct sockaddr*)&calleraddr,&cal);
+    if (fd < 0) {
+      if (errno==EINTR) continue;
+      if (errno==EWOULDBLOCK || errno==ECONNABORTED) return;
+      if (errno==EMFILE || errno==ENFILE || errno==ENOBUFS || errno==ENOMEM) {
+        loge(ll_error,"Failed to accept, pausing");
+        epoll_ctl(epfd,EPOLL_CTL_DEL,master,0);
+        acceptpaused= 1;
+        return;
+      }
+      loge(ll_fatal,"Failed to accept"); exit(1);
+    }
+    if (cal != sizeof(calleraddr)) {
+      log(ll_error,"Length of address is %ld, expected %ld",
+          (long)cal, (long)sizeof(calleraddr));
+      write(fd, "484 Server unexpected error: "
+                "Calling address malformatted\r\n",59);
+      close(fd); continue;
+    }
+    if (!admit(calleraddr.sin_addr,&ip,&why)) {
+      write(fd,why,strlen(why));
+      close(fd); continue;
+    }
+    setcloexec(fd,"Failed to set close-on-exec on client socket");
+    setnonblock(fd,"Failed to set nonblocking on client socket");
+    /* each engineflush is a whole batch of responses */
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    servseq++;
+    s= newsession(fd);
+    if (!s) {
+      loge(ll_error,"No memory for session");
+      write(fd,"484 Server system error: Out of memory\r\n",40);
+      admitdone(ip);
+      close(fd); continue;
+    }
+    s->ip= ip;
+    ev.events= EPOLLIN;
+    ev.data.ptr= s;
+    if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)) {
+      loge(ll_fatal,"Failed to add client to epoll set"); exit(1);
+    }
+    sess= s;
+    setstatus(0,"Experimental GROGGS system RGTP server ready");
+    engineflush(s);
+    sess= 0;
+    sessdone(s);
+  }
+}
+
+static void enginetimeouts(void) {
+  struct session *s, *next;
+  time_t now;
+
+  now= gettime();
+  for (s= sessions; s; s= next) {
+    next= s->next;
+    if (s->closing || now - s->lastinput < sesstimeout(s)) continue;
+    sess= s;
+    log(ll_trace,"timeout, closing");
+    if (s->outfd == -1) {
+      fputs("481 Timeout awaiting input - closing connection.\r\n",stdout);
+      engineflush(s);
+    }
+    s->closing= 1;
+    if (s->outfd != -1) { close(s->outfd); s->outfd= -1; }
+    sess= 0;
+    sessdone(s);
+  }
+}
+
+static void restart(int master);
+
+static void enginerestart(int master) {
+  /* The old sessions are finished off by a child, which must take
+   * over the edit locks since fcntl locks aren't inherited. */
+  struct session *s;
+  struct flock fl;
+  int child;
+
+  if (!sessions) restart(master);
+  log(ll_trace,"Caught a SIGUSR2, restarting; a child keeps the old sessions");
+  child= fork();
+  if (child < 0) { loge(ll_error,"Failed to fork to keep old sessions"); return; }
+  if (child) {
+    for (s= sessions; s; s= s->next)
+      if (s->edit) { fclose(s->edit); s->edit= 0; }
+    drainpid= child;
+    restart(master);
+    drainpid= 0;
+    return;
+  }
+  mypid= getpid();
+  draining= 1; wantrestart= 0;
+  epoll_ctl(epfd,EPOLL_CTL_DEL,master,0);
+  close(master);
+  for (s= sessions; s; s= s->next) {
+    if (!s->edit) continue;
+    fl.l_type= F_WRLCK;
+    fl.l_whence= SEEK_SET;
+    fl.l_start= 0;
+    fl.l_len= USERID_MAXLEN;
+    while (fcntl(fileno(s->edit),F_SETLKW,&fl) == -1) {
+      if (errno != EINTR) { loge(ll_error,"Failed to retake edit lock"); break; }
+    }
+  }
+}
+
+static void engine(int master) {
+  static char stdoutbuf[ENGINE_OUTBUF];
+  struct epoll_event evs[ENGINE_MAXEVENTS], ev;
+  struct session *s;
+  struct rusage ru;
+  long childstatpid;
+  time_t nexttick;
+  int i, n, status;
+
+  epfd= epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) { loge(ll_fatal,"Failed to create epoll set"); exit(1); }
+  ev.events= EPOLLIN;
+  ev.data.ptr= 0;
+  if (epoll_ctl(epfd,EPOLL_CTL_ADD,master,&ev)) {
+    loge(ll_fatal,"Failed to add master socket to epoll set"); exit(1);
+  }
+  newscratch();
+  setvbuf(stdout,stdoutbuf,_IOFBF,sizeof(stdoutbuf));
+  signal(SIGPIPE,SIG_IGN);
+
+  nexttick= gettime() + ENGINE_TICK;
+  for (;;) {
+    n= epoll_wait(epfd,evs,ENGINE_MAXEVENTS,ENGINE_TICK*1000);
+    if (n<0) {
+      if (errno != EINTR) { loge(ll_fatal,"Failed to epoll_wait"); exit(1); }
+      n= 0;
+    }
+    getrusage(RUSAGE_SELF,&ru);
+    for (i=0; i<n; i++) {
+      s= evs[i].data.ptr;
+      if (!s) { engineaccept(master); continue; }
+      if (s->outfd != -1) sessoutput(s);
+      else sessinput(s,1);
+      statscpu(s,&ru);
+      sessdone(s);
+    }
+    enginewaits();
+    if (!wantrestart && gettime() < nexttick) continue;
+    nexttick= gettime() + ENGINE_TICK;
+    while ((childstatpid= waitpid(-1,&status,WNOHANG))>0) {
+      admitreaped(childstatpid);
+      if (WIFEXITED(status) ? WEXITSTATUS(status) :
+          WIFSIGNALED(status) ? WTERMSIG(status)!=SIGPIPE : 1)
+        log(ll_error,"Subprocess %ld failed with code %d\n",childstatpid,status);
+    }
+    if (debugserver != 1) reopenstderr();
+    if (!isacceptor && !draining) checkacceptq(&master,1);
+    admitlog();
+    statslog();
+    enginetimeouts();
+    if (draining && !sessions) exit(0);
+    if (acceptpaused && !draining) {
+      ev.events= EPOLLIN;
+      ev.data.ptr= 0;
+      if (!epoll_ctl(epfd,EPOLL_CTL_ADD,master,&ev)) acceptpaused= 0;
+    }
+    if (wantrestart && !draining) enginerestart(master);
+  }
+}
+
+/*
+ * Parking idle sessions
+ *
+ * With -park <secs>, a forked server process whose client has been
+ * quiet that long, and which is in no particular state (no DATA,
+ * editing, authentication or half-read line), hands the client's
+ * socket and a few bytes of session state to the parking process and
+ * exits.  The parking process watches the parked sockets with epoll
+ * and forks a new server process to carry on with each session as
+ * soon as its client says something.  It also does the inactivity
+ * timeout for the sessions it holds.
+ *
+ * The parking process is forked by the daemon and talks to the server
+ * processes over an AF_UNIX SOCK_SEQPACKET socketpair; a session is
+ * one message, carrying a struct parkedsession and the socket
+ * (SCM_RIGHTS).  When the daemon restarts it tells the old parking
+ * process (SIGUSR2), which stops taking new sessions and exits when
+ * it has none left.
+ */
+
+struct parkedsession {
+  unsigned long servseq;
+  struct sockaddr_in calleraddr;
+  long lastinput;
+  int debuglevel, supertrace, identdone, maycontinue, registration, alevel, deflate;
+  char saveditemid[ITEMID_LEN+1];
+  char userid[USERID_MAXLEN+1];
+  long started;
+  unsigned long commands;
+  struct timeval utime, stime;
+  long maxrss;
+};
+
+static int parkpair[2]= { -1, -1 }; /* [0] parking process, [1] server processes */
+
+static int parkable(void) {
+  return parktime && parkpair[1] != -1 &&
+    !sess->indata && !sess->data && !sess->edit && sess->lenbeforeedit == -1 &&
+    !*sess->identue.userid && !sess->inlen && !sess->skipping;
+}
+
+static int sendpark(void) {
+  struct parkedsession ps;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } control;
+  struct rusage ru;
+
+  memset(&ps,0,sizeof(ps));
+  ps.servseq= sess->servseq;
+  ps.calleraddr= sess->calleraddr;
+  ps.lastinput= sess->lastinput;
+  ps.debuglevel= sess->debuglevel;
+  ps.supertrace= sess->supertrace;
+  ps.identdone= sess->identdone;
+  ps.maycontinue= sess->maycontinue;
+  ps.registration= sess->registration;
+  ps.alevel= sess->alevel;
+  ps.deflate= sess->deflate;
+  strcpy(ps.saveditemid,sess->saveditemid);
+  strcpy(ps.userid,sess->userid);
+  ps.started= sess->started;
+  ps.commands= sess->commands;
+  ps.utime= sess->utime;
+  ps.stime= sess->stime;
+  ps.maxrss= sess->maxrss;
+  if (!getrusage(RUSAGE_SELF,&ru)) {
+    addtimeval(&ps.utime,&ru.ru_utime,1);
+    addtimeval(&ps.stime,&ru.ru_stime,1);
+    if (ru.ru_maxrss > ps.maxrss) ps.maxrss= ru.ru_maxrss;
+  }
+
+  memset(&msg,0,sizeof(msg));
+  iov.iov_base= &ps; iov.iov_len= sizeof(ps);
+  msg.msg_iov= &iov; msg.msg_iovlen= 1;
+  msg.msg_control= control.buf; msg.msg_controllen= sizeof(control.buf);
+  cmsg= CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level= SOL_SOCKET;
+  cmsg->cmsg_type= SCM_RIGHTS;
+  cmsg->cmsg_len= CMSG_LEN(sizeof(int));
+  *(int*)CMSG_DATA(cmsg)= 0;
+  if (sendmsg(parkpair[1],&msg,MSG_DONTWAIT|MSG_NOSIGNAL) != sizeof(ps)) {
+    if (errno == EPIPE) {
+      /* that parking process has retired; don't try again */
+      close(parkpair[1]); parkpair[1]= -1;
+    } else {
+      loge(ll_trace,"Failed to park session");
+    }
+    return 0;
+  }
+  return 1;
+}
+
+static void waitorpark(void) {
+  /* Waits up to parktime for the client; if they don't say anything
+   * we park the session and exit. */
+  fd_set readfds;
+  struct timeval timeout;
+  int i;
+
+  if (gettime() + parktime >= sess->lastinput + sesstimeout(sess)) return;
+  for (;;) {
+    FD_ZERO(&readfds); FD_SET(0,&readfds);
+    timeout.tv_sec= parktime;
+    timeout.tv_usec= 0;
+    i= select(1,&readfds,(void*)0,(void*)0,&timeout);
+    if (i<0 && errno == EINTR) continue;
+    if (i) return;
+    break;
+  }
+  if (!sendpark()) return;
+  if (sess->supertrace) log(ll_debug,"Idle, parked");
+  exit(0);
+}
+
+static void resume(struct session *s) {
+  /* In a new child of the parking process: carry on with s. */
+  mypid= getpid();
+  slave= s->fd;
+  clientstdio();
+  close(slave);
+  s->fd= 0;
+  s->next= 0;
+  sess= sessions= s;
+  if (sess->supertrace) log(ll_debug,"Resumed");
+  serve();
+}
+
+static void parkreceive(void) {
+  struct parkedsession ps;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } control;
+  struct epoll_event ev;
+  struct session *s;
+  int r, fd;
+
+  for (;;) {
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base= &ps; iov.iov_len= sizeof(ps);
+    msg.msg_iov= &iov; msg.msg_iovlen= 1;
+    msg.msg_control= control.buf; msg.msg_controllen= sizeof(control.buf);
+    r= recvmsg(parkpair[0],&msg,MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+    if (r<0) {
+      if (errno == EINTR) continue;
+      if (errno != EWOULDBLOCK) loge(ll_error,"Failed to receive parked session");
+      return;
+    }
+    cmsg= CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+      log(ll_error,"Parked session message had no socket");
+      continue;
+    }
+    fd= *(int*)CMSG_DATA(cmsg);
+    if (r != sizeof(ps)) {
+      log(ll_error,"Parked session message was %d bytes, expected %d",
+          r,(int)sizeof(ps));
+      close(fd); continue;
+    }
+    servseq= ps.servseq;
+    calleraddr= ps.calleraddr;
+    s= newsession(fd);
+    if (!s) {
+      loge(ll_error,"No memory for parked session");
+      write(fd,"484 Server system error: Out of memory\r\n",40);
+      close(fd); continue;
+    }
+    s->lastinput= ps.lastinput;
+    s->debuglevel= ps.debuglevel;
+    s->supertrace= ps.supertrace;
+    s->identdone= ps.identdone;
+    s->maycontinue= ps.maycontinue;
+    s->registration= ps.registration;
+    s->alevel= ps.alevel;
+    s->deflate= ps.deflate;
+    strcpy(s->saveditemid,ps.saveditemid);
+    strcpy(s->userid,ps.userid);
+    s->started= ps.started;
+    s->commands= ps.commands;
+    s->utime= ps.utime;
+    s->stime= ps.stime;
+    s->maxrss= ps.maxrss;
+    ev.events= EPOLLIN|EPOLLRDHUP;
+    ev.data.ptr= s;
+    if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)) {
+      loge(ll_fatal,"Failed to add parked session to epoll set"); exit(1);
+    }
+  }
+}
+
+static void parkwake(struct session *s) {
+  struct session *o;
+  int r, child= -1;
+  char c;
+
+  sess= s;
+  r= recv(s->fd,&c,1,MSG_PEEK|MSG_DONTWAIT);
+  if (r<0 && (errno == EINTR || errno == EWOULDBLOCK)) { sess= 0; return; }
+  if (r<0) {
+    loge(ll_trace,"Read error, closing");
+  } else if (!r) {
+    log(ll_trace,"End of file, closing");
+  } else {
+    child= fork();
+    if (child == 0) {
+      close(epfd); epfd= -1;
+      if (parkpair[0] != -1) { close(parkpair[0]); parkpair[0]= -1; }
+      for (o= sessions; o; o= o->next) if (o != s) close(o->fd);
+      resume(s);
+    }
+    if (child < 0) {
+      loge(ll_error,"Failed to fork to resume session");
+      write(s->fd,"484 Server system error: Failed to fork\r\n",41);
+    }
+  }
+  sess= 0;
+  if (child < 0) statsreport(s,0); /* else the new child will report */
+  closesession(s);
+}
+
+static void parker(void) {
+  struct epoll_event evs[ENGINE_MAXEVENTS], ev;
+  struct session *s, *next;
+  long childstatpid;
+  time_t now;
+  int i, n, status, retiring= 0;
+
+  mypid= getpid();
+  epfd= epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) { loge(ll_fatal,"Failed to create epoll set"); exit(1); }
+  ev.events= EPOLLIN;
+  ev.data.ptr= 0;
+  if (epoll_ctl(epfd,EPOLL_CTL_ADD,parkpair[0],&ev)) {
+    loge(ll_fatal,"Failed to add park socket to epoll set"); exit(1);
+  }
+  log(ll_trace,"Parking process started");
+
+  for (;;) {
+    n= epoll_wait(epfd,evs,ENGINE_MAXEVENTS,PARK_TICK*1000);
+    if (n<0) {
+      if (errno != EINTR) { loge(ll_fatal,"Failed to epoll_wait"); exit(1); }
+      n= 0;
+    }
+    for (i=0; i<n; i++) {
+      if (evs[i].data.ptr) parkwake(evs[i].data.ptr);
+      else parkreceive();
+    }
+    while ((childstatpid= waitpid(-1,&status,WNOHANG))>0) {
+      if (WIFEXITED(status) ? WEXITSTATUS(status) :
+          WIFSIGNALED(status) ? WTERMSIG(status)!=SIGPIPE : 1)
+        log(ll_error,"Subprocess %ld failed with code %d\n",childstatpid,status);
+    }
+    now= gettime();
+    for (s= sessions; s; s= next) {
+      next= s->next;
+      if (now - s->lastinput < sesstimeout(s)) continue;
+      sess= s;
+      log(ll_trace,"timeout, closing");
+      write(s->fd,"481 Timeout awaiting input - closing connection.\r\n",51);
+      sess= 0;
+      statsreport(s,0);
+      closesession(s);
+    }
+    if (!retiring && (wantrestart || getppid() != parentpid)) {
+      /* The daemon has restarted or gone away */
+      log(ll_trace,"Parking process retiring");
+      retiring= 1;
+      parkreceive();
+      close(parkpair[0]); close(parkpair[1]);
+      parkpair[0]= parkpair[1]= -1;
+    }
+    if (retiring && !sessions) exit(0);
+  }
+}
+
+static void startparker(int master) {
+  int child;
+
+  if (parkpair[1] != -1) close(parkpair[1]);
+  if (socketpair(AF_UNIX,SOCK_SEQPACKET,0,parkpair)) {
+    loge(ll_fatal,"Failed to create park socketpair"); exit(1);
+  }
+  setcloexec(parkpair[1],"Failed to set close-on-exec on park socket");
+  parentpid= mypid;
+  child= fork();
+  if (child < 0) { loge(ll_fatal,"Failed to fork parking process"); exit(1); }
+  if (child == 0) { close(master); parker(); }
+  parkerpid= child;
+  close(parkpair[0]); parkpair[0]= -1;
 }
 
 /*
- * Command table and main program
+ * Pre-forked worker pool
+ *
+ * Idle workers wait in accept() on the shared master socket.  When one
+ * gets a connection it tells us so on reportpipe and becomes an
+ * ordinary server process, which exits at the end of the session.  We
+ * fork replacements as soon as we hear about it, so that forking is
+ * not on the critical path of a connecting client, and retire surplus
+ * idle workers by writing one byte each down ctlpipe.
  */
 
-const struct commandinfo commandinfos[]= {
-  { "AUTH", cmd_auth, al_none  },
-  { "ALVL", cmd_alvl, al_none  },
-  { "DBUG", cmd_dbug, al_none  },
-  { "HELP", cmd_help, al_none  },
-  { "MOTD", cmd_motd, al_none  },
-  { "NOOP", cmd_noop, al_none  },
-  { "QUIT", cmd_quit, al_none  },
-  { "REGU", cmd_regu, al_none  },
-  { "USER", cmd_user, al_none  },
-  
-  { "ELOG", cmd_elog, al_read  },
-  { "INDX", cmd_indx, al_read  },
-  { "ITEM", cmd_item, al_read  },
-  { "STAT", cmd_stat, al_read  },
-  
-  { "CONT", cmd_cont, al_write },
-  { "DATA", cmd_data, al_write },
-  { "NEWI", cmd_newi, al_write },
-  { "REPL", cmd_repl, al_write },
-  
-  { "DIFF", cmd_diff, al_edit  },
-  { "EDLK", cmd_edlk, al_edit  },
-  { "EDUL", cmd_edul, al_edit  },
-  { "EDIT", cmd_edit, al_edit  },
-  { "EDIX", cmd_edix, al_edit  },
-  { "EDAB", cmd_edab, al_edit  },
-  { "EDCF", cmd_edcf, al_edit  },
-  { "KILL", cmd_kill, al_edit  },
-  { "KILR", cmd_kilr, al_edit  },
-  { "MOTS", cmd_mots, al_edit  },
-  { "UDBM", cmd_udbm, al_edit  },
+enum childmsgtype { cm_busy };
 
-  { 0 }
+struct childmsg {
+  long pid;
+  int type; /* enum childmsgtype */
 };
 
-static void server(void) {
-  static char stdinbuf[INPUTLINE_MAXLEN+5], stdoutbuf[INPUTLINE_MAXLEN+5];
-  char linebuf[INPUTLINE_MAXLEN+5];
-  int l, flags;
-  const struct commandinfo *cip;
-  const char *p;
-  char *q;
+struct poolworker {
+  long pid;
+  int busy;
+};
 
-  mypid= getpid();
-  
-  close(0); errno=0;
-  if (dup(slave)) {
-    perror("groggsd: ERROR dup(slave)!=0");
-    write(slave,
-          "484 Server unexpected error: Failed to reassign stdin.\r\n",56);
-    exit(1);
-  }
-  close(1); errno=0;
-  if (dup(slave)!=1) {
-    perror("groggsd: ERROR dup(slave)!=1");
-    write(slave,
-          "484 Server unexpected error: Failed to reassign stdout\r\n",56);
-    exit(1);
+static int ctlpipe[2]= { -1, -1 };    /* parent -> idle workers: retire one each byte */
+static int reportpipe[2]= { -1, -1 }; /* workers -> parent: struct childmsg           */
+static struct poolworker *workers;
+static int nworkers, workersalloc;
+static int retiring;                   /* bytes sent down ctlpipe whose taker isn't reaped */
+
+static void setcloexec(int fd, const char *what) {
+  int flags;
+
+  flags= fcntl(fd,F_GETFD,0);
+  if (flags == -1 || fcntl(fd,F_SETFD,flags|FD_CLOEXEC) == -1) {
+    loge(ll_fatal,what); exit(1);
   }
-  setvbuf(stdin,stdinbuf,_IOLBF,INPUTLINE_MAXLEN);
-  setvbuf(stdout,stdoutbuf,_IOLBF,INPUTLINE_MAXLEN);
+}
 
-  sprintf(clientid, "%ld %s,%d",
-          servseq, inet_ntoa(calleraddr.sin_addr), ntohs(calleraddr.sin_port));
+static void setnonblock(int fd, const char *what) {
+  int flags;
 
-  signal(SIGPIPE,&sigpipehandler);
-  
-  flags= fcntl(0,F_GETFL,0);
-  if (flags == -1) ohshite("Failed fcntl GETFL on client socket");
-  flags &= ~O_NDELAY;
-  if (fcntl(0,F_SETFL,flags)==-1)
-    ohshite("Failed fcntl SETFL on client socket");
+  flags= fcntl(fd,F_GETFL,0);
+  if (flags == -1 || fcntl(fd,F_SETFL,flags|O_NDELAY) == -1) {
+    loge(ll_fatal,what); exit(1);
+  }
+}
 
-  setstatus(0,"Experimental GROGGS system RGTP server ready");
+static void poolworker(int master) {
+  struct childmsg cm;
+  fd_set readfds;
+  socklen_t cal;
+  char c;
+  int i;
+
+  mypid= getpid();
+  close(ctlpipe[1]); close(reportpipe[0]);
   for (;;) {
-    errno= 0;
-    settimeout(0, edit ? EDITORINACTIVITY_TIMEOUT : INACTIVITY_TIMEOUT);
-    p= fgets(linebuf,INPUTLINE_MAXLEN,stdin);
-    if (alarmclosefd== -1) wastimeout();
-    if (!p) {
-      if (ferror(stdin)) loge(ll_trace,"Read error, closing");
-      else log(ll_trace,"End of file, closing");
-      exit(0);
+    FD_ZERO(&readfds); FD_SET(master,&readfds); FD_SET(ctlpipe[0],&readfds);
+    i= select((master > ctlpipe[0] ? master : ctlpipe[0])+1,
+              &readfds,(void*)0,(void*)0,(void*)0);
+    if (i<0) {
+      if (errno==EINTR) continue;
+      loge(ll_fatal,"Pool worker failed to select"); exit(1);
     }
-    l= strlen(linebuf);
-    if (!l) {
-      log(ll_trace,"Empty line (not even a newline) received and ignored");
-      continue;
+    if (FD_ISSET(ctlpipe[0],&readfds)) {
+      i= read(ctlpipe[0],&c,1);
+      if (i>=0) exit(0); /* retired, or parent has gone away (eg, restarting) */
+      if (errno!=EINTR && errno!=EWOULDBLOCK) {
+        loge(ll_fatal,"Pool worker failed to read control pipe"); exit(1);
+      }
     }
-    if (linebuf[l-1]!='\n') {
-      log(ll_trace,"Line too long (`%.50s...')", linebuf);
-      setsupertrace(); fputs("512 Line far too long.\r\n",stdout);
-      skiptonewline();
-      continue;
+    if (!FD_ISSET(master,&readfds)) continue;
+    cal= sizeof(calleraddr);
+    slave= accept(master,(struct sockaddr*)&calleraddr,&cal);
+    if (slave < 0) {
+      if (errno==EINTR || errno==EWOULDBLOCK || errno==ECONNABORTED) continue;
+      loge(ll_fatal,"Pool worker failed to accept"); exit(1);
     }
-    while (l>0 && isspace(linebuf[l-1])) l--;
-    if (!l) continue;
-    linebuf[l]= 0;
-    alarm(0); if (alarmclosefd == -1) wastimeout();
-    if (supertrace) log(ll_debug,"<<< %s",linebuf);
-    else strcpy(loglinebuf,linebuf);
-    for (cip= commandinfos; cip->command; cip++) {
-      for (p= cip->command, q=linebuf;
-           *p && toupper(*p) == toupper(*q);
-           p++, q++);
-      if (!*p && (!*q || isspace(*q))) break;
-    }
-    if (!cip->command) {
-      setsupertrace(); log(ll_trace,"Unknown command `%.40s[...]'",linebuf);
-      fputs("510 Unknown command.\r\n",stdout);
-    } else if (alevel < cip->alevel) {
-      ensurelogcmdline();
-      log(ll_alert,"530 response to %s.",cip->command); tcpident(); setsupertrace();
-      fputs("530 Permission denied as specified in 230/231/232 response.\r\n",
-            stdout);
-    } else {
-      skipspace(&q);
-      (cip->function)(q);
+    if (cal != sizeof(calleraddr)) {
+      log(ll_fatal,"Length of address is %ld, expected %ld",
+          (long)cal, (long)sizeof(calleraddr));
+      write(slave, "484 Server unexpected error: "
+                   "Calling address malformatted\r\n",59);
+      exit(1);
     }
-  }    
+    cm.pid= mypid; cm.type= cm_busy;
+    signal(SIGPIPE,SIG_IGN);
+    if (write(reportpipe[1],&cm,sizeof(cm)) != sizeof(cm))
+      loge(ll_error,"Pool worker failed to report to parent");
+    close(ctlpipe[0]); close(reportpipe[1]); close(master);
+    server();
+  }
+}
+
+static void poolspawn(int master) {
+  int child;
+  
+  if (nworkers == workersalloc) {
+    workersalloc= workersalloc ? workersalloc*2 : 16;
+    workers= realloc(workers,sizeof(*workers)*workersalloc);
+    if (!workers) { loge(ll_fatal,"No memory for worker pool table"); exit(1); }
+  }
+  servseq++;
+  child= fork();
+  if (child < 0) { loge(ll_error,"Failed to fork pool worker"); return; }
+  if (child == 0) poolworker(master);
+  workers[nworkers].pid= child;
+  workers[nworkers].busy= 0;
+  nworkers++;
+}
+
+static void poolreadreports(void) {
+  struct childmsg cm;
+  int i, r;
+
+  for (;;) {
+    r= read(reportpipe[0],&cm,sizeof(cm));
+    if (r<0) {
+      if (errno==EINTR) continue;
+      if (errno==EWOULDBLOCK) return;
+      loge(ll_fatal,"Failed to read pool report pipe"); exit(1);
+    }
+    if (r != sizeof(cm)) {
+      log(ll_fatal,"Pool report pipe gave %d bytes, expected %d",r,(int)sizeof(cm));
+      exit(1);
+    }
+    for (i=0; i<nworkers; i++)
+      if (workers[i].pid == cm.pid && cm.type == cm_busy) workers[i].busy= 1;
+  }
+}
+
+static void poolreaped(long pid, int status) {
+  int i;
+
+  /* It may have said it was busy just before it exited. */
+  poolreadreports();
+  for (i=0; i<nworkers; i++) {
+    if (workers[i].pid != pid) continue;
+    /* An idle worker only exits cleanly when it has taken a byte. */
+    if (!workers[i].busy && WIFEXITED(status) && !WEXITSTATUS(status) && retiring)
+      retiring--;
+    workers[i]= workers[--nworkers];
+    return;
+  }
+}
+
+static void poolmaintain(int master) {
+  int i, idle;
+
+  /* Idle workers already told to retire don't count: they will go. */
+  for (i=0, idle=-retiring; i<nworkers; i++) if (!workers[i].busy) idle++;
+  while (idle < poolmin) { poolspawn(master); idle++; }
+  if (idle > poolmax) {
+    /* We retire at most one per tick; any worker which is idle may take it. */
+    if (write(ctlpipe[1],"",1) == 1) retiring++;
+    else if (errno != EWOULDBLOCK) loge(ll_error,"Failed to write pool control pipe");
+  }
+}
+
+static void poolinit(void) {
+  if (pipe(ctlpipe) || pipe(reportpipe)) {
+    loge(ll_fatal,"Failed to create pool pipes"); exit(1);
+  }
+  setcloexec(ctlpipe[1],"Failed to set close-on-exec on pool control pipe");
+  setcloexec(reportpipe[0],"Failed to set close-on-exec on pool report pipe");
+  setnonblock(ctlpipe[0],"Failed to set nonblocking on pool control pipe");
+  setnonblock(ctlpipe[1],"Failed to set nonblocking on pool control pipe");
+  setnonblock(reportpipe[0],"Failed to set nonblocking on pool report pipe");
 }
 
 static void recordwantrestart(void) { wantrestart=1; }
 
+static void restart(int master) {
+  /* Only returns if the exec fails. */
+  char buf[10], minbuf[10], maxbuf[10], backlogbuf[10], pidbuf[20], parkbuf[10];
+  char maxsessbuf[10], maxperipbuf[10], ratebuf[2][30], ipratebuf[2][30];
+  char admitbuf[10];
+  const char *args[32];
+  int nargs= 0, admitfd;
+
+  sprintf(buf,"%d",master);
+  args[nargs++]= DAEMON_PROGRAM;
+  args[nargs++]= "-master"; args[nargs++]= buf;
+  if (debugserver>0) args[nargs++]= "-debug";
+  if (debugserver>1) args[nargs++]= "-debug";
+  if (poolmin) {
+    sprintf(minbuf,"%d",poolmin); sprintf(maxbuf,"%d",poolmax);
+    args[nargs++]= "-pool"; args[nargs++]= minbuf; args[nargs++]= maxbuf;
+  }
+  if (multiplex) args[nargs++]= "-multiplex";
+  if (backlog != LISTEN_BACKLOG) {
+    sprintf(backlogbuf,"%d",backlog);
+    args[nargs++]= "-backlog"; args[nargs++]= backlogbuf;
+  }
+  if (parktime) {
+    sprintf(parkbuf,"%d",parktime);
+    args[nargs++]= "-park"; args[nargs++]= parkbuf;
+  }
+  if (maxsessions) {
+    sprintf(maxsessbuf,"%d",maxsessions);
+    args[nargs++]= "-maxsessions"; args[nargs++]= maxsessbuf;
+  }
+  if (maxperip) {
+    sprintf(maxperipbuf,"%d",maxperip);
+    args[nargs++]= "-maxperip"; args[nargs++]= maxperipbuf;
+  }
+  if (rate) {
+    sprintf(ratebuf[0],"%g",rate); sprintf(ratebuf[1],"%g",rateburst);
+    args[nargs++]= "-rate"; args[nargs++]= ratebuf[0]; args[nargs++]= ratebuf[1];
+  }
+  if (iprate) {
+    sprintf(ipratebuf[0],"%g",iprate); sprintf(ipratebuf[1],"%g",iprateburst);
+    args[nargs++]= "-iprate"; args[nargs++]= ipratebuf[0]; args[nargs++]= ipratebuf[1];
+  }
+  if (isacceptor) {
+    sprintf(pidbuf,"%ld",daemonpid);
+    args[nargs++]= "-acceptor"; args[nargs++]= pidbuf;
+  }
+  admitfd= admitsave();
+  if (admitfd != -1) {
+    sprintf(admitbuf,"%d",admitfd);
+    args[nargs++]= "-admitstate"; args[nargs++]= admitbuf;
+  }
+  args[nargs]= 0;
+  log(ll_trace,"Caught a SIGUSR2, restarting ...");
+  if (parkerpid && kill(parkerpid,SIGUSR2))
+    loge(ll_error,"Failed to tell parking process we're restarting");
+  execv(DAEMON_PROGRAM,(char**)args);
+  loge(ll_error,"Failed to exec replacement daemon");
+  if (admitfd != -1) close(admitfd);
+}
+
 static void reopenstderr(void) {
   int fd;
   
@@ -2152,6 +6704,14 @@ static void reopenstderr(void) {
   if (fd<0) {
     loge(ll_error,"Failed to reopen logging file"); exit(1);
   }
+  if (epfd != -1) {
+    /* -multiplex: stdout is the output scratch file */
+    if (dup2(fd,2) != 2) {
+      loge(ll_error,"Failed to dup2 logfile to stderr"); exit(1);
+    }
+    close(fd);
+    return;
+  }
   if (dup2(fd,1) != 1) {
     loge(ll_error,"Failed to dup2 logfile to stdout"); exit(1);
   }
@@ -2175,8 +6735,190 @@ static void checkstderr(void) {
   checking--;
 }
 
+/*
+ * Multiple acceptors
+ *
+ * With -acceptors N we open N listening sockets on the same port with
+ * SO_REUSEPORT, so that the kernel shares out incoming connections,
+ * and fork an acceptor process for each.  An acceptor is just an
+ * ordinary daemon (forking, -pool or -multiplex) on its own socket.
+ * This process stays behind as a supervisor: it restarts acceptors
+ * which die, passes SIGUSR2 and SIGTERM on to them, and keeps an eye
+ * on the accept queues.
+ */
+
+struct acceptor {
+  long pid;                       /* 0 if not running */
+  int master;
+};
+
+static struct acceptor acceptortab[ACCEPTORS_MAX];
+static sig_atomic_t wantstop;     /* supervisor caught a SIGTERM */
+
+static void recordwantstop(void) { wantstop=1; }
+
+static int makemaster(int reuseport) {
+  struct sockaddr_in sa;
+  int master, one= 1;
+
+  master= socket(AF_INET,SOCK_STREAM,0);
+  if (master<0) {
+    perror("groggsd: Fatal error! Failed to create socket"); exit(1);
+  }
+  if (reuseport &&
+      setsockopt(master,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one))) {
+    loge(ll_fatal,"Failed to set SO_REUSEPORT"); exit(1);
+  }
+  memset(&sa,0,sizeof(sa));
+  sa.sin_family= AF_INET;
+  for (;;) {
+    sa.sin_port= htons(port);
+    if (bind(master,(struct sockaddr*)&sa,sizeof(sa)) >=0) break;
+    if (errno != EADDRINUSE || debugserver != 1) {
+      loge(ll_fatal,"Failed to bind"); exit(1);
+    }
+    port++;
+  }
+  return master;
+}
+
+static int readlistenstats(unsigned long *overflows, unsigned long *drops) {
+  /* Gets the host-wide counts of connections lost because an accept
+   * queue was full.  Returns 0 if they're not available. */
+  static char names[NETSTATLINE_MAXLEN], values[NETSTATLINE_MAXLEN];
+  FILE *file;
+  char *n, *v, *np, *vp;
+  int found= 0;
+
+  file= fopen(NETSTAT_FILENAME,"r");
+  if (!file) return 0;
+  while (fgets(names,sizeof(names),file) && fgets(values,sizeof(values),file)) {
+    if (strncmp(names,"TcpExt:",7) || strncmp(values,"TcpExt:",7)) continue;
+    strtok_r(names," \n",&np); strtok_r(values," \n",&vp);
+    while ((n= strtok_r(0," \n",&np)) && (v= strtok_r(0," \n",&vp))) {
+      if (!strcmp(n,"ListenOverflows")) { *overflows= strtoul(v,0,10); found|= 1; }
+      else if (!strcmp(n,"ListenDrops")) { *drops= strtoul(v,0,10); found|= 2; }
+    }
+  }
+  fclose(file);
+  return found == 3;
+}
+
+static void checkacceptq(const int *masters, int n) {
+  /* Logs any accept queue overflows since we were last called, with
+   * the current length/limit of each of our queues. */
+  static time_t nextcheck;
+  static unsigned long lastoverflows, lastdrops;
+  static int havelast;
+  unsigned long overflows, drops;
+  char buf[ACCEPTORS_MAX*25+5], *p;
+  struct tcp_info ti;
+  socklen_t l;
+  time_t now;
+  int i;
+
+  now= gettime();
+  if (now < nextcheck) return;
+  nextcheck= now + ACCEPTQ_CHECK;
+  if (!readlistenstats(&overflows,&drops)) return;
+  if (havelast && (overflows != lastoverflows || drops != lastdrops)) {
+    p= buf; *p= 0;
+    for (i=0; i<n; i++) {
+      l= sizeof(ti);
+      if (getsockopt(masters[i],IPPROTO_TCP,TCP_INFO,&ti,&l)) strcpy(p," ?");
+      else sprintf(p," %u/%u",ti.tcpi_unacked,ti.tcpi_sacked);
+      p+= strlen(p);
+    }
+    log(ll_alert,"Accept queues overflowed %lu times (%lu dropped) on this host "
+        "since last check; our queues now%s",
+        overflows-lastoverflows, drops-lastdrops, buf);
+  }
+  lastoverflows= overflows; lastdrops= drops; havelast= 1;
+}
+
+static int startacceptor(int i) {
+  /* Returns -1 in the parent, or in the child the socket to use. */
+  int j, child;
+
+  child= fork();
+  if (child < 0) { loge(ll_error,"Failed to fork acceptor"); return -1; }
+  if (child) { acceptortab[i].pid= child; return -1; }
+  mypid= getpid();
+  isacceptor= 1;
+  signal(SIGTERM,SIG_DFL);
+  for (j=0; j<acceptors; j++)
+    if (j != i) close(acceptortab[j].master);
+  return acceptortab[i].master;
+}
+
+static void signalacceptors(int sig) {
+  int i;
+
+  for (i=0; i<acceptors; i++)
+    if (acceptortab[i].pid && kill(acceptortab[i].pid,sig))
+      loge(ll_error,"Failed to signal acceptor");
+}
+
+static int supervise(int master) {
+  /* Returns only in the acceptors, giving the socket to use. */
+  int masters[ACCEPTORS_MAX];
+  struct timeval timeout;
+  struct sigaction act;
+  long childstatpid;
+  int i, status;
+
+  acceptortab[0].master= master;
+  for (i=1; i<acceptors; i++) {
+    acceptortab[i].master= makemaster(1);
+    if (listen(acceptortab[i].master,backlog) < 0) {
+      loge(ll_fatal,"Failed to listen"); exit(1);
+    }
+    setnonblock(acceptortab[i].master,"Failed to set nonblocking on master socket");
+  }
+  for (i=0; i<acceptors; i++) masters[i]= acceptortab[i].master;
+
+  act.sa_handler= recordwantstop;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags= 0;
+  if (sigaction(SIGTERM,&act,0)) {
+    loge(ll_fatal,"Failed to set SIGTERM handler"); exit(1);
+  }
+  log(ll_trace,"Started, using port %d, with %d acceptors",port,acceptors);
+
+  for (;;) {
+    for (i=0; i<acceptors; i++) {
+      if (acceptortab[i].pid) continue;
+      master= startacceptor(i);
+      if (master >= 0) return master;
+    }
+    timeout.tv_sec= SUPERVISOR_TICK;
+    timeout.tv_usec= 0;
+    select(0,(void*)0,(void*)0,(void*)0,&timeout);
+    while ((childstatpid= waitpid(-1,&status,WNOHANG))>0) {
+      for (i=0; i<acceptors; i++) {
+        if (acceptortab[i].pid != childstatpid) continue;
+        log(ll_error,"Acceptor %ld died with code %d, restarting it",
+            childstatpid,status);
+        acceptortab[i].pid= 0;
+      }
+    }
+    if (debugserver != 1) reopenstderr();
+    if (wantstop) {
+      log(ll_trace,"Caught a SIGTERM, stopping acceptors");
+      signalacceptors(SIGTERM);
+      exit(0);
+    }
+    if (wantrestart) {
+      log(ll_trace,"Caught a SIGUSR2, restarting acceptors");
+      wantrestart= 0;
+      signalacceptors(SIGUSR2);
+    }
+    checkacceptq(masters,acceptors);
+  }
+}
+
 int main(int argc, char **argv) {
-  int master, child;
+  int master, child, waitfd;
   struct sockaddr_in sa;
   int cal, i, status, flags;
   unsigned long v;
@@ -2185,6 +6927,12 @@ int main(int argc, char **argv) {
   fd_set readfds;
   struct timeval timeout;
   long childstatpid;
+  struct ipentry *ip;
+  const char *why;
+  struct rusage ru;
+  long packdays= -1;
+  char *estr;
+  int unpack= 0, admitfd= -1;
 
   umask(umask(0777) | UMASK_ADD);
   mypid= getpid();
@@ -2206,12 +6954,134 @@ int main(int argc, char **argv) {
         exit(2);
       }
       port= atoi(*argv);
+    } else if (!strcmp(*argv,"-pool")) {
+      if (!argv[1] || !argv[2]) {
+        fputs("groggsd: USAGE -pool needs minimum and maximum idle workers\n",stderr);
+        exit(2);
+      }
+      poolmin= atoi(*++argv);
+      poolmax= atoi(*++argv);
+      if (poolmin < 1 || poolmax < poolmin) {
+        fputs("groggsd: USAGE -pool needs 1 <= minimum <= maximum\n",stderr);
+        exit(2);
+      }
+    } else if (!strcmp(*argv,"-multiplex")) {
+      multiplex= 1;
+    } else if (!strcmp(*argv,"-acceptors")) {
+      if (!*++argv) {
+        fputs("groggsd: USAGE No number after -acceptors\n",stderr);
+        exit(2);
+      }
+      acceptors= atoi(*argv);
+      if (acceptors < 1 || acceptors > ACCEPTORS_MAX) {
+        fprintf(stderr,"groggsd: USAGE -acceptors must be 1 to %d\n",ACCEPTORS_MAX);
+        exit(2);
+      }
+    } else if (!strcmp(*argv,"-acceptor")) {
+      if (!*++argv) {
+        fputs("groggsd: USAGE No pid after -acceptor\n",stderr);
+        exit(2);
+      }
+      isacceptor= 1;
+      daemonpid= atol(*argv);
+    } else if (!strcmp(*argv,"-park")) {
+      if (!*++argv) {
+        fputs("groggsd: USAGE No time after -park\n",stderr);
+        exit(2);
+      }
+      parktime= atoi(*argv);
+      if (parktime < 1) {
+        fputs("groggsd: USAGE -park time must be positive\n",stderr);
+        exit(2);
+      }
+    } else if (!strcmp(*argv,"-backlog")) {
+      if (!*++argv) {
+        fputs("groggsd: USAGE No length after -backlog\n",stderr);
+        exit(2);
+      }
+      backlog= atoi(*argv);
+      if (backlog < 1) {
+        fputs("groggsd: USAGE -backlog must be positive\n",stderr);
+        exit(2);
+      }
+    } else if (!strcmp(*argv,"-maxsessions") || !strcmp(*argv,"-maxperip")) {
+      if (!argv[1]) {
+        fprintf(stderr,"groggsd: USAGE No number after %s\n",*argv);
+        exit(2);
+      }
+      i= atoi(argv[1]);
+      if (i < 1) {
+        fprintf(stderr,"groggsd: USAGE %s must be positive\n",*argv);
+        exit(2);
+      }
+      if (!strcmp(*argv,"-maxsessions")) maxsessions= i; else maxperip= i;
+      argv++;
+    } else if (!strcmp(*argv,"-rate") || !strcmp(*argv,"-iprate")) {
+      if (!argv[1] || !argv[2]) {
+        fprintf(stderr,"groggsd: USAGE %s needs connections per second and burst\n",*argv);
+        exit(2);
+      }
+      if (atof(argv[1]) <= 0 || atof(argv[2]) < 1) {
+        fprintf(stderr,"groggsd: USAGE %s needs rate > 0 and burst >= 1\n",*argv);
+        exit(2);
+      }
+      if (!strcmp(*argv,"-rate")) {
+        rate= atof(argv[1]); rateburst= atof(argv[2]);
+        ratebucket.tokens= rateburst;
+      } else {
+        iprate= atof(argv[1]); iprateburst= atof(argv[2]);
+      }
+      argv+= 2;
+    } else if (!strcmp(*argv,"-packitems")) {
+      if (!*++argv) {
+        fputs("groggsd: USAGE No number of days after -packitems\n",stderr);
+        exit(2);
+      }
+      packdays= strtol(*argv,&estr,10);
+      if (estr == *argv || *estr || packdays < 0) {
+        fputs("groggsd: USAGE -packitems days must be a number, not negative\n",stderr);
+        exit(2);
+      }
+    } else if (!strcmp(*argv,"-unpackitems")) {
+      unpack= 1;
+    } else if (!strcmp(*argv,"-admitstate")) {
+      if (!*++argv) {
+        fputs("groggsd: USAGE No fd number after -admitstate\n",stderr);
+        exit(2);
+      }
+      admitfd= atoi(*argv);
     } else {
       fprintf(stderr,"groggsd: INITERROR Unknown option `%s'\n",*argv);
       exit(2);
     }
   }
 
+  if (poolmin && multiplex) {
+    fputs("groggsd: USAGE -pool and -multiplex are mutually exclusive\n",stderr);
+    exit(2);
+  }
+  if (poolmin && (maxsessions || maxperip || rate || iprate)) {
+    fputs("groggsd: USAGE -pool workers accept for themselves; can't limit admissions\n",stderr);
+    exit(2);
+  }
+  if (parktime && (maxsessions || maxperip)) {
+    fputs("groggsd: USAGE -park hands sessions to the parking process; can't limit sessions\n",stderr);
+    exit(2);
+  }
+  if (parktime && multiplex) {
+    fputs("groggsd: USAGE -park is for forked sessions, not -multiplex\n",stderr);
+    exit(2);
+  }
+  if (acceptors && master>=0) {
+    fputs("groggsd: USAGE -acceptors makes its own sockets; can't use -master\n",stderr);
+    exit(2);
+  }
+  if (packdays >= 0 && unpack) {
+    fputs("groggsd: USAGE -packitems and -unpackitems are mutually exclusive\n",stderr);
+    exit(2);
+  }
+  if (!isacceptor) daemonpid= mypid;
+
   if (!debugserver) {
     setvbuf(stderr,0,_IOFBF,512);
     if (chdir(SPOOL_DIR)) {
@@ -2221,21 +7091,12 @@ int main(int argc, char **argv) {
   }
   if (debugserver != 1) reopenstderr();
 
+  if (packdays >= 0) { packitems(packdays); exit(0); }
+  if (unpack) { unpackitems(); exit(0); }
+  if (admitfd != -1) admitload(admitfd);
+
   if (master<0) {
-    master= socket(AF_INET,SOCK_STREAM,0);
-    if (master<0) {
-      perror("groggsd: Fatal error! Failed to create socket"); exit(1);
-    }
-    memset(&sa,0,sizeof(sa));
-    sa.sin_family= AF_INET;
-    for (;;) {
-      sa.sin_port= htons(port);
-      if (bind(master,(struct sockaddr*)&sa,sizeof(sa)) >=0) break;
-      if (errno != EADDRINUSE || debugserver != 1) {
-        loge(ll_fatal,"Failed to bind"); exit(1);
-      }
-      port++;
-    }
+    master= makemaster(acceptors>0);
   } else {
     cal= sizeof(sa);
     errno=0;
@@ -2244,7 +7105,7 @@ int main(int argc, char **argv) {
     }
     port= ntohs(sa.sin_port);
   }
-  if (listen(master,3) < 0) { loge(ll_fatal,"Failed to listen"); exit(1); }
+  if (listen(master,backlog) < 0) { loge(ll_fatal,"Failed to listen"); exit(1); }
 
   v= getpid(); i=32;
   act.sa_handler= SIG_DFL;
@@ -2280,27 +7141,63 @@ int main(int argc, char **argv) {
     loge(ll_fatal,"Failed fcntl SETFL on master socket"); exit(1);
   }
 
-  log(ll_trace,"Started, using port %d",port);
+  mirrorinit();
+  xrefinit();
+  metainit();
+  if (acceptors) master= supervise(master);
+  if (!multiplex) {
+    if (pipe(statspipe)) { loge(ll_fatal,"Failed to create accounting pipe"); exit(1); }
+    setcloexec(statspipe[0],"Failed to set close-on-exec on accounting pipe");
+    setcloexec(statspipe[1],"Failed to set close-on-exec on accounting pipe");
+    setnonblock(statspipe[0],"Failed to set nonblocking on accounting pipe");
+    setnonblock(statspipe[1],"Failed to set nonblocking on accounting pipe");
+  }
+  if (parktime) startparker(master);
+
+  if (poolmin) {
+    poolinit();
+    log(ll_trace,"Started, using port %d, keeping %d-%d idle workers",
+        port,poolmin,poolmax);
+  } else if (multiplex) {
+    log(ll_trace,"Started, using port %d, multiplexing sessions",port);
+    engine(master);
+  } else {
+    log(ll_trace,"Started, using port %d",port);
+  }
 
   for (;;) {
-    timeout.tv_sec= 3600*2;
+    timeout.tv_sec= poolmin ? POOL_TICK : parktime ? PARK_TICK : 3600*2;
     timeout.tv_usec= 0;
-    FD_ZERO(&readfds); FD_SET(master,&readfds);
-    i= select(master+1,&readfds,(void*)0,(void*)0,&timeout);
+    waitfd= poolmin ? reportpipe[0] : master;
+    FD_ZERO(&readfds); FD_SET(waitfd,&readfds); FD_SET(statspipe[0],&readfds);
+    i= select((waitfd > statspipe[0] ? waitfd : statspipe[0])+1,
+              &readfds,(void*)0,(void*)0,&timeout);
     if (i<0 && errno!=EINTR) { loge(ll_fatal ,"Failed to select"); exit(1); }
-    while ((childstatpid= waitpid(-1,&status,WNOHANG))>0)
+    statsreadreports();
+    while ((childstatpid= wait4(-1,&status,WNOHANG,&ru))>0) {
+      if (poolmin) poolreaped(childstatpid,status);
+      admitreaped(childstatpid);
+      if (childstatpid == parkerpid) {
+        log(ll_error,"Parking process %ld died with code %d, restarting it",
+            childstatpid,status);
+        startparker(master);
+        continue;
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        statsunreported(childstatpid,status,&ru);
       if (WIFEXITED(status) ? WEXITSTATUS(status) :
           WIFSIGNALED(status) ? WTERMSIG(status)!=SIGPIPE : 1)
         log(ll_error,"Subprocess %ld failed with code %d\n",childstatpid,status);
+    }
     if (debugserver != 1) reopenstderr();
-    if (wantrestart) {
-      char buf[10]; sprintf(buf,"%d",master);
-      log(ll_trace,"Caught a SIGUSR2, restarting ...");
-      execl(DAEMON_PROGRAM,DAEMON_PROGRAM,"-master",buf,
-            debugserver>0 ? "-debug" : (const char*)0,
-            debugserver>1 ? "-debug" : (const char*)0,
-            (const char*)0);
-      loge(ll_error,"Failed to exec replacement daemon");
+    if (!isacceptor) checkacceptq(&master,1);
+    admitlog();
+    statslog();
+    if (wantrestart) restart(master);
+    if (poolmin) {
+      poolreadreports();
+      poolmaintain(master);
+      continue;
     }
     cal= sizeof(calleraddr);
     slave= accept(master,(struct sockaddr*)&calleraddr,&cal);
@@ -2315,14 +7212,21 @@ int main(int argc, char **argv) {
                    "Calling address malformatted\r\n",59);
       exit(1);
     }
+    if (!admit(calleraddr.sin_addr,&ip,&why)) {
+      write(slave,why,strlen(why));
+      close(slave); continue;
+    }
     servseq++;
     child= fork();
     if (child < 0) {
       loge(ll_error,"Failed to fork");
       write(slave,"484 Server system error: Failed to fork\r\n",41);
+      admitdone(ip);
       close(slave);
     } else if (child == 0) {
       close(master); server();
+    } else {
+      admitchild(child,ip);
     }
     close(slave);
   }
@@ -0,0 +1,244 @@
+/*
+ * Distributed GROGGS  Copyright (C)1993 Ian Jackson
+ *
+ * Index scanner
+ *
+ *
+ * This is free software; may redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is made available in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License can be found in the top-
+ * level src directory.  Alternatively could write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "ehandle.h"
+#include "misc.h"
+#include "indexscan.h"
+
+static struct indexquery query;
+static int countonly;
+static long nmatches;
+
+static void usage(const char *fmt, ...) {
+  va_list ap;
+
+  if (fmt) {
+    va_start(ap,fmt);
+    vfprintf(stderr,fmt,ap);
+    va_end(ap);
+    fputs("\n\n",stderr);
+  }
+  if (!
+      fputs("Usage:\n"
+            "  idxscan [-c] [query] [spooldir]\n"
+            "  idxscan -b [query] indexfile\n"
+            "  idxscan -g entries indexfile\n"
+            "Query:\n"
+            "   -i itemid\n"
+            "   -u userid\n"
+            "   -t type\n"
+            "   -s hexseq[-hexseq]\n"
+            "Options:\n"
+            "   -c     count matching entries instead of listing them\n"
+            "   -b     time the scan against the plain loop\n"
+            "   -g     generate a test index\n", stderr))
+    ohshite("Failed to write usage message to stderr");
+  exit(fmt ? 2 : 0);
+}
+
+static const char *mapfile(int fd, const char *name, long *nr) {
+  /* Maps the entries in the file open on fd; returns 0 if there are none. */
+  struct stat stab;
+  void *p;
+
+  if (fstat(fd,&stab)) ohshite("Failed to stat %s",name);
+  if (stab.st_size % INDEXENTRY_LENINF)
+    ohshit("%s corrupt - invalid length %ld",name,(long)stab.st_size);
+  *nr= stab.st_size / INDEXENTRY_LENINF;
+  if (!*nr) return 0;
+  p= mmap(0,stab.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if (p == MAP_FAILED) ohshite("Failed to map %s",name);
+  return p;
+}
+
+static void scanfile(int fd, const char *name) {
+  const char *recs;
+  long n, m, i, *matches;
+
+  recs= mapfile(fd,name,&n);
+  if (!recs) return;
+  matches= countonly ? 0 : malloc(n*sizeof(*matches));
+  if (!countonly && !matches) ohshite("No memory to scan %s",name);
+  m= indexscan(recs,n,&query,matches);
+  for (i=0; !countonly && i<m; i++)
+    if (fwrite(recs+matches[i]*INDEXENTRY_LENINF,INDEXENTRY_LENINF,1,stdout) != 1)
+      ohshite("Write error");
+  nmatches+= m;
+  free(matches);
+  munmap((void*)recs,n*INDEXENTRY_LENINF);
+}
+
+static void scanspool(void) {
+  /* Scans the sealed segments, in the manifest's order, and then the
+   * head, with the index locked as the daemon would. */
+  char name[INDEXSEG_MAXFILENAMELEN+5];
+  FILE *index, *manifest;
+  long num, records;
+  int fd, r;
+
+  index= fopen(INDEX_FILENAME,"r");
+  if (!index) ohshite("Index inaccessible");
+  makelock(index,F_RDLCK,INDEX_FILENAME);
+  manifest= fopen(INDEXSEG_MANIFEST,"r");
+  if (!manifest && errno != ENOENT) ohshite("Failed to open " INDEXSEG_MANIFEST);
+  while (manifest) {
+    r= fscanf(manifest,"%lx %ld %*x %*x %*x %*x\n",&num,&records);
+    if (r == EOF && !ferror(manifest)) break;
+    if (r != 2) ohshite("Failed to read " INDEXSEG_MANIFEST);
+    sprintf(name,"%s%08lX",INDEXSEG_DIR,num);
+    fd= open(name,O_RDONLY);
+    if (fd == -1) ohshite("Index segment %s inaccessible",name);
+    scanfile(fd,name);
+    close(fd);
+  }
+  if (manifest) fclose(manifest);
+  scanfile(fileno(index),INDEX_FILENAME);
+  if (ufclose(index,INDEX_FILENAME)) ohshite("Failed to close index");
+}
+
+static void generate(long n, const char *filename) {
+  /* Writes n made-up entries, formatted as indexentry would. */
+  static const char types[]= "RRRRRRRRIRRRCRRE";
+  char buf[INDEXENTRY_LENINF+5], user[30];
+  FILE *file;
+  long i;
+
+  file= fopen(filename,"w");
+  if (!file) ohshite("Failed to create %s",filename);
+  for (i=0; i<n; i++) {
+    sprintf(buf,"%08lX %08lX",i,0x30000000L+i*7);
+    memset(buf+17,' ',INDEXENTRY_LENINF-17-1);
+    sprintf(buf+18,"A%07ld",(i*7919) % 100000); buf[18+ITEMID_LEN]= ' ';
+    sprintf(user,"user%ld@example.org",(i*31) % 2000);
+    memcpy(buf+19+ITEMID_LEN,user,strlen(user));
+    buf[20+ITEMID_LEN+USERID_MAXLEN]= types[i % (sizeof(types)-1)];
+    sprintf(buf+22+ITEMID_LEN+USERID_MAXLEN,"Generated entry %ld",i);
+    buf[strlen(buf)]= ' ';
+    buf[INDEXENTRY_LENINF-1]= '\n';
+    if (fwrite(buf,INDEXENTRY_LENINF,1,file) != 1) ohshite("Failed to write %s",filename);
+  }
+  if (fclose(file)) ohshite("Failed to write %s",filename);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void bench(const char *filename) {
+  /* Times indexscan against indexscan_plain; the best of three runs each. */
+  long (*const scanners[2])(const char*, long, const struct indexquery*, long*)=
+    { indexscan_plain, indexscan };
+  static const char *const names[2]= { "plain", "indexscan" };
+  const char *recs;
+  long n, m, *matches;
+  double t, best;
+  int fd, s, run;
+
+  fd= open(filename,O_RDONLY);
+  if (fd == -1) ohshite("Failed to open %s",filename);
+  recs= mapfile(fd,filename,&n);
+  if (!recs) ohshit("%s is empty",filename);
+  matches= malloc(n*sizeof(*matches));
+  if (!matches) ohshite("No memory for matches");
+  indexscan(recs,n,&query,0); /* fault it all in */
+  for (s=0; s<2; s++) {
+    best= 0; m= 0;
+    for (run=0; run<3; run++) {
+      t= now();
+      m= scanners[s](recs,n,&query,matches);
+      t= now()-t;
+      if (!run || t < best) best= t;
+    }
+    printf("%-10s %ld entries, %ld matches, %.3fs, %.0f Mbyte/s\n",
+           names[s],n,m,best,n*(double)INDEXENTRY_LENINF/best/1e6);
+  }
+  if (ferror(stdout)) ohshite("Write error");
+  free(matches);
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  long generatecount= -1;
+  int c, benchmark= 0;
+  char *ep;
+
+  indexscan_init(&query);
+  while ((c= getopt(argc,argv,"ci:u:t:s:bg:")) != -1) {
+    switch (c) {
+    case 'c':
+      countonly= 1; break;
+    case 'i':
+      if (strlen(optarg) != ITEMID_LEN) usage("item-ID must be %d characters",ITEMID_LEN);
+      indexscan_item(&query,optarg); break;
+    case 'u':
+      if (!*optarg || strlen(optarg) > USERID_MAXLEN) usage("userid is empty or too long");
+      indexscan_user(&query,optarg); break;
+    case 't':
+      if (strlen(optarg) != 1) usage("type must be one character");
+      query.type= *optarg; break;
+    case 's':
+      query.seqfrom= strtoul(optarg,&ep,16);
+      query.seqto= *ep == '-' ? strtoul(ep+1,&ep,16) : query.seqfrom;
+      if (*ep) usage("sequence range must be hex[-hex]");
+      break;
+    case 'b':
+      benchmark= 1; break;
+    case 'g':
+      generatecount= strtol(optarg,&ep,10);
+      if (*ep || generatecount < 0) usage("-g needs a number of entries");
+      break;
+    default:
+      usage(optopt == '?' ? 0 : "unknown option");
+    }
+  }
+  argv+= optind; argc-= optind;
+
+  if (generatecount >= 0) {
+    if (argc != 1) usage("-g needs an index file to write");
+    generate(generatecount,argv[0]);
+  } else if (benchmark) {
+    if (argc != 1) usage("-b needs an index file to read");
+    bench(argv[0]);
+  } else {
+    if (argc > 1) usage("too many arguments");
+    if (argc && chdir(argv[0])) ohshite("Failed to change to %s",argv[0]);
+    scanspool();
+    if (countonly) printf("%ld\n",nmatches);
+  }
+  if (fflush(stdout)) ohshite("Write error");
+  return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Distributed GROGGS  Copyright (C)1993 Ian Jackson
+ *
+ * Index scanning
+ *
+ *
+ * This is free software; may redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is made available in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License can be found in the top-
+ * level src directory.  Alternatively could write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Some questions about the index can only be answered by looking at
+ * every entry, so this looks at each as cheaply as it can.  The fields
+ * are at fixed offsets, so each test is a few wide loads and compares
+ * rather than a memcmp: the item-ID is one 64-bit word, the userid
+ * five SSE2 compares (or ten words without SSE2), and the sequence
+ * number is decoded eight hex digits at once.  The cheapest tests go
+ * first so most entries are rejected after one or two loads.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "indexscan.h"
+
+#define SEQ_OFFSET   0
+#define ITEM_OFFSET  18
+#define USER_OFFSET  (19+ITEMID_LEN)
+#define TYPE_OFFSET  (20+ITEMID_LEN+USERID_MAXLEN)
+
+#if USERID_MAXLEN < 16
+#error USERID_MAXLEN is too short for indexscan
+#endif
+
+void indexscan_init(struct indexquery *q) {
+  memset(q,0,sizeof(*q));
+  q->seqfrom= 0;
+  q->seqto= ULONG_MAX;
+}
+
+void indexscan_item(struct indexquery *q, const char *itemid) {
+  memcpy(q->itemid,itemid,ITEMID_LEN);
+  q->useitemid= 1;
+}
+
+void indexscan_user(struct indexquery *q, const char *userid) {
+  size_t l;
+
+  l= strlen(userid);
+  if (l > USERID_MAXLEN) l= USERID_MAXLEN;
+  memset(q->userid,' ',USERID_MAXLEN);
+  memcpy(q->userid,userid,l);
+  q->useuserid= 1;
+}
+
+static uint64_t load64(const char *p) {
+  uint64_t v;
+
+  memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static unsigned long hex8(const char *p) {
+  /* Decodes the 8 hex digits at p.  Letters have 0x40 set, and their
+   * low nibbles are 9 less than their values. */
+  uint64_t v;
+
+  v= load64(p);
+  v= (v & 0x0f0f0f0f0f0f0f0fULL) + ((v & 0x4040404040404040ULL) >> 6) * 9;
+  v= ((v << 4) | (v >> 8)) & 0x00ff00ff00ff00ffULL;
+  v= ((v << 8) | (v >> 16)) & 0x0000ffff0000ffffULL;
+  return ((v << 16) | (v >> 32)) & 0xffffffffULL;
+}
+#else
+static unsigned long hex8(const char *p) {
+  char buf[9];
+
+  memcpy(buf,p,8); buf[8]= 0;
+  return strtoul(buf,0,16);
+}
+#endif
+
+static int itemeq(const char *a, const char *b) {
+#if ITEMID_LEN == 8
+  return load64(a) == load64(b);
+#else
+  return !memcmp(a,b,ITEMID_LEN);
+#endif
+}
+
+static int usereq(const char *a, const char *b) {
+#ifdef __SSE2__
+  __m128i eq;
+  int i;
+
+  eq= _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a),
+                     _mm_loadu_si128((const __m128i*)b));
+  for (i=16; i<USERID_MAXLEN-16; i+=16)
+    eq= _mm_and_si128(eq,_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i)),
+                                        _mm_loadu_si128((const __m128i*)(b+i))));
+  eq= _mm_and_si128(eq,_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i*)(a+USERID_MAXLEN-16)),
+        _mm_loadu_si128((const __m128i*)(b+USERID_MAXLEN-16))));
+  return _mm_movemask_epi8(eq) == 0xffff;
+#else
+  uint64_t diff;
+  int i;
+
+  diff= 0;
+  for (i=0; i<USERID_MAXLEN-8; i+=8) diff|= load64(a+i) ^ load64(b+i);
+  diff|= load64(a+USERID_MAXLEN-8) ^ load64(b+USERID_MAXLEN-8);
+  return !diff;
+#endif
+}
+
+long indexscan(const char *recs, long n, const struct indexquery *q, long *matches) {
+  const char *rec;
+  unsigned long seq;
+  long i, m;
+  int useseq;
+
+  useseq= q->seqfrom > 0 || q->seqto < ULONG_MAX;
+  for (i=0, m=0, rec=recs; i<n; i++, rec+=INDEXENTRY_LENINF) {
+    if (q->type && rec[TYPE_OFFSET] != q->type) continue;
+    if (q->useitemid && !itemeq(rec+ITEM_OFFSET,q->itemid)) continue;
+    if (useseq) {
+      seq= hex8(rec+SEQ_OFFSET);
+      if (seq < q->seqfrom || seq > q->seqto) continue;
+    }
+    if (q->useuserid && !usereq(rec+USER_OFFSET,q->userid)) continue;
+    if (matches) matches[m]= i;
+    m++;
+  }
+  return m;
+}
+
+long indexscan_plain(const char *recs, long n, const struct indexquery *q, long *matches) {
+  char buf[9];
+  const char *rec;
+  unsigned long seq;
+  long i, m;
+
+  for (i=0, m=0; i<n; i++) {
+    rec= recs + i*INDEXENTRY_LENINF;
+    if (q->useitemid && memcmp(rec+ITEM_OFFSET,q->itemid,ITEMID_LEN)) continue;
+    if (q->useuserid && memcmp(rec+USER_OFFSET,q->userid,USERID_MAXLEN)) continue;
+    if (q->type && rec[TYPE_OFFSET] != q->type) continue;
+    memcpy(buf,rec+SEQ_OFFSET,8); buf[8]= 0;
+    seq= strtoul(buf,0,16);
+    if (seq < q->seqfrom || seq > q->seqto) continue;
+    if (matches) matches[m]= i;
+    m++;
+  }
+  return m;
+}
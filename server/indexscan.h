@@ -0,0 +1,51 @@
+/*
+ * Distributed GROGGS  Copyright (C)1993 Ian Jackson
+ *
+ * Index scanning
+ *
+ *
+ * This is free software; may redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is made available in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License can be found in the top-
+ * level src directory.  Alternatively could write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef INDEXSCAN_H
+#define INDEXSCAN_H
+
+#include "config.h"
+
+/* Entries are INDEXENTRY_LENINF long and must be well-formed: the
+ * sequence number in hex at 0, the item-ID at 18, the userid padded
+ * with spaces at 19+ITEMID_LEN and the type at 20+ITEMID_LEN+USERID_MAXLEN,
+ * as indexentry writes them. */
+
+struct indexquery {
+  int useitemid, useuserid;
+  char itemid[ITEMID_LEN];
+  char userid[USERID_MAXLEN];       /* padded with spaces */
+  int type;                         /* 0 for any */
+  unsigned long seqfrom, seqto;     /* inclusive */
+};
+
+void indexscan_init(struct indexquery *q);
+void indexscan_item(struct indexquery *q, const char *itemid);
+void indexscan_user(struct indexquery *q, const char *userid);
+
+long indexscan(const char *recs, long n, const struct indexquery *q, long *matches);
+/* Stores the numbers of the entries among the n at recs that match
+ * q in matches (if it isn't 0), in order; returns how many. */
+
+long indexscan_plain(const char *recs, long n, const struct indexquery *q, long *matches);
+/* The same, a field at a time with memcmp and strtoul; for comparison. */
+
+#endif
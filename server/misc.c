@@ -37,6 +37,43 @@
 
 #define FCNTL_LOCKING
 
+/* Files we've locked and not yet unlocked, so that unlockall can
+ * tidy up after a command which is abandoned half way through. */
+#define LOCKED_MAX 10
+static FILE *locked[LOCKED_MAX];
+
+static void addlocked(FILE *file) {
+  int i;
+
+  for (i=0; i<LOCKED_MAX; i++)
+    if (!locked[i]) { locked[i]= file; return; }
+  ohshit("Too many files locked at once");
+}
+
+static void droplocked(FILE *file) {
+  int i;
+
+  for (i=0; i<LOCKED_MAX; i++)
+    if (locked[i] == file) locked[i]= 0;
+}
+
+void holdfile(FILE *file) {
+  /* For a file we haven't locked but which unlockall should close
+   * all the same; give it back with ufclose as usual. */
+  addlocked(file);
+}
+
+void unlockall(void) {
+  int i;
+  FILE *file;
+
+  for (i=0; i<LOCKED_MAX; i++) {
+    if (!(file= locked[i])) continue;
+    unlock(file,"(abandoned)");
+    fclose(file);
+  }
+}
+
 #ifdef FCNTL_LOCKING
 
 void makelock(FILE *file, int type, const char *filename) {
@@ -50,7 +87,7 @@ void makelock(FILE *file, int type, const char *filename) {
     fl.l_whence= SEEK_SET;
     fl.l_start= 0;
     fl.l_len= 1;
-    if (fcntl(fileno(file),F_SETLKW,&fl) != -1) return;
+    if (fcntl(fileno(file),F_SETLKW,&fl) != -1) { addlocked(file); return; }
     if (errno != EINTR) ohshite("Failed to lock %s (%s)",
                                 filename,
                                 type==F_RDLCK ? "read" :
@@ -80,7 +117,7 @@ void makelock(FILE *file, int type, const char *filename) {
     }
     /* check whether it's worked */
     stat(filename,&sbuf);
-    if (sbuf.st_nlink==2) return;
+    if (sbuf.st_nlink==2) { addlocked(file); return; }
     if (sbuf.st_nlink>2) unlink(tbuff); /* remove the attempted lock... */
     sleep(1); /* block */
   }
@@ -93,6 +130,7 @@ void unlock(FILE *file, const char *filename) {
 
   /* no need to actually remove the lock in this situation */
 
+  droplocked(file);
 }
 
 #else
@@ -107,6 +145,7 @@ void unlock(FILE *file, const char *filename) {
   char hbuff[100], tbuff[1024];
   pid_t mypid;
   
+  droplocked(file);
   gethostname(hbuff,sizeof(hbuff));
   mypid=getpid();
   sprintf(tbuff,"%s.lock.%s.%i",filename,hbuff,mypid);
@@ -30,6 +30,8 @@ union longword { unsigned long ul; unsigned char uc[4]; };
 void makelock(FILE*, int type, const char *filename);
 void unlock(FILE*, const char *filename);
 int ufclose(FILE*, const char *filename);
+void holdfile(FILE*); /* so that unlockall closes it too */
+void unlockall(void); /* closes every file still locked */
 
 int scanhex(char **cmdp, int n, unsigned char *dest);
 void sendhex(const unsigned char *p, int n);